@@ -12,23 +12,70 @@
  *******************************************************************************/
 #include <debug.h>
 
-static uint8_t  p_us = 0;
-static uint16_t p_ms = 0;
+static uint32_t p_us = 0;
+static uint32_t p_ms = 0;
+static uint32_t usart_baud = 115200;
 
 #define DEBUG_DATA0_ADDRESS  ((volatile uint32_t*)0xE00000F4)
 #define DEBUG_DATA1_ADDRESS  ((volatile uint32_t*)0xE00000F8)
 
+#if (SDI_PRINT == SDI_PR_CLOSE) && (DEBUG_TX == DEBUG_TX_DMA)
+#define DEBUG_TX_MASK  (DEBUG_TX_BUF_SIZE - 1)
+
+static uint8_t  tx_buf[DEBUG_TX_BUF_SIZE];
+static volatile uint16_t tx_head = 0;     /* free running write index */
+static volatile uint16_t tx_tail = 0;     /* free running index of the oldest unsent byte */
+static volatile uint16_t tx_dma_len = 0;  /* bytes owned by the DMA, 0 when idle */
+static uint8_t  tx_policy = DEBUG_TX_FULL;
+static uint32_t tx_dropped = 0;
+
+void DMA1_Channel4_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+#endif
+
+#if (SDI_PRINT == SDI_PR_OPEN) && (SDI_TX == SDI_TX_RING)
+#define SDI_TX_MASK  (SDI_TX_BUF_SIZE - 1)
+
+static uint8_t  sdi_buf[SDI_TX_BUF_SIZE];
+static uint16_t sdi_head = 0;       /* free running write index */
+static uint16_t sdi_tail = 0;       /* free running index of the oldest unsent byte */
+static uint16_t sdi_last_head = 0;  /* sdi_head at the previous poll */
+static uint32_t sdi_dropped = 0;
+#endif
+
 /*********************************************************************
  * @fn      Delay_Init
  *
  * @brief   Initializes Delay Funcation.
+ *          SysTick runs free from HCLK and is never stopped or
+ *          reloaded, so SysTick->CNT doubles as a cycle counter for
+ *          timestamps and profiling. Called again after a clock
+ *          switch to rescale the delays.
  *
  * @return  none
  */
 void Delay_Init(void)
 {
-    p_us = SystemCoreClock / 8000000;
-    p_ms = (uint16_t)p_us * 1000;
+    p_us = SystemCoreClock / 1000000;
+    p_ms = p_us * 1000;
+
+    /* HCLK, count up, no auto reload; a compare interrupt enable is kept */
+    SysTick->CTLR |= (1 << 2) | (1 << 0);
+}
+
+/*********************************************************************
+ * @fn      Delay_Ticks
+ *
+ * @brief   Waits for the given number of SysTick counts.
+ *
+ * @param   ticks - HCLK cycles.
+ *
+ * @return  None
+ */
+static void Delay_Ticks(uint32_t ticks)
+{
+    uint32_t start = SysTick->CNT;
+
+    while((SysTick->CNT - start) < ticks);
 }
 
 /*********************************************************************
@@ -42,17 +89,7 @@ void Delay_Init(void)
  */
 void Delay_Us(uint32_t n)
 {
-    uint32_t i;
-
-    SysTick->SR &= ~(1 << 0);
-    i = (uint32_t)n * p_us;
-
-    SysTick->CMP = i;
-    SysTick->CNT = 0;
-    SysTick->CTLR |=(1 << 0);
-
-    while((SysTick->SR & (1 << 0)) != (1 << 0));
-    SysTick->CTLR &= ~(1 << 0);
+    Delay_Ticks(n * p_us);
 }
 
 /*********************************************************************
@@ -66,17 +103,14 @@ void Delay_Us(uint32_t n)
  */
 void Delay_Ms(uint32_t n)
 {
-    uint32_t i;
-
-    SysTick->SR &= ~(1 << 0);
-    i = (uint32_t)n * p_ms;
-
-    SysTick->CMP = i;
-    SysTick->CNT = 0;
-    SysTick->CTLR |=(1 << 0);
-
-    while((SysTick->SR & (1 << 0)) != (1 << 0));
-    SysTick->CTLR &= ~(1 << 0);
+    while(n--)
+    {
+#if (SDI_PRINT == SDI_PR_OPEN) && (SDI_TX == SDI_TX_RING)
+        /* Idle time, let the debugger have a packet every millisecond */
+        SDI_Printf_Poll();
+#endif
+        Delay_Ticks(p_ms);
+    }
 }
 
 /*********************************************************************
@@ -130,17 +164,230 @@ void USART_Printf_Init(uint32_t baudrate)
 
 #endif
 
+    usart_baud = baudrate;
     USART_InitStructure.USART_BaudRate = baudrate;
     USART_InitStructure.USART_WordLength = USART_WordLength_8b;
     USART_InitStructure.USART_StopBits = USART_StopBits_1;
     USART_InitStructure.USART_Parity = USART_Parity_No;
     USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
-    USART_InitStructure.USART_Mode = USART_Mode_Tx;
+    USART_InitStructure.USART_Mode = USART_Mode_Tx | USART_Mode_Rx;
 
     USART_Init(USART1, &USART_InitStructure);
+
+#if (SDI_PRINT == SDI_PR_CLOSE) && (DEBUG_TX == DEBUG_TX_DMA)
+    {
+        DMA_InitTypeDef  DMA_InitStructure = {0};
+        NVIC_InitTypeDef NVIC_InitStructure = {0};
+
+        RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+        DMA_DeInit(DMA1_Channel4);
+        DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->DATAR;
+        DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)tx_buf;
+        DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+        DMA_InitStructure.DMA_BufferSize = 0;
+        DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+        DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+        DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+        DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+        DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+        DMA_Init(DMA1_Channel4, &DMA_InitStructure);
+        DMA_ITConfig(DMA1_Channel4, DMA_IT_TC, ENABLE);
+
+        NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel4_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init(&NVIC_InitStructure);
+
+        USART_DMACmd(USART1, USART_DMAReq_Tx, ENABLE);
+    }
+#endif
+
     USART_Cmd(USART1, ENABLE);
 }
 
+/*********************************************************************
+ * @fn      USART_Printf_Retime
+ *
+ * @brief   Recomputes the baud rate divider after a clock switch.
+ *          BRR holds PCLK2 / baud in 1/16ths, rounded to nearest.
+ *          Nothing to do in SDI mode.
+ *
+ * @return  None
+ */
+void USART_Printf_Retime(void)
+{
+#if (SDI_PRINT == SDI_PR_CLOSE)
+    USART1->BRR = (uint16_t)((SystemCoreClock + usart_baud / 2) / usart_baud);
+#endif
+}
+
+#if (SDI_PRINT == SDI_PR_CLOSE) && (DEBUG_TX == DEBUG_TX_DMA)
+/*********************************************************************
+ * @fn      USART_Tx_Kick
+ *
+ * @brief   Hands the next contiguous run of the TX ring to DMA1
+ *          Channel 4 if the channel is idle. Call with interrupts
+ *          disabled or from the DMA interrupt.
+ *
+ * @return  None
+ */
+static void USART_Tx_Kick(void)
+{
+    uint16_t start, len;
+
+    if((tx_dma_len != 0) || (tx_head == tx_tail))
+    {
+        return;
+    }
+
+    start = tx_tail & DEBUG_TX_MASK;
+    len = (uint16_t)(tx_head - tx_tail);
+    if(start + len > DEBUG_TX_BUF_SIZE)
+    {
+        len = DEBUG_TX_BUF_SIZE - start;
+    }
+
+    tx_dma_len = len;
+    DMA1_Channel4->CFGR &= ~DMA_CFGR1_EN;
+    DMA1_Channel4->MADDR = (uint32_t)&tx_buf[start];
+    DMA1_Channel4->CNTR = len;
+    DMA1_Channel4->CFGR |= DMA_CFGR1_EN;
+}
+
+/*********************************************************************
+ * @fn      USART_Tx_Service
+ *
+ * @brief   Retires a finished DMA transfer and starts the next one.
+ *          Call with interrupts disabled or from the DMA interrupt.
+ *
+ * @return  None
+ */
+static void USART_Tx_Service(void)
+{
+    if(DMA1->INTFR & DMA1_IT_TC4)
+    {
+        DMA1->INTFCR = DMA1_IT_TC4;
+        tx_tail += tx_dma_len;
+        tx_dma_len = 0;
+    }
+    USART_Tx_Kick();
+}
+
+/*********************************************************************
+ * @fn      DMA1_Channel4_IRQHandler
+ *
+ * @brief   USART1 TX DMA transfer complete.
+ *
+ * @return  None
+ */
+void DMA1_Channel4_IRQHandler(void)
+{
+    USART_Tx_Service();
+}
+
+/*********************************************************************
+ * @fn      USART_Tx_Wait
+ *
+ * @brief   Waits for the DMA to make progress. Services the channel by
+ *          polling as well, so it also works with interrupts disabled.
+ *
+ * @return  None
+ */
+static void USART_Tx_Wait(void)
+{
+    __disable_irq();
+    USART_Tx_Service();
+    __enable_irq();
+}
+#endif
+
+/*********************************************************************
+ * @fn      USART_Printf_SetFullPolicy
+ *
+ * @brief   Selects what printf does when the TX ring is full.
+ *
+ * @param   policy - DEBUG_TX_FULL_BLOCK, DEBUG_TX_FULL_DROP or
+ *                   DEBUG_TX_FULL_COUNT.
+ *
+ * @return  None
+ */
+void USART_Printf_SetFullPolicy(uint8_t policy)
+{
+#if (SDI_PRINT == SDI_PR_CLOSE) && (DEBUG_TX == DEBUG_TX_DMA)
+    tx_policy = policy;
+#else
+    (void)policy;
+#endif
+}
+
+/*********************************************************************
+ * @fn      USART_Printf_Flush
+ *
+ * @brief   Waits until every buffered byte has left the USART, or with
+ *          SDI printf until the debugger took the last packet. Gives up
+ *          on the debugger after SDI_FLUSH_MS without progress, so an
+ *          unattended board does not hang here.
+ *
+ * @return  None
+ */
+void USART_Printf_Flush(void)
+{
+#if (SDI_PRINT == SDI_PR_OPEN)
+    uint32_t start;
+#if (SDI_TX == SDI_TX_RING)
+    uint16_t tail;
+#endif
+#endif
+
+#if (DEBUG_PRINTF == DEBUG_PRINTF_NEWLIB)
+    fflush(stdout);
+#endif
+#if (SDI_PRINT == SDI_PR_OPEN)
+    start = SysTick->CNT;
+#if (SDI_TX == SDI_TX_RING)
+    while(sdi_head != sdi_tail)
+    {
+        tail = sdi_tail;
+        SDI_Printf_Poll();
+        if(sdi_tail != tail) start = SysTick->CNT;
+        else if((SysTick->CNT - start) >= SDI_FLUSH_MS * p_ms) return;
+    }
+#endif
+    while(*(DEBUG_DATA0_ADDRESS) != 0u)
+    {
+        if((SysTick->CNT - start) >= SDI_FLUSH_MS * p_ms) return;
+    }
+#else
+#if (DEBUG_TX == DEBUG_TX_DMA)
+    while(tx_head != tx_tail)
+    {
+        USART_Tx_Wait();
+    }
+#endif
+    while(USART_GetFlagStatus(USART1, USART_FLAG_TC) == RESET);
+#endif
+}
+
+/*********************************************************************
+ * @fn      USART_Printf_GetDropped
+ *
+ * @brief   Bytes discarded under DEBUG_TX_FULL_COUNT.
+ *
+ * @return  Dropped byte count.
+ */
+uint32_t USART_Printf_GetDropped(void)
+{
+#if (SDI_PRINT == SDI_PR_CLOSE) && (DEBUG_TX == DEBUG_TX_DMA)
+    return tx_dropped;
+#else
+    return 0;
+#endif
+}
+
 /*********************************************************************
  * @fn      SDI_Printf_Enable
  *
@@ -157,6 +404,86 @@ void SDI_Printf_Enable(void)
     Delay_Ms(1);
 }
 
+#if (SDI_PRINT == SDI_PR_OPEN)
+/*********************************************************************
+ * @fn      SDI_Put
+ *
+ * @brief   Posts one packet to the debugger mailbox, which must be
+ *          free. Only the len valid bytes of p are read.
+ *
+ * @param   p - Packet data.
+ *          len - 1 to 7 bytes.
+ *
+ * @return  None
+ */
+static void SDI_Put(const uint8_t *p, uint8_t len)
+{
+    uint32_t w[2] = {len, 0};
+    uint8_t i;
+
+    /* data0 holds the length and bytes 0-2, data1 bytes 3-6 */
+    for(i = 0; i < len; i++)
+    {
+        w[(i + 1) >> 2] |= (uint32_t)p[i] << (((i + 1) & 3) << 3);
+    }
+
+    *(DEBUG_DATA1_ADDRESS) = w[1];
+    *(DEBUG_DATA0_ADDRESS) = w[0];
+}
+#endif
+
+/*********************************************************************
+ * @fn      SDI_Printf_Poll
+ *
+ * @brief   Moves buffered output to the debugger while its mailbox is
+ *          free, never waits. Full 7 byte packets go first; a shorter
+ *          tail is only sent once no new output arrived since the
+ *          previous call, so bursts stay packed. Call it from the main
+ *          loop (not from interrupts, _write uses the same ring).
+ *
+ * @return  None
+ */
+void SDI_Printf_Poll(void)
+{
+#if (SDI_PRINT == SDI_PR_OPEN) && (SDI_TX == SDI_TX_RING)
+    uint8_t pkt[7];
+    uint16_t used;
+    uint8_t i, n;
+
+    while(*(DEBUG_DATA0_ADDRESS) == 0u)
+    {
+        used = (uint16_t)(sdi_head - sdi_tail);
+        if(used == 0) break;
+        if(used < 7 && sdi_head != sdi_last_head) break;
+
+        n = (used > 7) ? 7 : (uint8_t)used;
+        for(i = 0; i < n; i++)
+        {
+            pkt[i] = sdi_buf[(uint16_t)(sdi_tail + i) & SDI_TX_MASK];
+        }
+        SDI_Put(pkt, n);
+        sdi_tail += n;
+    }
+    sdi_last_head = sdi_head;
+#endif
+}
+
+/*********************************************************************
+ * @fn      SDI_Printf_GetDropped
+ *
+ * @brief   Bytes discarded because the SDI ring was full.
+ *
+ * @return  Dropped byte count.
+ */
+uint32_t SDI_Printf_GetDropped(void)
+{
+#if (SDI_PRINT == SDI_PR_OPEN) && (SDI_TX == SDI_TX_RING)
+    return sdi_dropped;
+#else
+    return 0;
+#endif
+}
+
 /*********************************************************************
  * @fn      _write
  *
@@ -172,38 +499,82 @@ int _write(int fd, char *buf, int size)
 {
     int i = 0;
     int writeSize = size;
-#if (SDI_PRINT == SDI_PR_OPEN)
-    do
+#if (SDI_PRINT == SDI_PR_OPEN) && (SDI_TX == SDI_TX_RING)
     {
+        uint16_t space = SDI_TX_BUF_SIZE - (uint16_t)(sdi_head - sdi_tail);
 
+        if(space < writeSize)
+        {
+            sdi_dropped += writeSize - space;
+            writeSize = space;
+        }
+        for(i = 0; i < writeSize; i++)
+        {
+            sdi_buf[(uint16_t)(sdi_head + i) & SDI_TX_MASK] = *buf++;
+        }
+        sdi_head += writeSize;
+
+        /* Push what the mailbox takes right now, the rest waits for a poll */
+        SDI_Printf_Poll();
+    }
+    /* Report everything as written, newlib would retry dropped bytes */
+    writeSize = size;
+
+#elif (SDI_PRINT == SDI_PR_OPEN)
+    while(writeSize)
+    {
         /**
          * data0  data1 8 bytes
          * data0 The lowest byte storage length, the maximum is 7
          *
          */
+        uint8_t n = (writeSize > 7) ? 7 : (uint8_t)writeSize;
 
         while( (*(DEBUG_DATA0_ADDRESS) != 0u))
         {
 
         }
 
-        if(writeSize>7)
-        {
-            *(DEBUG_DATA1_ADDRESS) = (*(buf+i+3)) | (*(buf+i+4)<<8) | (*(buf+i+5)<<16) | (*(buf+i+6)<<24);
-            *(DEBUG_DATA0_ADDRESS) = (7u) | (*(buf+i)<<8) | (*(buf+i+1)<<16) | (*(buf+i+2)<<24);
+        SDI_Put((const uint8_t *)buf + i, n);
+        i += n;
+        writeSize -= n;
+    }
+    writeSize = size;
 
-            i += 7;
-            writeSize -= 7;
-        }
-        else
+#elif (DEBUG_TX == DEBUG_TX_DMA)
+
+    while(writeSize)
+    {
+        uint16_t space = DEBUG_TX_BUF_SIZE - (uint16_t)(tx_head - tx_tail);
+
+        if(space == 0)
         {
-            *(DEBUG_DATA1_ADDRESS) = (*(buf+i+3)) | (*(buf+i+4)<<8) | (*(buf+i+5)<<16) | (*(buf+i+6)<<24);
-            *(DEBUG_DATA0_ADDRESS) = (writeSize) | (*(buf+i)<<8) | (*(buf+i+1)<<16) | (*(buf+i+2)<<24);
+            if(tx_policy == DEBUG_TX_FULL_BLOCK)
+            {
+                USART_Tx_Wait();
+                continue;
+            }
+            if(tx_policy == DEBUG_TX_FULL_COUNT)
+            {
+                tx_dropped += writeSize;
+            }
+            break;
+        }
 
-            writeSize = 0;
+        if(space > writeSize) space = writeSize;
+        for(i = 0; i < space; i++)
+        {
+            tx_buf[(uint16_t)(tx_head + i) & DEBUG_TX_MASK] = *buf++;
         }
+        writeSize -= space;
 
-    } while (writeSize);
+        __disable_irq();
+        tx_head += space;
+        USART_Tx_Kick();
+        __enable_irq();
+    }
+    /* Report everything as written, newlib would retry dropped bytes */
+    writeSize = size;
 
 #else
 
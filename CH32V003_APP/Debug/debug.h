@@ -19,6 +19,7 @@
 
 #include <ch32v00x.h>
 #include <stdio.h>
+#include "tinyfmt.h"
 
 /* UART Printf Definition */
 #define DEBUG_UART1_NoRemap   1  //Tx-PD5
@@ -39,11 +40,69 @@
 #define SDI_PRINT   SDI_PR_CLOSE
 #endif
 
+/* Printf Definition */
+#define DEBUG_PRINTF_NEWLIB   0  //newlib printf
+#define DEBUG_PRINTF_TINY     1  //printf() is TF_Printf(), see tinyfmt.h
+
+#ifndef DEBUG_PRINTF
+#define DEBUG_PRINTF   DEBUG_PRINTF_TINY
+#endif
+
+/* SDI Printf TX Definition */
+#define SDI_TX_BLOCK   0  //Wait for the debugger on every 7 byte packet
+#define SDI_TX_RING    1  //Ring buffer drained by SDI_Printf_Poll(), never waits
+
+#ifndef SDI_TX
+#define SDI_TX   SDI_TX_RING
+#endif
+
+/* SDI ring size, power of two. Bytes that do not fit are dropped and counted */
+#ifndef SDI_TX_BUF_SIZE
+#define SDI_TX_BUF_SIZE   128
+#endif
+
+/* USART_Printf_Flush stops waiting for the debugger after this long without a packet taken */
+#ifndef SDI_FLUSH_MS
+#define SDI_FLUSH_MS      10
+#endif
+
+/* UART Printf TX Definition */
+#define DEBUG_TX_POLL   0  //Wait for TC on every byte
+#define DEBUG_TX_DMA    1  //Ring buffer drained by DMA1 Channel 4
+
+#ifndef DEBUG_TX
+#define DEBUG_TX   DEBUG_TX_DMA
+#endif
+
+/* TX ring size in bytes, power of two */
+#ifndef DEBUG_TX_BUF_SIZE
+#define DEBUG_TX_BUF_SIZE   256
+#endif
+
+/* What _write does when the TX ring is full */
+#define DEBUG_TX_FULL_BLOCK   0  //Wait until the DMA frees enough space
+#define DEBUG_TX_FULL_DROP    1  //Discard what does not fit
+#define DEBUG_TX_FULL_COUNT   2  //Discard what does not fit and count it
+
+#ifndef DEBUG_TX_FULL
+#define DEBUG_TX_FULL   DEBUG_TX_FULL_BLOCK
+#endif
+
 void Delay_Init(void);
 void Delay_Us(uint32_t n);
 void Delay_Ms(uint32_t n);
 void USART_Printf_Init(uint32_t baudrate);
+void USART_Printf_Retime(void);
+void USART_Printf_SetFullPolicy(uint8_t policy);
+void USART_Printf_Flush(void);
+uint32_t USART_Printf_GetDropped(void);
 void SDI_Printf_Enable(void);
+void SDI_Printf_Poll(void);
+uint32_t SDI_Printf_GetDropped(void);
+
+#if (DEBUG_PRINTF == DEBUG_PRINTF_TINY)
+#define printf   TF_Printf
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,252 @@
+/*
+ * tinyfmt.c
+ *
+ *  Small printf replacement and binary log records, see tinyfmt.h.
+ *  Output is collected in a short buffer on the stack and handed to
+ *  _write() in chunks. Decimal conversion subtracts powers of ten, RV32EC
+ *  has no divide instruction and a libgcc division per digit costs more.
+ */
+
+#include "tinyfmt.h"
+
+extern int _write(int fd, char *buf, int size);
+
+#define TF_CHUNK   32
+
+typedef struct {
+    char buf[TF_CHUNK];
+    uint8_t n;
+    int total;
+} tf_out_t;
+
+static const uint32_t tf_pow10[9] = {
+    1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10
+};
+
+static const char tf_hex[2][16] = {
+    { '0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f' },
+    { '0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F' },
+};
+
+static void tf_putc(tf_out_t *o, char c)
+{
+    o->buf[o->n++] = c;
+    o->total++;
+    if(o->n == TF_CHUNK)
+    {
+        _write(1, o->buf, TF_CHUNK);
+        o->n = 0;
+    }
+}
+
+/*********************************************************************
+ * @fn      tf_field
+ *
+ * @brief   Writes s (len chars) padded to width. A sign goes in front
+ *          of zero padding.
+ *
+ * @return  none
+ */
+static void tf_field(tf_out_t *o, const char *s, uint8_t len, char sign,
+                     uint8_t width, uint8_t left, char pad)
+{
+    uint8_t w = len + (sign ? 1 : 0);
+
+    if(sign && pad == '0') tf_putc(o, sign);
+    if(!left)
+    {
+        for(; w < width; w++) tf_putc(o, pad);
+    }
+    if(sign && pad != '0') tf_putc(o, sign);
+    while(len--) tf_putc(o, *s++);
+    for(; w < width; w++) tf_putc(o, ' ');
+}
+
+/* Digits of v into p (at least 11 chars), returns the count */
+static uint8_t tf_utoa(char *p, uint32_t v)
+{
+    uint8_t i, n = 0;
+    char d;
+
+    for(i = 0; i < 9; i++)
+    {
+        d = '0';
+        while(v >= tf_pow10[i])
+        {
+            v -= tf_pow10[i];
+            d++;
+        }
+        if(n || d != '0') p[n++] = d;
+    }
+    p[n++] = '0' + (char)v;
+    return n;
+}
+
+static uint8_t tf_xtoa(char *p, uint32_t v, uint8_t upper)
+{
+    uint8_t n = 8;
+    int8_t i;
+
+    while(n > 1 && !(v >> ((n - 1) << 2))) n--;
+    for(i = n - 1; i >= 0; i--)
+    {
+        *p++ = tf_hex[upper][(v >> (i << 2)) & 0x0F];
+    }
+    return n;
+}
+
+/*********************************************************************
+ * @fn      TF_VPrintf
+ *
+ * @brief   Formats fmt to the debug output.
+ *
+ * @return  Number of characters written.
+ */
+int TF_VPrintf(const char *fmt, va_list ap)
+{
+    tf_out_t o;
+    char num[11];
+    const char *s;
+    uint8_t width, left, len;
+    char c, pad, sign;
+    uint32_t v;
+
+    o.n = 0;
+    o.total = 0;
+
+    while((c = *fmt++) != 0)
+    {
+        if(c != '%')
+        {
+            tf_putc(&o, c);
+            continue;
+        }
+
+        left = 0;
+        pad = ' ';
+        sign = 0;
+        width = 0;
+        if(*fmt == '-')
+        {
+            left = 1;
+            fmt++;
+        }
+        if(*fmt == '0')
+        {
+            pad = '0';
+            fmt++;
+        }
+        while(*fmt >= '0' && *fmt <= '9')
+        {
+            width = (uint8_t)((width << 3) + (width << 1) + (*fmt++ - '0'));
+        }
+        if(*fmt == 'l') fmt++;
+        if(left) pad = ' ';
+
+        c = *fmt++;
+        switch(c)
+        {
+            case 'd':
+                v = (uint32_t)va_arg(ap, int32_t);
+                if(v & 0x80000000)
+                {
+                    sign = '-';
+                    v = 0 - v;
+                }
+                len = tf_utoa(num, v);
+                tf_field(&o, num, len, sign, width, left, pad);
+                break;
+
+            case 'u':
+                len = tf_utoa(num, va_arg(ap, uint32_t));
+                tf_field(&o, num, len, 0, width, left, pad);
+                break;
+
+            case 'x':
+            case 'X':
+                len = tf_xtoa(num, va_arg(ap, uint32_t), c == 'X');
+                tf_field(&o, num, len, 0, width, left, pad);
+                break;
+
+            case 's':
+                s = va_arg(ap, const char *);
+                if(!s) s = "(null)";
+                for(len = 0; s[len] && len < 255; len++);
+                tf_field(&o, s, len, 0, width, left, ' ');
+                break;
+
+            case 'c':
+                num[0] = (char)va_arg(ap, int);
+                tf_field(&o, num, 1, 0, width, left, ' ');
+                break;
+
+            case 0:
+                fmt--;
+                break;
+
+            default:
+                /* %% and anything unsupported are copied as they are */
+                tf_putc(&o, c);
+                break;
+        }
+    }
+
+    if(o.n) _write(1, o.buf, o.n);
+    return o.total;
+}
+
+/*********************************************************************
+ * @fn      TF_Printf
+ *
+ * @brief   printf() for the debug output.
+ *
+ * @return  Number of characters written.
+ */
+int TF_Printf(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = TF_VPrintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+/*********************************************************************
+ * @fn      TF_Emit
+ *
+ * @brief   Writes one binary log record, back end of TF_LOG().
+ *
+ * @param   id - offset of the format string in .logfmt.
+ *          nargs - number of 32 bit arguments that follow.
+ *
+ * @return  none
+ */
+void TF_Emit(uint16_t id, uint8_t nargs, ...)
+{
+    uint8_t rec[5 + 4 * TFMT_LOG_MAX_ARGS];
+    uint8_t *p = rec + 5;
+    uint32_t a;
+    va_list ap;
+    uint8_t i;
+
+    rec[0] = TFMT_LOG_SYNC1;
+    rec[1] = TFMT_LOG_SYNC2;
+    rec[2] = (uint8_t)id;
+    rec[3] = (uint8_t)(id >> 8);
+    rec[4] = nargs;
+
+    va_start(ap, nargs);
+    for(i = 0; i < nargs; i++)
+    {
+        a = va_arg(ap, uint32_t);
+        *p++ = (uint8_t)a;
+        *p++ = (uint8_t)(a >> 8);
+        *p++ = (uint8_t)(a >> 16);
+        *p++ = (uint8_t)(a >> 24);
+    }
+    va_end(ap);
+
+    _write(1, (char *)rec, p - rec);
+}
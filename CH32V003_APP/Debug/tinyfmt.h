@@ -0,0 +1,61 @@
+/*
+ * tinyfmt.h
+ *
+ *  Small printf replacement and binary log records.
+ *
+ *  TF_Printf() understands %d %u %x %X %s %c %% with the '-' and '0'
+ *  flags and a field width ('l' is accepted and ignored, long is 32 bit).
+ *  Formats are checked by the compiler like printf formats.
+ *
+ *  TF_LOG() is the call to use on hot paths. With TFMT_LOG_TEXT it is
+ *  TF_Printf(); with TFMT_LOG_BINARY the format string is kept out of the
+ *  image in the non loaded .logfmt section and only a record
+ *    sync1 sync2 idLE16 nargs argLE32...
+ *  is written, id being the offset of the string in .logfmt. Tools/logdecode
+ *  turns the records back into text using the ELF file. Arguments must be
+ *  32 bit or narrower; %s arguments are sent as addresses and resolved from
+ *  the ELF, so they have to point at constant strings.
+ */
+
+#ifndef __TINYFMT_H
+#define __TINYFMT_H
+
+#include <stdint.h>
+#include <stdarg.h>
+
+#define TFMT_LOG_TEXT     0
+#define TFMT_LOG_BINARY   1
+
+#ifndef TFMT_LOG
+#define TFMT_LOG   TFMT_LOG_TEXT
+#endif
+
+#define TFMT_LOG_SYNC1    0xD6
+#define TFMT_LOG_SYNC2    0x6D
+#define TFMT_LOG_MAX_ARGS 8
+
+int TF_Printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int TF_VPrintf(const char *fmt, va_list ap);
+void TF_Emit(uint16_t id, uint8_t nargs, ...);
+
+/* Format check only, never called */
+static inline __attribute__((format(printf, 1, 2))) void TF_Check(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+#define TF_NARGS(...)   TF_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define TF_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...)   n
+
+#if (TFMT_LOG == TFMT_LOG_BINARY)
+#define TF_LOG(fmt, ...)                                                            \
+    do {                                                                            \
+        static const char tf_fmt_[] __attribute__((section(".logfmt"), used)) = fmt; \
+        if(0) TF_Check(fmt, ##__VA_ARGS__);                                         \
+        TF_Emit((uint16_t)(uintptr_t)tf_fmt_, TF_NARGS(__VA_ARGS__), ##__VA_ARGS__);  \
+    } while(0)
+#else
+#define TF_LOG(fmt, ...)   TF_Printf(fmt, ##__VA_ARGS__)
+#endif
+
+#endif /* __TINYFMT_H */
@@ -12,6 +12,23 @@
 #ifndef __CH32V00x_CONF_H
 #define __CH32V00x_CONF_H
 
+/* RAM code Definition */
+#define HIGHCODE_DISABLE   0
+#define HIGHCODE_ENABLE    1  //Flash programming and SPI inner loops run from RAM
+
+#ifndef HIGHCODE
+#define HIGHCODE   HIGHCODE_DISABLE
+#endif
+
+#if (HIGHCODE == HIGHCODE_ENABLE)
+#define __HIGHCODE   __attribute__((section(".highcode"), noinline))
+#else
+#define __HIGHCODE
+#endif
+
+/* Code that has to run from RAM whatever HIGHCODE says (it rewrites the flash) */
+#define __RAMCODE    __attribute__((section(".highcode"), noinline))
+
 #include <ch32v00x_adc.h>
 #include <ch32v00x_dbgmcu.h>
 #include <ch32v00x_dma.h>
@@ -0,0 +1,178 @@
+/*
+ * clock.c
+ *
+ *  Runtime system clock switching, see clock.h.
+ */
+
+#include "clock.h"
+#include "debug.h"
+
+static clock_cb_t clock_cb[CLOCK_MAX_CALLBACKS];
+static uint8_t clock_cb_count = 0;
+static clock_mode_t clock_mode = CLOCK_48MHZ;
+static uint32_t clock_pll_src = RCC_PLLSRC_HSI_Mul2;
+
+/*********************************************************************
+ * @fn      CLOCK_Init
+ *
+ * @brief   Records the PLL source SystemInit() chose, so the PLL is fed
+ *          the same way when it is restarted. Call once at boot.
+ *
+ * @return  none
+ */
+void CLOCK_Init(void)
+{
+    clock_pll_src = RCC->CFGR0 & RCC_PLLSRC;
+}
+
+/*********************************************************************
+ * @fn      CLOCK_Register
+ *
+ * @brief   Adds a function called after every clock switch, to
+ *          recompute whatever it derived from SystemCoreClock.
+ *
+ * @param   cb - retime callback, must not block.
+ *
+ * @return  0 - registered, 1 - table full.
+ */
+uint8_t CLOCK_Register(clock_cb_t cb)
+{
+    if(clock_cb_count >= CLOCK_MAX_CALLBACKS) return 1;
+
+    clock_cb[clock_cb_count++] = cb;
+    return 0;
+}
+
+/*********************************************************************
+ * @fn      CLOCK_HSE_Start
+ *
+ * @brief   Starts the crystal oscillator, with the same timeout as
+ *          SystemInit(). It is stopped again if it does not come up.
+ *
+ * @return  1 - HSE ready, 0 - timed out.
+ */
+static uint8_t CLOCK_HSE_Start(void)
+{
+    uint32_t n;
+
+    RCC->CTLR |= RCC_HSEON;
+    for(n = 0; n < HSE_STARTUP_TIMEOUT; n++)
+    {
+        if(RCC->CTLR & RCC_HSERDY) return 1;
+    }
+    RCC->CTLR &= ~RCC_HSEON;
+    return 0;
+}
+
+/*********************************************************************
+ * @fn      CLOCK_Switch
+ *
+ * @brief   Register sequence for one mode, from whatever clock runs.
+ *          The flash wait state is raised before speeding up and
+ *          lowered only once running slower. The PLL and HSE are
+ *          stopped in the HSI modes (standby stops them as well) and
+ *          restarted when going back to 48MHz. If HSE does not start
+ *          the PLL runs from HSI * 2 instead.
+ *
+ * @return  none
+ */
+static void CLOCK_Switch(clock_mode_t mode)
+{
+    uint32_t src = clock_pll_src;
+
+    if(mode == CLOCK_48MHZ)
+    {
+        FLASH->ACTLR = (FLASH->ACTLR & ~FLASH_ACTLR_LATENCY) | FLASH_ACTLR_LATENCY_1;
+
+        /* The PLL is off here, its source can be changed */
+        if(src == RCC_PLLSRC_HSE_Mul2 && !CLOCK_HSE_Start()) src = RCC_PLLSRC_HSI_Mul2;
+        RCC->CFGR0 = (RCC->CFGR0 & ~RCC_PLLSRC) | src;
+
+        RCC->CTLR |= RCC_PLLON;
+        while((RCC->CTLR & RCC_PLLRDY) == 0);
+
+        RCC->CFGR0 = (RCC->CFGR0 & ~RCC_SW) | RCC_SW_PLL;
+        while((RCC->CFGR0 & RCC_SWS) != (uint32_t)0x08);
+
+        /* From 8MHz this briefly runs at 16MHz, still within range */
+        RCC->CFGR0 &= ~RCC_HPRE;
+    }
+    else
+    {
+        RCC->CFGR0 = (RCC->CFGR0 & ~RCC_SW) | RCC_SW_HSI;
+        while((RCC->CFGR0 & RCC_SWS) != (uint32_t)0x00);
+
+        RCC->CFGR0 = (RCC->CFGR0 & ~RCC_HPRE) |
+                     ((mode == CLOCK_8MHZ_HSI) ? RCC_HPRE_DIV3 : RCC_HPRE_DIV1);
+        RCC->CTLR &= ~RCC_PLLON;
+        RCC->CTLR &= ~RCC_HSEON;
+
+        FLASH->ACTLR = (FLASH->ACTLR & ~FLASH_ACTLR_LATENCY) | FLASH_ACTLR_LATENCY_0;
+    }
+}
+
+/*********************************************************************
+ * @fn      CLOCK_Notify
+ *
+ * @brief   Updates SystemCoreClock and runs the retime callbacks.
+ *
+ * @return  none
+ */
+static void CLOCK_Notify(void)
+{
+    uint8_t i;
+
+    SystemCoreClockUpdate();
+    for(i = 0; i < clock_cb_count; i++) clock_cb[i]();
+}
+
+/*********************************************************************
+ * @fn      CLOCK_Set
+ *
+ * @brief   Switches the system clock. Pending debug output is flushed
+ *          first since the UART baud rate changes underneath it.
+ *
+ * @param   mode - new clock.
+ *
+ * @return  none
+ */
+void CLOCK_Set(clock_mode_t mode)
+{
+    if(mode == clock_mode) return;
+
+    USART_Printf_Flush();
+    __disable_irq();
+
+    CLOCK_Switch(mode);
+    clock_mode = mode;
+    CLOCK_Notify();
+
+    __enable_irq();
+}
+
+/*********************************************************************
+ * @fn      CLOCK_Resume
+ *
+ * @brief   Brings the current mode back after standby, which wakes on
+ *          HSI with the PLL and HSE stopped. Interrupts are left as
+ *          they are.
+ *
+ * @return  none
+ */
+void CLOCK_Resume(void)
+{
+    CLOCK_Switch(clock_mode);
+    CLOCK_Notify();
+}
+
+/*********************************************************************
+ * @fn      CLOCK_Get
+ *
+ * @brief   Current clock mode.
+ *
+ * @return  clock_mode_t
+ */
+clock_mode_t CLOCK_Get(void)
+{
+    return clock_mode;
+}
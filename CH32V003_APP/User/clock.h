@@ -0,0 +1,42 @@
+/*
+ * clock.h
+ *
+ *  Runtime system clock switching. SystemInit() still picks the boot
+ *  clock (48MHz from the PLL); CLOCK_Set() moves between that and the
+ *  two HSI speeds the same system_ch32v00x.c configurations use, with
+ *  the flash wait state ordered around the switch.
+ *
+ *  Modules whose timing is derived from HCLK register a retime callback
+ *  with CLOCK_Register(). After every switch SystemCoreClock is updated
+ *  and the callbacks run in registration order, interrupts still off.
+ */
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <ch32v00x.h>
+
+typedef enum {
+    CLOCK_48MHZ = 0,   //PLL, source as chosen by SystemInit() (HSI * 2 if HSE fails), 1 wait state
+    CLOCK_24MHZ_HSI,   //HSI, 0 wait state
+    CLOCK_8MHZ_HSI,    //HSI / 3, 0 wait state
+} clock_mode_t;
+
+#ifndef CLOCK_MAX_CALLBACKS
+#define CLOCK_MAX_CALLBACKS   6
+#endif
+
+/* Clock the APP runs at once booted, full speed is restored where needed */
+#ifndef CLOCK_RUN
+#define CLOCK_RUN   CLOCK_48MHZ
+#endif
+
+typedef void (*clock_cb_t)(void);
+
+void CLOCK_Init(void);
+uint8_t CLOCK_Register(clock_cb_t cb);
+void CLOCK_Set(clock_mode_t mode);
+void CLOCK_Resume(void);
+clock_mode_t CLOCK_Get(void);
+
+#endif /* CLOCK_H_ */
@@ -0,0 +1,152 @@
+/*
+ * dump.c
+ *
+ *  Memory dump helpers for the debug output.
+ */
+
+#include "dump.h"
+#include "string.h"
+#include "stdio.h"
+
+extern int _write(int fd, char *buf, int size);
+
+static const char dump_nibble[16] = "0123456789ABCDEF";
+
+/* "AAAAAAAA: " + "XX " per byte + "\r\n" */
+static char dump_line[10 + 3 * DUMP_ROW_BYTES + 2];
+
+/*********************************************************************
+ * @fn      Dump_Put_Hex32
+ *
+ * @brief   Formats a 32-bit value as 8 hex digits.
+ *
+ * @return  Pointer after the last digit.
+ */
+static char *Dump_Put_Hex32(char *p, uint32_t v)
+{
+    int8_t i;
+
+    for(i = 28; i >= 0; i -= 4)
+    {
+        *p++ = dump_nibble[(v >> i) & 0x0F];
+    }
+    return p;
+}
+
+/*********************************************************************
+ * @fn      Dump_Hex
+ *
+ * @brief   Prints a title line followed by rows of DUMP_ROW_BYTES
+ *          bytes, each row emitted with a single write.
+ *
+ * @param   title - heading, may be NULL.
+ *          addr - address printed for the first byte.
+ *          buf - data.
+ *          len - data length.
+ *
+ * @return  none
+ */
+void Dump_Hex(const char *title, uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+    char *p;
+    uint32_t n, i;
+
+#if (DEBUG_PRINTF == DEBUG_PRINTF_NEWLIB)
+    fflush(stdout);
+#endif
+
+    if(title)
+    {
+        _write(1, "\r\n", 2);
+        _write(1, (char *)title, strlen(title));
+        _write(1, ":\r\n", 3);
+    }
+
+    while(len)
+    {
+        n = (len > DUMP_ROW_BYTES) ? DUMP_ROW_BYTES : len;
+
+        p = Dump_Put_Hex32(dump_line, addr);
+        *p++ = ':';
+        *p++ = ' ';
+        for(i = 0; i < n; i++)
+        {
+            *p++ = dump_nibble[buf[i] >> 4];
+            *p++ = dump_nibble[buf[i] & 0x0F];
+            *p++ = ' ';
+        }
+        *p++ = '\r';
+        *p++ = '\n';
+        _write(1, dump_line, p - dump_line);
+
+        buf += n;
+        addr += n;
+        len -= n;
+    }
+}
+
+/*********************************************************************
+ * @fn      Dump_Raw
+ *
+ * @brief   Sends the data as one binary frame:
+ *          D5 5D | title len | title | addr (LE32) | len (LE16) |
+ *          data | sum16 (LE) of every byte after the sync.
+ *
+ * @param   title - tag stored in the frame, may be NULL.
+ *          addr - address of the first byte.
+ *          buf - data.
+ *          len - data length, at most 65535.
+ *
+ * @return  none
+ */
+void Dump_Raw(const char *title, uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+    uint8_t hdr[6];
+    uint8_t tlen = title ? (uint8_t)strlen(title) : 0;
+    uint16_t sum = tlen;
+    uint32_t i;
+
+#if (DEBUG_PRINTF == DEBUG_PRINTF_NEWLIB)
+    fflush(stdout);
+#endif
+
+    if(len > 0xFFFF) len = 0xFFFF;
+
+    hdr[0] = DUMP_RAW_SYNC1;
+    hdr[1] = DUMP_RAW_SYNC2;
+    hdr[2] = tlen;
+    _write(1, (char *)hdr, 3);
+    if(tlen) _write(1, (char *)title, tlen);
+
+    hdr[0] = addr;
+    hdr[1] = addr >> 8;
+    hdr[2] = addr >> 16;
+    hdr[3] = addr >> 24;
+    hdr[4] = len;
+    hdr[5] = len >> 8;
+    for(i = 0; i < 6; i++) sum += hdr[i];
+    for(i = 0; i < tlen; i++) sum += (uint8_t)title[i];
+    for(i = 0; i < len; i++) sum += buf[i];
+    _write(1, (char *)hdr, 6);
+    _write(1, (char *)buf, len);
+
+    hdr[0] = sum;
+    hdr[1] = sum >> 8;
+    _write(1, (char *)hdr, 2);
+}
+
+/*********************************************************************
+ * @fn      Dump
+ *
+ * @brief   Dumps in the format selected by DUMP_MODE.
+ *
+ * @return  none
+ */
+void Dump(const char *title, uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+#if (DUMP_MODE == DUMP_MODE_RAW)
+    Dump_Raw(title, addr, buf, len);
+#else
+    Dump_Hex(title, addr, buf, len);
+#endif
+}
@@ -0,0 +1,34 @@
+/*
+ * dump.h
+ *
+ *  Memory dump helpers for the debug output. Whole rows are formatted
+ *  into a line buffer and written at once instead of one printf per byte.
+ */
+
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include <ch32v00x.h>
+
+/* Output format */
+#define DUMP_MODE_HEX   0  //Readable rows "00001000: 41 42 ..."
+#define DUMP_MODE_RAW   1  //Binary frames, decoded by Tools/dumpdecode
+
+#ifndef DUMP_MODE
+#define DUMP_MODE   DUMP_MODE_HEX
+#endif
+
+/* Bytes per hex row, 16 or 32 */
+#ifndef DUMP_ROW_BYTES
+#define DUMP_ROW_BYTES   16
+#endif
+
+/* Raw frame: sync, title length, title, address, length, data, sum16 */
+#define DUMP_RAW_SYNC1   0xD5
+#define DUMP_RAW_SYNC2   0x5D
+
+void Dump_Hex(const char *title, uint32_t addr, const uint8_t *buf, uint32_t len);
+void Dump_Raw(const char *title, uint32_t addr, const uint8_t *buf, uint32_t len);
+void Dump(const char *title, uint32_t addr, const uint8_t *buf, uint32_t len);
+
+#endif /* DUMP_H_ */
@@ -11,6 +11,8 @@
 *******************************************************************************/
 #include "flash.h"
 #include "string.h"
+#include "perf.h"
+#include "trace.h"
 u32 Verify_buf[32];
 
 /*********************************************************************
@@ -21,9 +23,11 @@ u32 Verify_buf[32];
  *
  * @return  none
  */
-void CH32_IAP_Program(u32 adr, u32* buf)
+__HIGHCODE void CH32_IAP_Program(u32 adr, u32* buf)
 {
+    PERF_BEGIN(PERF_IAP_PROGRAM);
     adr &= 0xFFFFFFC0;
+    TRACE_EVENT(TRACE_IAP_PROGRAM, adr, 0);
 
     //FLASH_BufReset
     FLASH->CTLR |= ((uint32_t)0x00010000);
@@ -48,5 +52,26 @@ void CH32_IAP_Program(u32 adr, u32* buf)
     while(FLASH->STATR &  ((uint32_t)0x00000001))
         ;
     FLASH->CTLR &= ~((uint32_t)0x00010000);
+    PERF_END(PERF_IAP_PROGRAM);
 }
 
+/*********************************************************************
+ * @fn      CH32_Highcode_Check
+ *
+ * @brief   Verifies that the startup code copied .highcode to RAM
+ *          intact by comparing it with its load image in flash.
+ *
+ * @return  Size of .highcode in bytes, 0xFFFF if the copy differs.
+ */
+u16 CH32_Highcode_Check(void)
+{
+    const u32 *lma = (const u32 *)&_highcode_lma;
+    const u32 *vma = (const u32 *)&_highcode_vma_start;
+
+    while(vma < (const u32 *)&_highcode_vma_end)
+    {
+        if(*vma++ != *lma++) return 0xFFFF;
+    }
+
+    return (u16)((u32)&_highcode_vma_end - (u32)&_highcode_vma_start);
+}
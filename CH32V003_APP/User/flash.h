@@ -15,6 +15,11 @@
 #include "ch32v00x_it.h"
 #include "stdio.h"
 
+extern char _highcode_lma;
+extern char _highcode_vma_start;
+extern char _highcode_vma_end;
+
 void CH32_IAP_Program(u32 adr, u32* buf);
+u16 CH32_Highcode_Check(void);
 
 #endif
@@ -13,6 +13,8 @@
 #include "string.h"
 #include "flash.h"
 #include "core_riscv.h"
+#include "perf.h"
+#include "trace.h"
 
 /******************************************************************************/
 
@@ -113,8 +115,7 @@ uint8_t WriteFlashMCU(void)
         // If last block < 256 bytes, pad with 0xFF
         if (chunkSize < 256)
         {
-            for (i = chunkSize; i < 256; i++)
-                flashData[i] = 0xFF;
+            memset(&flashData[chunkSize], 0xFF, 256 - chunkSize);
         }
 
         // Write one 256-byte page to SPI flash
@@ -242,10 +243,13 @@ void UART_Rx_Deal(void)
     {
         if (Uart1_Rx() == Uart_Sync_Head2)
         {
+            /* Timed from the sync header, idle line time is not counted */
+            PERF_BEGIN(PERF_UART_RX_DEAL);
             isp_cmd_t->UART.Cmd = Uart1_Rx();
             Data_add += isp_cmd_t->UART.Cmd;
             isp_cmd_t->UART.Len = Uart1_Rx();
             Data_add += isp_cmd_t->UART.Len;
+            TRACE_EVENT(TRACE_IAP_RX, isp_cmd_t->UART.Cmd, isp_cmd_t->UART.Len);
 
             if(isp_cmd_t->UART.Cmd == CMD_IAP_ERASE ||isp_cmd_t->UART.Cmd == CMD_IAP_VERIFY)
             {
@@ -274,6 +278,7 @@ void UART_Rx_Deal(void)
                         if (Uart1_Rx() == Uart_Sync_Head1)
                         {
                             s = RecData_Deal();
+                            TRACE_EVENT(TRACE_IAP_CMD, isp_cmd_t->UART.Cmd, s);
 
                             if (s != ERR_End)
                             {
@@ -295,6 +300,11 @@ void UART_Rx_Deal(void)
                     }
                 }
             }
+            else
+            {
+                TRACE_EVENT(TRACE_IAP_RX_BAD, isp_cmd_t->UART.Cmd, Data_add);
+            }
+            PERF_END(PERF_UART_RX_DEAL);
         }
     }
 }
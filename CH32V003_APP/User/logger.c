@@ -0,0 +1,445 @@
+/*
+ * logger.c
+ *
+ *  Circular ADC data logger into the external SPI flash.
+ *
+ *  TIM2 update events trigger one ADC1 scan each, DMA1 channel 1 moves the
+ *  results into a circular double buffer and raises an interrupt at every
+ *  half. The interrupt only marks the half as ready, all packing and flash
+ *  work is done from LOGGER_Task() in the main loop, which never waits for
+ *  the flash: it issues one page program or sector erase when the chip is
+ *  idle and returns, so the CPU load is bounded by the copy of one half
+ *  buffer per call. Sectors are erased ahead of the write head; a page
+ *  that is full while an erase runs is programmed in an erase suspend,
+ *  so the erase time does not have to be buffered in RAM.
+ */
+
+#include "logger.h"
+
+#if (LOGGER == LOGGER_ENABLE)
+
+#include "string.h"
+
+#define LOGGER_CHANNELS   (sizeof(logger_channels) / sizeof(logger_channels[0]))
+#define LOGGER_SECTOR     SPIF_ERASE_SIZE
+
+typedef struct {
+    logger_page_hdr_t hdr;
+    uint16_t samples[LOGGER_PAGE_SAMPLES];
+} logger_page_t;
+
+static const uint8_t logger_channels[] = LOGGER_CHANNEL_LIST;
+
+_Static_assert((LOGGER_ERASE_AHEAD * LOGGER_SECTOR / LOGGER_PAGE_SIZE - 1) * LOGGER_PAGE_SAMPLES
+               > (uint32_t)LOGGER_SAMPLE_RATE * LOGGER_CHANNELS * LOGGER_TSE_MS / 1000,
+               "LOGGER_ERASE_AHEAD too small, the head would reach a sector still being erased");
+
+/* GPIO of the analog inputs A0..A7 */
+static GPIO_TypeDef * const logger_ain_port[8] = {GPIOA, GPIOA, GPIOC, GPIOD, GPIOD, GPIOD, GPIOD, GPIOD};
+static const uint16_t logger_ain_pin[8] = {GPIO_Pin_2, GPIO_Pin_1, GPIO_Pin_4, GPIO_Pin_2,
+                                           GPIO_Pin_3, GPIO_Pin_5, GPIO_Pin_6, GPIO_Pin_4};
+
+static uint16_t adc_buf[2 * LOGGER_HALF_SAMPLES];
+static volatile uint8_t half_ready;        /* bit n: half n filled and not consumed yet */
+static volatile uint16_t isr_dropped;      /* samples overwritten before they were packed */
+static uint8_t next_half;
+
+static logger_page_t page_queue[LOGGER_PAGE_QUEUE];
+static uint8_t q_head;                     /* oldest full page */
+static uint8_t q_count;                    /* full pages waiting for the flash */
+static uint16_t fill_pos;                  /* samples in the page being filled */
+static uint16_t pending_dropped;
+
+static uint32_t page_seq;
+static uint32_t head_off;                  /* region offset of the next page to program */
+static uint32_t erased_ahead;              /* erased bytes starting at head_off */
+static uint8_t erasing;                    /* erase of the sector after them running */
+static uint8_t suspended;                  /* ... and suspended */
+
+static logger_stats_t logger_stats;
+
+void DMA1_Channel1_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+
+/*********************************************************************
+ * @fn      DMA1_Channel1_IRQHandler
+ *
+ * @brief   Marks the half of adc_buf that DMA just completed as ready.
+ *          A half that is still marked from the previous pass has been
+ *          overwritten and is counted as dropped.
+ *
+ * @return  none
+ */
+void DMA1_Channel1_IRQHandler(void)
+{
+    uint8_t bit;
+
+    if(DMA1->INTFR & DMA1_IT_HT1)
+    {
+        DMA1->INTFCR = DMA1_IT_HT1;
+        bit = 0x01;
+    }
+    else
+    {
+        DMA1->INTFCR = DMA1_IT_GL1;
+        bit = 0x02;
+    }
+
+    if(half_ready & bit)
+    {
+        isr_dropped += LOGGER_HALF_SAMPLES;
+    }
+    half_ready |= bit;
+}
+
+/*********************************************************************
+ * @fn      LOGGER_ScanRegion
+ *
+ * @brief   Finds the newest page in the ring and resumes after it.
+ *          Pages are written in order, so the rest of the head sector
+ *          is still erased.
+ *
+ * @return  none
+ */
+static void LOGGER_ScanRegion(void)
+{
+    logger_page_hdr_t hdr;
+    uint32_t off;
+    uint8_t found = 0;
+
+    head_off = 0;
+    erased_ahead = 0;
+    page_seq = 0;
+
+    for(off = 0; off < LOGGER_REGION_SIZE; off += LOGGER_PAGE_SIZE)
+    {
+        SPIF_read(NORMAL_FLASH, LOGGER_REGION_START + off, (uint8_t *)&hdr, sizeof(hdr));
+        if(hdr.seq == 0xFFFFFFFF) continue;
+        if(!found || (int32_t)(hdr.seq - page_seq) >= 0)
+        {
+            found = 1;
+            page_seq = hdr.seq;
+            head_off = off;
+        }
+    }
+
+    if(found)
+    {
+        page_seq++;
+        head_off = (head_off + LOGGER_PAGE_SIZE) % LOGGER_REGION_SIZE;
+        erased_ahead = (LOGGER_SECTOR - (head_off % LOGGER_SECTOR)) % LOGGER_SECTOR;
+    }
+}
+
+/*********************************************************************
+ * @fn      LOGGER_Init
+ *
+ * @brief   Configures TIM2, ADC1 and DMA1 channel 1, locates the write
+ *          head in the flash ring and erases up to LOGGER_ERASE_AHEAD
+ *          sectors in front of it, waiting, so sampling never starts
+ *          behind an erase. Sampling starts with LOGGER_Start().
+ *
+ * @return  none
+ */
+void LOGGER_Init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStructure = {0};
+    ADC_InitTypeDef ADC_InitStructure = {0};
+    DMA_InitTypeDef DMA_InitStructure = {0};
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseInitStructure = {0};
+    NVIC_InitTypeDef NVIC_InitStructure = {0};
+    uint8_t i;
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_ADC1 | RCC_APB2Periph_GPIOA |
+                           RCC_APB2Periph_GPIOC | RCC_APB2Periph_GPIOD, ENABLE);
+    RCC_ADCCLKConfig(RCC_PCLK2_Div8);
+
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AIN;
+    for(i = 0; i < LOGGER_CHANNELS; i++)
+    {
+        if(logger_channels[i] < 8)
+        {
+            GPIO_InitStructure.GPIO_Pin = logger_ain_pin[logger_channels[i]];
+            GPIO_Init(logger_ain_port[logger_channels[i]], &GPIO_InitStructure);
+        }
+    }
+
+    ADC_DeInit(ADC1);
+    ADC_InitStructure.ADC_Mode = ADC_Mode_Independent;
+    ADC_InitStructure.ADC_ScanConvMode = (LOGGER_CHANNELS > 1) ? ENABLE : DISABLE;
+    ADC_InitStructure.ADC_ContinuousConvMode = DISABLE;
+    ADC_InitStructure.ADC_ExternalTrigConv = ADC_ExternalTrigConv_T2_TRGO;
+    ADC_InitStructure.ADC_DataAlign = ADC_DataAlign_Right;
+    ADC_InitStructure.ADC_NbrOfChannel = LOGGER_CHANNELS;
+    ADC_Init(ADC1, &ADC_InitStructure);
+
+    for(i = 0; i < LOGGER_CHANNELS; i++)
+    {
+        ADC_RegularChannelConfig(ADC1, logger_channels[i], i + 1, ADC_SampleTime_43Cycles);
+    }
+
+    ADC_DMACmd(ADC1, ENABLE);
+    ADC_ExternalTrigConvCmd(ADC1, ENABLE);
+    ADC_Cmd(ADC1, ENABLE);
+
+    ADC_ResetCalibration(ADC1);
+    while(ADC_GetResetCalibrationStatus(ADC1));
+    ADC_StartCalibration(ADC1);
+    while(ADC_GetCalibrationStatus(ADC1));
+
+    DMA_DeInit(DMA1_Channel1);
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&ADC1->RDATAR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)adc_buf;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+    DMA_InitStructure.DMA_BufferSize = 2 * LOGGER_HALF_SAMPLES;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel1, &DMA_InitStructure);
+    DMA_ITConfig(DMA1_Channel1, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    /* 1MHz timer clock, one update (and one ADC scan) per sample period */
+    TIM_TimeBaseInitStructure.TIM_Prescaler = SystemCoreClock / 1000000 - 1;
+    TIM_TimeBaseInitStructure.TIM_Period = 1000000 / LOGGER_SAMPLE_RATE - 1;
+    TIM_TimeBaseInitStructure.TIM_ClockDivision = TIM_CKD_DIV1;
+    TIM_TimeBaseInitStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseInit(TIM2, &TIM_TimeBaseInitStructure);
+    TIM_SelectOutputTrigger(TIM2, TIM_TRGOSource_Update);
+
+    LOGGER_ScanRegion();
+
+    while(erased_ahead < LOGGER_ERASE_AHEAD * LOGGER_SECTOR)
+    {
+        if(SPIF_erase_sector_start(LOGGER_REGION_START + (head_off + erased_ahead) % LOGGER_REGION_SIZE) != SPIF_OK ||
+           SPIF_wait_idle() != SPIF_OK)
+        {
+            logger_stats.flash_errors++;
+        }
+        erased_ahead += LOGGER_SECTOR;
+        logger_stats.sectors_erased++;
+    }
+}
+
+/*********************************************************************
+ * @fn      LOGGER_Retime
+ *
+ * @brief   Clock switch callback: keeps the timer at 1MHz. The new
+ *          prescaler is loaded at the next update, so the sample
+ *          period in progress finishes at the old rate.
+ *
+ * @return  none
+ */
+void LOGGER_Retime(void)
+{
+    TIM2->PSC = SystemCoreClock / 1000000 - 1;
+}
+
+/*********************************************************************
+ * @fn      LOGGER_Start
+ *
+ * @brief   Starts the DMA and the sampling timer.
+ *
+ * @return  none
+ */
+void LOGGER_Start(void)
+{
+    half_ready = 0;
+    next_half = 0;
+    DMA_SetCurrDataCounter(DMA1_Channel1, 2 * LOGGER_HALF_SAMPLES);
+    DMA_Cmd(DMA1_Channel1, ENABLE);
+    TIM_Cmd(TIM2, ENABLE);
+}
+
+/*********************************************************************
+ * @fn      LOGGER_Stop
+ *
+ * @brief   Stops sampling. Samples already buffered are still packed
+ *          and the last, partly filled page is queued so that the
+ *          following LOGGER_Task() calls write it out.
+ *
+ * @return  none
+ */
+void LOGGER_Stop(void)
+{
+    TIM_Cmd(TIM2, DISABLE);
+    DMA_Cmd(DMA1_Channel1, DISABLE);
+
+    LOGGER_Task();
+
+    if(fill_pos && (q_count < LOGGER_PAGE_QUEUE))
+    {
+        page_queue[(q_head + q_count) % LOGGER_PAGE_QUEUE].hdr.count = fill_pos;
+        page_seq++;
+        q_count++;
+        fill_pos = 0;
+    }
+}
+
+/*********************************************************************
+ * @fn      LOGGER_Pack
+ *
+ * @brief   Appends samples to the page being filled and queues pages
+ *          as they become full. Without a free page the samples are
+ *          dropped and reported in the header of the next page.
+ *
+ * @param   src - samples.
+ *          n - number of samples.
+ *
+ * @return  none
+ */
+static void LOGGER_Pack(const uint16_t *src, uint16_t n)
+{
+    logger_page_t *page;
+    uint16_t chunk;
+
+    while(n)
+    {
+        if(q_count == LOGGER_PAGE_QUEUE)
+        {
+            pending_dropped += n;
+            logger_stats.samples_dropped += n;
+            return;
+        }
+
+        page = &page_queue[(q_head + q_count) % LOGGER_PAGE_QUEUE];
+        if(fill_pos == 0)
+        {
+            page->hdr.seq = page_seq;
+            page->hdr.dropped = pending_dropped;
+            pending_dropped = 0;
+        }
+
+        chunk = LOGGER_PAGE_SAMPLES - fill_pos;
+        if(chunk > n) chunk = n;
+
+        memcpy(&page->samples[fill_pos], src, chunk * sizeof(uint16_t));
+        fill_pos += chunk;
+        src += chunk;
+        n -= chunk;
+        logger_stats.samples_logged += chunk;
+
+        if(fill_pos == LOGGER_PAGE_SAMPLES)
+        {
+            page->hdr.count = fill_pos;
+            page_seq++;
+            q_count++;
+            fill_pos = 0;
+            if(q_count > logger_stats.queue_max) logger_stats.queue_max = q_count;
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      LOGGER_Task
+ *
+ * @brief   Packs every completed half buffer and, if the flash is idle,
+ *          starts either the next page program or the next erase ahead
+ *          of the write head. With a page queued during that erase the
+ *          erase is suspended, the page programmed and the erase
+ *          resumed on the following calls. Never waits for the flash
+ *          beyond tSUS; call it from the main loop at least once per
+ *          half buffer period.
+ *
+ * @return  none
+ */
+void LOGGER_Task(void)
+{
+    uint8_t bit;
+    uint16_t lost;
+    logger_page_t *page;
+
+    while(half_ready & (bit = (1 << next_half)))
+    {
+        LOGGER_Pack(&adc_buf[next_half * LOGGER_HALF_SAMPLES], LOGGER_HALF_SAMPLES);
+
+        __disable_irq();
+        half_ready &= ~bit;
+        lost = isr_dropped;
+        isr_dropped = 0;
+        __enable_irq();
+
+        pending_dropped += lost;
+        logger_stats.samples_dropped += lost;
+        next_half ^= 1;
+    }
+
+    if((q_count == 0) && !erasing && (erased_ahead >= LOGGER_ERASE_AHEAD * LOGGER_SECTOR)) return;
+
+    if(SPIF_is_busy())
+    {
+        /* Only an erase of ours is suspended, and only for a page that has room */
+        if(!erasing || suspended || (q_count == 0) || (erased_ahead < LOGGER_PAGE_SIZE)) return;
+        if(SPIF_erase_suspend() != SPIF_OK) logger_stats.flash_errors++;
+        suspended = 1;
+        logger_stats.erase_suspends++;
+        if(SPIF_is_busy()) return;
+    }
+
+    /* Program queued pages first, erase only when there is nothing to
+     * write or the head has caught up with the erased area */
+    if(q_count && (erased_ahead >= LOGGER_PAGE_SIZE))
+    {
+        page = &page_queue[q_head];
+        if(SPIF_page_program_start(LOGGER_REGION_START + head_off, (uint8_t *)page, LOGGER_PAGE_SIZE) != SPIF_OK)
+        {
+            logger_stats.flash_errors++;
+        }
+        head_off = (head_off + LOGGER_PAGE_SIZE) % LOGGER_REGION_SIZE;
+        erased_ahead -= LOGGER_PAGE_SIZE;
+        q_head = (q_head + 1) % LOGGER_PAGE_QUEUE;
+        q_count--;
+        logger_stats.pages_written++;
+        return;
+    }
+
+    if(suspended)
+    {
+        if(SPIF_erase_resume() != SPIF_OK) logger_stats.flash_errors++;
+        suspended = 0;
+        return;
+    }
+
+    /* Idle and not suspended, so the erase has finished */
+    if(erasing)
+    {
+        erasing = 0;
+        erased_ahead += LOGGER_SECTOR;
+    }
+
+    if(erased_ahead < LOGGER_ERASE_AHEAD * LOGGER_SECTOR)
+    {
+        if(SPIF_erase_sector_start(LOGGER_REGION_START + (head_off + erased_ahead) % LOGGER_REGION_SIZE) != SPIF_OK)
+        {
+            logger_stats.flash_errors++;
+        }
+        erasing = 1;
+        logger_stats.sectors_erased++;
+    }
+}
+
+/*********************************************************************
+ * @fn      LOGGER_GetStats
+ *
+ * @brief   Copies the logger counters.
+ *
+ * @param   stats - destination.
+ *
+ * @return  none
+ */
+void LOGGER_GetStats(logger_stats_t *stats)
+{
+    *stats = logger_stats;
+}
+
+#endif /* LOGGER */
@@ -0,0 +1,98 @@
+/*
+ * logger.h
+ *
+ *  Circular ADC data logger: TIM2 triggers ADC1 scans, DMA1 channel 1
+ *  fills a double buffer and LOGGER_Task() packs the samples into pages
+ *  that are appended to a ring of sectors in the external SPI flash.
+ */
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <ch32v00x.h>
+#include "spiflash.h"
+
+#define LOGGER_DISABLE   0
+#define LOGGER_ENABLE    1
+
+#ifndef LOGGER
+#define LOGGER   LOGGER_DISABLE
+#endif
+
+/* ADC channels converted on every trigger, in scan order (ADC_Channel_7 = PD4) */
+#ifndef LOGGER_CHANNEL_LIST
+#define LOGGER_CHANNEL_LIST     { ADC_Channel_7 }
+#endif
+
+/* Scan rate in Hz, one sample per channel per scan */
+#ifndef LOGGER_SAMPLE_RATE
+#define LOGGER_SAMPLE_RATE      1000
+#endif
+
+/* Samples per DMA half buffer, must be a multiple of the channel count */
+#ifndef LOGGER_HALF_SAMPLES
+#define LOGGER_HALF_SAMPLES     32
+#endif
+
+/* Worst case sector erase time (tSE max) in ms */
+#ifndef LOGGER_TSE_MS
+#define LOGGER_TSE_MS           400
+#endif
+
+/*
+ * Pages held in RAM (one being filled, the rest waiting for the flash).
+ * A page never waits for an erase, the erase is suspended to program it,
+ * so the queue only covers a page program and the task period.
+ */
+#ifndef LOGGER_PAGE_QUEUE
+#define LOGGER_PAGE_QUEUE       2
+#endif
+
+/* Ring region in the external flash, sector aligned */
+#ifndef LOGGER_REGION_START
+#define LOGGER_REGION_START     0x00010000
+#endif
+#ifndef LOGGER_REGION_SIZE
+#define LOGGER_REGION_SIZE      0x00010000
+#endif
+
+/*
+ * Number of sectors kept erased in front of the write head. The next
+ * erase starts as the head enters the last of them and has to finish
+ * before the head leaves it, checked at build time:
+ *   (LOGGER_ERASE_AHEAD * sector / 256 - 1) * LOGGER_PAGE_SAMPLES > LOGGER_SAMPLE_RATE * channels * tSE
+ * With one 4K sector, 124 samples per page and one channel that is up to
+ * 4650 Hz.
+ */
+#ifndef LOGGER_ERASE_AHEAD
+#define LOGGER_ERASE_AHEAD      1
+#endif
+
+#define LOGGER_PAGE_SIZE        256
+#define LOGGER_PAGE_SAMPLES     ((LOGGER_PAGE_SIZE - sizeof(logger_page_hdr_t)) / sizeof(uint16_t))
+
+/* Header at the start of every page written to the flash */
+typedef struct {
+    uint32_t seq;          /* page sequence number, 0xFFFFFFFF = erased */
+    uint16_t count;        /* valid samples in this page */
+    uint16_t dropped;      /* samples lost just before this page */
+} logger_page_hdr_t;
+
+typedef struct {
+    uint32_t pages_written;
+    uint32_t samples_logged;
+    uint32_t samples_dropped;
+    uint32_t sectors_erased;
+    uint32_t erase_suspends;   /* pages programmed inside an erase */
+    uint16_t queue_max;
+    uint16_t flash_errors;
+} logger_stats_t;
+
+void LOGGER_Init(void);
+void LOGGER_Retime(void);
+void LOGGER_Start(void);
+void LOGGER_Stop(void);
+void LOGGER_Task(void);
+void LOGGER_GetStats(logger_stats_t *stats);
+
+#endif /* LOGGER_H_ */
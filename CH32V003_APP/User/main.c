@@ -19,15 +19,17 @@
 #include "debug.h"
 #include "spiflash.h"
 #include "iap.h"
-#include <stddef.h>
-
-void *memset(void *dest, int value, size_t len)
-{
-    unsigned char *ptr = dest;
-    while (len--)
-        *ptr++ = (unsigned char)value;
-    return dest;
-}
+#include "logger.h"
+#include "dump.h"
+#include "perf.h"
+#include "flash.h"
+#include "selfupd.h"
+#include "trace.h"
+#include "sched.h"
+#include "clock.h"
+#include "power.h"
+#include "romfs.h"
+#include "overlay.h"
 
 /* Global define */
 
@@ -53,6 +55,87 @@ void GPIO_Toggle_INIT(void)
 
 }
 
+/*********************************************************************
+ * @fn      Flash_Dump
+ *
+ * @brief   Prints the SPI flash busy wait counters of each operation.
+ *
+ * @return  none
+ */
+void Flash_Dump(void)
+{
+    static const char *const op_name[SPIF_OP_COUNT] = { "program", "sec-erase", "chip-erase", "other" };
+    SPIF_wait_stats_t ws;
+    u8 op;
+
+    TF_LOG("\r\nSPIF waits\r\n");
+    for(op = 0; op < SPIF_OP_COUNT; op++)
+    {
+        SPIF_wait_get_stats(op, &ws);
+        TF_LOG("%-10s n=%u polls=%u max=%u timeouts=%u\r\n", op_name[op], (unsigned)ws.waits,
+               (unsigned)ws.polls, (unsigned)ws.max_polls, (unsigned)ws.timeouts);
+    }
+}
+
+/*********************************************************************
+ * @fn      Debug_Command_Poll
+ *
+ * @brief   One letter commands on the debug UART: 'p' prints the PERF
+ *          table, 'r' resets it, 't' dumps the trace ring, 'c' clears
+ *          it, 's' prints the scheduler statistics, 'w' the standby and
+ *          flash power-down counts and wake latency, 'f' the flash busy
+ *          waits.
+ *
+ * @return  none
+ */
+void Debug_Command_Poll(void)
+{
+#if (SDI_PRINT == SDI_PR_CLOSE)
+    u8 c;
+
+    if(USART_GetFlagStatus(USART1, USART_FLAG_RXNE) == RESET) return;
+
+    c = (u8)USART_ReceiveData(USART1);
+    if(c == 'p') PERF_Dump();
+    else if(c == 'r') PERF_Reset();
+    else if(c == 't') TRACE_Dump();
+    else if(c == 'c') TRACE_Clear();
+    else if(c == 's') SCHED_Dump();
+    else if(c == 'w') POWER_Dump();
+    else if(c == 'f') Flash_Dump();
+#endif
+}
+
+/*********************************************************************
+ * @fn      Task_Debug
+ *
+ * @brief   Debug console: commands and SDI output.
+ *
+ * @return  none
+ */
+void Task_Debug(void)
+{
+    Debug_Command_Poll();
+#if (SDI_PRINT == SDI_PR_OPEN)
+    SDI_Printf_Poll();
+#endif
+}
+
+/*********************************************************************
+ * @fn      Task_Led
+ *
+ * @brief   Heartbeat on PC0 and PD2.
+ *
+ * @return  none
+ */
+void Task_Led(void)
+{
+    static u8 led = 0;
+
+    GPIO_WriteBit(GPIOC, GPIO_Pin_0, (led == 0) ? (led = Bit_SET) : (led = Bit_RESET));
+    GPIO_WriteBit(GPIOD, GPIO_Pin_2, led);
+}
+
 /*********************************************************************
  * @fn      GoToIAP
  *
@@ -76,8 +159,6 @@ void GoToIAP(void)
  */
 int main(void)
 {
-    u8 i = 0;
-    u8 led = 0;
     //u8 led1 = 12;
     u8 isNewFirmware = 0;
     uint16_t app_length = 0;
@@ -104,6 +185,18 @@ int main(void)
     printf("\r\nSystemClk:%d\r\n", SystemCoreClock);
     printf("ChipID:%08x\r\n", DBGMCU_GetCHIPID() );
     printf("Flash_used = 0x%08x (%u bytes)\r\n", (unsigned)GetLengthFlashMCU(), (unsigned)GetLengthFlashMCU());
+    if(CH32_Highcode_Check() == 0xFFFF) printf("Highcode copy mismatch\r\n");
+    else printf("Highcode = %u bytes in RAM\r\n", (unsigned)CH32_Highcode_Check());
+#if (SELFUPD == SELFUPD_ENABLE)
+    /* Returns only when there is nothing to install */
+    printf("Self update: %u\r\n", (unsigned)SELFUPD_Check());
+#endif
+#if (ROMFS == ROMFS_ENABLE)
+    printf("Romfs: %u\r\n", (unsigned)ROMFS_Mount());
+#endif
+#if (OVL == OVL_ENABLE)
+    if(OVL_Check()) printf("Overlays missing: 0x%02X\r\n", OVL_Check());
+#endif
     
     
     // SPIF_erase(); 
@@ -126,54 +219,41 @@ int main(void)
     SPIF_read(SECURITY_AREA, 0x1000, (uint8_t*)&flash_info_test, sizeof(flash_info_t));
     
     SPIF_read(SECURITY_AREA, 0x1000 ,flasData, 256);
-    printf("\r\nSecurity Block 0: ");
-    for (int i = 0; i < 256; i++) {
-        u8 data = 0;
-        data = *((u8*)flasData+i);
-        printf("0x%02X ", data);  // Use %d for int
-    }
-    
+    Dump("Security Block 0", 0x1000, flasData, 256);
+
     SPIF_read(NORMAL_FLASH, 0 ,flasData, 256);
-    printf("\r\nZero Block: ");
-    for (int i = 0; i < 256; i++) {
-        u8 data = 0;
-        data = *((u8*)flasData+i);
-        printf("0x%02X ", data);  // Use %d for int
-    }
+    Dump("Zero Block", 0, flasData, 256);
 
     SPIF_read(NORMAL_FLASH, 256 ,flasData, 256);
-    printf("\r\nFirst Block: ");
-    for (int i = 0; i < 256; i++) {
-        u8 data = 0;
-        data = *((u8*)flasData+i);
-        printf("0x%02X ", data);  // Use %d for int
-    }
+    Dump("First Block", 256, flasData, 256);
 
     SPIF_read(NORMAL_FLASH, 256*23 ,flasData, 256);
-    printf("\r\n\r\nLast Block: ");
-    for (int i = 0; i < 256; i++) {
-        u8 data = 0;
-        data = *((u8*)flasData+i);
-        printf("0x%02X ", data);  // Use %d for int
-    }
+    Dump("Last Block", 256*23, flasData, 256);
 
-    while(1)
-    {
-        Delay_Ms(100);
-        
-        //printf("\r\nCounting: %d", i);
-        GPIO_WriteBit(GPIOC, GPIO_Pin_0, (led == 0) ? (led = Bit_SET) : (led = Bit_RESET));
-        GPIO_WriteBit(GPIOD, GPIO_Pin_2, led);
-        
-        if( SPI_I2S_GetFlagStatus( SPI1, SPI_I2S_FLAG_TXE ) != RESET )
-        {
-           
-            
-            
-            i++;
-            
-        }
-        
-        if(i == 18) i = 0;
-    }
+    PERF_Dump();
+
+    SCHED_Init();
+
+#if (LOGGER == LOGGER_ENABLE)
+    LOGGER_Init();
+    LOGGER_Start();
+    /* One non-blocking flash step per run, well within one half buffer period */
+    SCHED_Add(LOGGER_Task, "logger", 1);
+#endif
+    SCHED_Add(Task_Debug, "debug", 10);
+    SCHED_Add(Task_Led, "led", 100);
+    SCHED_Add(SPIF_pd_poll, "spif_pd", 10);
+
+    /* Everything derived from HCLK follows a clock switch */
+    CLOCK_Init();
+    CLOCK_Register(Delay_Init);
+    CLOCK_Register(USART_Printf_Retime);
+    CLOCK_Register(SPI_Retime);
+    CLOCK_Register(SCHED_Retime);
+#if (LOGGER == LOGGER_ENABLE)
+    CLOCK_Register(LOGGER_Retime);
+#endif
+    CLOCK_Set(CLOCK_RUN);
+
+    SCHED_Loop();
 }
@@ -0,0 +1,21 @@
+/*
+ * memops.h
+ *
+ *  Word wise memcpy/memset/memcmp replacing the byte loops of newlib nano,
+ *  see memops.c. Nothing to call here, the standard <string.h> names are
+ *  used; the option only exists to fall back to the library versions.
+ */
+
+#ifndef MEMOPS_H_
+#define MEMOPS_H_
+
+#include <string.h>
+
+#define MEMOPS_DISABLE   0
+#define MEMOPS_ENABLE    1
+
+#ifndef MEMOPS
+#define MEMOPS   MEMOPS_ENABLE
+#endif
+
+#endif /* MEMOPS_H_ */
@@ -0,0 +1,135 @@
+/*
+ * overlay.c
+ *
+ *  Overlay loader, see overlay.h. An overlay is one SPIF_read() stream
+ *  from the external flash straight into the RAM slot; the core has no
+ *  instruction cache, so the code can run as soon as the read returns.
+ */
+
+#include "overlay.h"
+
+#if (OVL == OVL_ENABLE)
+
+#include "debug.h"
+
+/* Link.ld */
+extern char _ovl_vma[];
+extern char _xflash_origin[];
+extern char __load_start_ovl0[], __load_stop_ovl0[];
+extern char __load_start_ovl1[], __load_stop_ovl1[];
+extern char __load_start_ovl2[], __load_stop_ovl2[];
+extern char __load_start_ovl3[], __load_stop_ovl3[];
+
+#define OVL_NONE      0xFF
+
+typedef struct {
+    const char *start;
+    const char *stop;
+} ovl_lma_t;
+
+/* Load ranges in XFLASH, an empty overlay has start == stop */
+static const ovl_lma_t ovl_lma[OVL_COUNT] = {
+    { __load_start_ovl0, __load_stop_ovl0 },
+    { __load_start_ovl1, __load_stop_ovl1 },
+    { __load_start_ovl2, __load_stop_ovl2 },
+    { __load_start_ovl3, __load_stop_ovl3 },
+};
+
+static uint8_t ovl_resident = OVL_NONE;
+static ovl_stats_t ovl_stats[OVL_COUNT];
+
+/*********************************************************************
+ * @fn      OVL_Load
+ *
+ * @brief   Makes overlay n resident, reading it from the external flash
+ *          unless it already is. Called by the stubs. After a failed read
+ *          the slot holds nothing usable and no overlay is resident.
+ *
+ * @param   n - overlay number
+ *
+ * @return  1 - overlay n is resident
+ *          0 - the read failed, the slot must not be entered
+ */
+uint8_t OVL_Load(uint8_t n)
+{
+    uint32_t size = ovl_lma[n].stop - ovl_lma[n].start;
+    uint32_t start, cycles;
+
+    ovl_stats[n].calls++;
+    if(n == ovl_resident) return 1;
+
+    ovl_resident = OVL_NONE;
+    start = SysTick->CNT;
+    if(SPIF_read(NORMAL_FLASH, OVL_SPIF_ADDR + (uint32_t)(ovl_lma[n].start - _xflash_origin), (uint8_t *)_ovl_vma, size) != SPIF_OK)
+    {
+        ovl_stats[n].errors++;
+        return 0;
+    }
+    cycles = SysTick->CNT - start;
+
+    ovl_resident = n;
+    ovl_stats[n].loads++;
+    ovl_stats[n].load_cycles += cycles;
+    if(cycles > ovl_stats[n].load_max) ovl_stats[n].load_max = cycles;
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      OVL_Check
+ *
+ * @brief   Looks for overlays missing from the external flash: a non
+ *          empty overlay whose first word reads erased or cannot be read.
+ *
+ * @return  bit n set if overlay n is missing
+ */
+uint8_t OVL_Check(void)
+{
+    uint32_t word;
+    uint8_t n, missing = 0;
+
+    for(n = 0; n < OVL_COUNT; n++)
+    {
+        if(ovl_lma[n].stop == ovl_lma[n].start) continue;
+        if(SPIF_read(NORMAL_FLASH, OVL_SPIF_ADDR + (uint32_t)(ovl_lma[n].start - _xflash_origin), (uint8_t *)&word, sizeof(word)) != SPIF_OK ||
+           word == 0xFFFFFFFF) missing |= 1 << n;
+    }
+    return missing;
+}
+
+/*********************************************************************
+ * @fn      OVL_GetStats
+ *
+ * @brief   Copies the counters of overlay n.
+ *
+ * @return  none
+ */
+void OVL_GetStats(uint8_t n, ovl_stats_t *stats)
+{
+    *stats = ovl_stats[n];
+    stats->size = (uint16_t)(ovl_lma[n].stop - ovl_lma[n].start);
+}
+
+/*********************************************************************
+ * @fn      OVL_Dump
+ *
+ * @brief   Prints size, calls and load cost of every non empty overlay,
+ *          to decide what is worth keeping resident.
+ *
+ * @return  none
+ */
+void OVL_Dump(void)
+{
+    ovl_stats_t s;
+    uint8_t n;
+
+    for(n = 0; n < OVL_COUNT; n++)
+    {
+        OVL_GetStats(n, &s);
+        if(!s.size) continue;
+        TF_LOG("ovl%u %u bytes calls=%u loads=%u avg=%u max=%u errors=%u\r\n", n, (unsigned)s.size, (unsigned)s.calls,
+               (unsigned)s.loads, (unsigned)(s.loads ? s.load_cycles / s.loads : 0), (unsigned)s.load_max,
+               (unsigned)s.errors);
+    }
+}
+
+#endif /* OVL */
@@ -0,0 +1,67 @@
+/*
+ * overlay.h
+ *
+ *  Code overlays: rarely used functions are linked into .ovl0...ovl3
+ *  (see Link.ld), stored in the external SPI flash at OVL_SPIF_ADDR and
+ *  copied into one shared RAM slot when called. The overlay stays there
+ *  until a call into another overlay evicts it.
+ *
+ *  An overlay function is marked with __OVERLAY(n) and called through a
+ *  resident stub made with OVL_STUB()/OVL_STUB_VOID(), which loads the
+ *  overlay first. If the load fails (flash error or timeout) the slot is
+ *  not entered: the stub returns the error value given as its last
+ *  argument, a void stub returns without doing anything.
+ *
+ *      __OVERLAY(1) uint16_t crc_table_ovl(const uint8_t *p, uint16_t n) { ... }
+ *      OVL_STUB(1, uint16_t, crc_table, (const uint8_t *p, uint16_t n), (p, n), 0xFFFF)
+ *
+ *  Overlay code may call resident code, never another overlay (the
+ *  linker rejects direct references, and a stub would evict the caller).
+ *  Stubs are not for interrupt handlers. CH32V003_APP_ovl.bin from the
+ *  same build has to be written at OVL_SPIF_ADDR.
+ */
+
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include <ch32v00x.h>
+#include "spiflash.h"
+
+#define OVL_DISABLE   0
+#define OVL_ENABLE    1
+
+#ifndef OVL
+#define OVL   OVL_DISABLE
+#endif
+
+/* Overlay sections in Link.ld */
+#define OVL_COUNT     4
+
+/* Where CH32V003_APP_ovl.bin is written, normal flash */
+#ifndef OVL_SPIF_ADDR
+#define OVL_SPIF_ADDR 0x00200000
+#endif
+
+#define __OVERLAY(n)  __attribute__((section(".ovl" #n), noinline))
+
+#define OVL_STUB(n, ret, name, params, args, err) \
+    ret name params { if(!OVL_Load(n)) return err; return name##_ovl args; }
+
+#define OVL_STUB_VOID(n, name, params, args) \
+    void name params { if(OVL_Load(n)) name##_ovl args; }
+
+typedef struct {
+    uint32_t calls;        /* stub calls */
+    uint32_t loads;        /* calls that had to load the overlay */
+    uint32_t load_cycles;  /* HCLK cycles spent loading, all loads */
+    uint32_t load_max;     /* slowest load */
+    uint32_t errors;       /* loads that failed, the call was skipped */
+    uint16_t size;         /* bytes */
+} ovl_stats_t;
+
+uint8_t OVL_Load(uint8_t n);
+uint8_t OVL_Check(void);
+void OVL_GetStats(uint8_t n, ovl_stats_t *stats);
+void OVL_Dump(void);
+
+#endif /* OVERLAY_H_ */
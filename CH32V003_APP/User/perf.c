@@ -0,0 +1,72 @@
+/*
+ * perf.c
+ *
+ *  Profiling region table and its dump over the debug output.
+ */
+
+#include "perf.h"
+
+#if (PERF == PERF_ENABLE)
+
+#include "debug.h"
+
+uint32_t perf_start[PERF_REGION_COUNT];
+perf_stat_t perf_table[PERF_REGION_COUNT] = {
+    [0 ... PERF_REGION_COUNT - 1] = { 0, 0xFFFFFFFF, 0, 0 }
+};
+
+static const char * const perf_name[PERF_REGION_COUNT] = {
+    "SPIF_write",
+    "CH32_IAP_Program",
+    "UART_Rx_Deal",
+    "SPI read xfer",
+    "SPI page program",
+};
+
+/*********************************************************************
+ * @fn      PERF_Reset
+ *
+ * @brief   Clears all region statistics.
+ *
+ * @return  none
+ */
+void PERF_Reset(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < PERF_REGION_COUNT; i++)
+    {
+        perf_table[i].count = 0;
+        perf_table[i].min = 0xFFFFFFFF;
+        perf_table[i].max = 0;
+        perf_table[i].total = 0;
+    }
+}
+
+/*********************************************************************
+ * @fn      PERF_Dump
+ *
+ * @brief   Prints count and min/avg/max cycles of every region that
+ *          has run, on the debug UART or SDI (whichever printf uses).
+ *
+ * @return  none
+ */
+void PERF_Dump(void)
+{
+    uint8_t i;
+    perf_stat_t s;
+
+    TF_LOG("\r\nPERF (cycles @ %u Hz)\r\n", (unsigned)SystemCoreClock);
+    for(i = 0; i < PERF_REGION_COUNT; i++)
+    {
+        __disable_irq();
+        s = perf_table[i];
+        __enable_irq();
+
+        if(s.count == 0) continue;
+        TF_LOG("%-18s n=%u min=%u avg=%u max=%u\r\n", perf_name[i], (unsigned)s.count,
+               (unsigned)s.min, (unsigned)PERF_Avg(s.total, s.count), (unsigned)s.max);
+    }
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * perf.h
+ *
+ *  Hot path profiling regions timed with the free running SysTick counter
+ *  (HCLK cycles, see Delay_Init()). PERF_BEGIN/PERF_END compile to nothing
+ *  unless PERF is set to PERF_ENABLE.
+ */
+
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <ch32v00x.h>
+
+#define PERF_DISABLE   0
+#define PERF_ENABLE    1
+
+#ifndef PERF
+#define PERF   PERF_DISABLE
+#endif
+
+/* Region IDs, one table entry each */
+typedef enum {
+    PERF_SPIF_WRITE = 0,
+    PERF_IAP_PROGRAM,
+    PERF_UART_RX_DEAL,
+    PERF_SPI_PAGE_READ,
+    PERF_SPI_PAGE_WRITE,
+    PERF_REGION_COUNT
+} perf_id_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} perf_stat_t;
+
+/*
+ * Average of a 64-bit cycle sum without the libgcc 64-bit divide: sum and
+ * count are halved until the sum fits 32 bits. 0 without samples.
+ */
+static inline uint32_t PERF_Avg(uint64_t total, uint32_t count)
+{
+    if(count == 0) return 0;
+    while(total >> 32)
+    {
+        total >>= 1;
+        count >>= 1;
+        if(count == 0) return 0xFFFFFFFF;
+    }
+    return (uint32_t)total / count;
+}
+
+#if (PERF == PERF_ENABLE)
+
+extern uint32_t perf_start[PERF_REGION_COUNT];
+extern perf_stat_t perf_table[PERF_REGION_COUNT];
+
+__attribute__((always_inline)) static inline void PERF_Record(uint8_t id, uint32_t cycles)
+{
+    perf_stat_t *s = &perf_table[id];
+
+    s->count++;
+    s->total += cycles;
+    if(cycles < s->min) s->min = cycles;
+    if(cycles > s->max) s->max = cycles;
+}
+
+#define PERF_BEGIN(id)   (perf_start[(id)] = SysTick->CNT)
+#define PERF_END(id)     PERF_Record((id), SysTick->CNT - perf_start[(id)])
+
+void PERF_Reset(void);
+void PERF_Dump(void);
+
+#else
+
+#define PERF_BEGIN(id)   ((void)0)
+#define PERF_END(id)     ((void)0)
+#define PERF_Reset()     ((void)0)
+#define PERF_Dump()      ((void)0)
+
+#endif
+
+#endif /* PERF_H_ */
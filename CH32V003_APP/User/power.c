@@ -0,0 +1,139 @@
+/*
+ * power.c
+ *
+ *  Standby with auto-wakeup, see power.h.
+ */
+
+#include "power.h"
+#include "debug.h"
+#include "clock.h"
+#include "spiflash.h"
+
+#define POWER_AWU_WINDOW_MAX   0x3F
+
+/* AWU prescalers from 1ms to 480ms per count at 128kHz */
+static const struct {
+    uint8_t psc;
+    uint16_t div;
+} power_awu[] = {
+    { PWR_AWU_Prescaler_128,   128 },
+    { PWR_AWU_Prescaler_1024,  1024 },
+    { PWR_AWU_Prescaler_10240, 10240 },
+    { PWR_AWU_Prescaler_61440, 61440 },
+};
+
+#define POWER_AWU_STEPS   (sizeof(power_awu) / sizeof(power_awu[0]))
+
+static power_stats_t power_stats;
+
+/*********************************************************************
+ * @fn      POWER_Init
+ *
+ * @brief   Starts the LSI and routes the AWU to EXTI line 9 as an
+ *          event, which is what wakes a WFE standby.
+ *
+ * @return  none
+ */
+void POWER_Init(void)
+{
+    EXTI_InitTypeDef EXTI_InitStructure = {0};
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+    RCC_LSICmd(ENABLE);
+    while(RCC_GetFlagStatus(RCC_FLAG_LSIRDY) == RESET);
+
+    EXTI_InitStructure.EXTI_Line = EXTI_Line9;
+    EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Event;
+    EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Falling;
+    EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+    EXTI_Init(&EXTI_InitStructure);
+}
+
+/*********************************************************************
+ * @fn      POWER_Standby
+ *
+ * @brief   Sleeps in standby for at most ms. The finest AWU prescaler
+ *          that can express the time is used and the count rounded
+ *          down, so the wake is never late. Call with interrupts
+ *          disabled and the debug output flushed.
+ *
+ * @param   ms - time until the next deadline.
+ *
+ * @return  Time actually programmed in ms, 0 if too short to sleep.
+ */
+uint32_t POWER_Standby(uint32_t ms)
+{
+    uint32_t n = 0, slept, wake_clk, t0, t1, t2;
+    uint8_t i;
+
+    for(i = 0; i < POWER_AWU_STEPS; i++)
+    {
+        n = ms * (POWER_LSI_HZ / 1000) / power_awu[i].div;
+        if(n <= POWER_AWU_WINDOW_MAX) break;
+    }
+    if(i == POWER_AWU_STEPS)
+    {
+        i--;
+        n = POWER_AWU_WINDOW_MAX;
+    }
+    if(n == 0) return 0;
+    slept = n * power_awu[i].div / (POWER_LSI_HZ / 1000);
+
+    SPIF_power_down();
+
+    PWR_AWU_SetPrescaler(power_awu[i].psc);
+    PWR_AWU_SetWindowValue((uint8_t)n);
+    PWR_AutoWakeUpCmd(ENABLE);
+    PWR_EnterSTANDBYMode(PWR_STANDBYEntry_WFE);
+
+    /* Running from HSI now, PLL and HSE off */
+    t0 = SysTick->CNT;
+    PWR_AutoWakeUpCmd(DISABLE);
+    SystemCoreClockUpdate();
+    wake_clk = SystemCoreClock;
+    CLOCK_Resume();
+    t1 = SysTick->CNT;
+#if (SPIF_PD_POLICY == SPIF_PD_NEVER)
+    SPIF_release_power_down();
+#endif
+    t2 = SysTick->CNT;
+
+    power_stats.wake_us = (t1 - t0) / (wake_clk / 1000000) + (t2 - t1) / (SystemCoreClock / 1000000);
+    if(power_stats.wake_us > power_stats.wake_max_us) power_stats.wake_max_us = power_stats.wake_us;
+    power_stats.entries++;
+    power_stats.slept_ms += slept;
+
+    return slept;
+}
+
+/*********************************************************************
+ * @fn      POWER_GetStats
+ *
+ * @brief   Copies the standby statistics.
+ *
+ * @return  none
+ */
+void POWER_GetStats(power_stats_t *stats)
+{
+    *stats = power_stats;
+}
+
+/*********************************************************************
+ * @fn      POWER_Dump
+ *
+ * @brief   Prints the standby and flash power-down statistics and
+ *          restarts the latency max.
+ *
+ * @return  none
+ */
+void POWER_Dump(void)
+{
+    SPIF_pd_stats_t pd;
+
+    SPIF_pd_get_stats(&pd);
+    TF_LOG("\r\nSPIF power-down n=%u, wakes=%u cost=%u us\r\n", (unsigned)pd.sleeps, (unsigned)pd.wakes,
+           (unsigned)(pd.wake_cycles / (SystemCoreClock / 1000000)));
+    TF_LOG("POWER standby n=%u %u ms, wake last=%u max=%u us\r\n", (unsigned)power_stats.entries,
+           (unsigned)power_stats.slept_ms, (unsigned)power_stats.wake_us, (unsigned)power_stats.wake_max_us);
+    power_stats.wake_max_us = 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * power.h
+ *
+ *  Standby with auto-wakeup for the scheduler idle loop. POWER_Standby()
+ *  puts the SPI flash into deep power-down, programs the AWU (clocked by
+ *  the 128kHz LSI) for the requested time and enters standby. On wake the
+ *  clock mode is restored through CLOCK_Resume() and the flash released.
+ *
+ *  HCLK, and so SysTick, stops in standby: the caller adds the returned
+ *  time to its tick. The USART does not receive while in standby.
+ *
+ *  Wake latency is the software part, from the first instruction after
+ *  standby to the flash being usable again, measured with SysTick. The
+ *  regulator and HSI start up before that is not included. With
+ *  SPIF_PD_AUTO the flash is left asleep until its next access and that
+ *  wake is accounted by the flash driver instead.
+ */
+
+#ifndef POWER_H_
+#define POWER_H_
+
+#include <ch32v00x.h>
+
+/* LSI frequency used to convert AWU counts to ms, trim per board if needed */
+#ifndef POWER_LSI_HZ
+#define POWER_LSI_HZ   128000
+#endif
+
+typedef struct {
+    uint32_t entries;        /* standby entries */
+    uint32_t slept_ms;       /* nominal time spent in standby */
+    uint32_t wake_us;        /* last wake latency */
+    uint32_t wake_max_us;    /* longest wake latency */
+} power_stats_t;
+
+void POWER_Init(void);
+uint32_t POWER_Standby(uint32_t ms);
+void POWER_GetStats(power_stats_t *stats);
+void POWER_Dump(void);
+
+#endif /* POWER_H_ */
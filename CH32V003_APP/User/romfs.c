@@ -0,0 +1,208 @@
+/*
+ * romfs.c
+ *
+ *  Read-only asset filesystem in the external SPI flash, see romfs.h.
+ *  Every access streams through SPIF_read(); the only RAM state is the
+ *  entry count of the mounted image and the open file handles.
+ */
+
+#include "romfs.h"
+
+#if (ROMFS == ROMFS_ENABLE)
+
+#define ROMFS_DIR_ADDR      (ROMFS_ADDR + sizeof(romfs_hdr_t))
+#define ROMFS_NAME_CHUNK    8
+
+static uint16_t romfs_count;
+static uint8_t romfs_mounted;
+
+/*********************************************************************
+ * @fn      ROMFS_Hash
+ *
+ * @brief   FNV-1a of a path, as computed by mkromfs.
+ *
+ * @param   path - NUL terminated path
+ *
+ * @return  hash
+ */
+static uint32_t ROMFS_Hash(const char *path)
+{
+    uint32_t h = ROMFS_HASH_INIT;
+
+    while(*path)
+    {
+        h ^= (uint8_t)*path++;
+        h *= ROMFS_HASH_PRIME;
+    }
+    return h;
+}
+
+/*********************************************************************
+ * @fn      ROMFS_NameEqual
+ *
+ * @brief   Compares a path with the name stored at an image offset, a
+ *          few bytes per flash read.
+ *
+ * @param   name - offset of the stored name
+ *          path - NUL terminated path
+ *
+ * @return  1 if equal, 0 if not, 0xFF on a flash error
+ */
+static uint8_t ROMFS_NameEqual(uint32_t name, const char *path)
+{
+    uint8_t chunk[ROMFS_NAME_CHUNK];
+    uint8_t i;
+
+    for(;;)
+    {
+        if(SPIF_read(NORMAL_FLASH, ROMFS_ADDR + name, chunk, sizeof(chunk)) != SPIF_OK) return 0xFF;
+        for(i = 0; i < sizeof(chunk); i++)
+        {
+            if(chunk[i] != (uint8_t)path[i]) return 0;
+            if(!chunk[i]) return 1;
+        }
+        name += sizeof(chunk);
+        path += sizeof(chunk);
+    }
+}
+
+/*********************************************************************
+ * @fn      ROMFS_Mount
+ *
+ * @brief   Checks the image header at ROMFS_ADDR.
+ *
+ * @return  ROMFS_OK, ROMFS_ERR_BAD_IMAGE or ROMFS_ERR_FLASH
+ */
+ROMFS_RET_t ROMFS_Mount(void)
+{
+    romfs_hdr_t hdr;
+
+    romfs_mounted = 0;
+    if(SPIF_read(NORMAL_FLASH, ROMFS_ADDR, (uint8_t *)&hdr, sizeof(hdr)) != SPIF_OK) return ROMFS_ERR_FLASH;
+
+    if(hdr.magic != ROMFS_MAGIC || hdr.version != ROMFS_VERSION) return ROMFS_ERR_BAD_IMAGE;
+    if(hdr.size < sizeof(hdr) + hdr.count * sizeof(romfs_entry_t)) return ROMFS_ERR_BAD_IMAGE;
+    if(hdr.size > SPIF_get_size() - ROMFS_ADDR) return ROMFS_ERR_BAD_IMAGE;
+
+    romfs_count = hdr.count;
+    romfs_mounted = 1;
+    return ROMFS_OK;
+}
+
+/*********************************************************************
+ * @fn      ROMFS_Open
+ *
+ * @brief   Looks a path up: binary search for the first entry with its
+ *          hash, then name compares for the entries sharing the hash.
+ *          A leading '/' is ignored.
+ *
+ * @param   file - handle to fill
+ *          path - path relative to the image root
+ *
+ * @return  ROMFS_OK, ROMFS_ERR_NOT_MOUNTED, ROMFS_ERR_NOT_FOUND or
+ *          ROMFS_ERR_FLASH
+ */
+ROMFS_RET_t ROMFS_Open(romfs_file_t *file, const char *path)
+{
+    romfs_entry_t entry;
+    uint32_t hash, probe;
+    uint16_t lo = 0, hi = romfs_count, mid;
+    uint8_t eq;
+
+    if(!romfs_mounted) return ROMFS_ERR_NOT_MOUNTED;
+
+    if(*path == '/') path++;
+    hash = ROMFS_Hash(path);
+
+    while(lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if(SPIF_read(NORMAL_FLASH, ROMFS_DIR_ADDR + mid * sizeof(romfs_entry_t), (uint8_t *)&probe, sizeof(probe)) != SPIF_OK)
+            return ROMFS_ERR_FLASH;
+        if(probe < hash) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for(; lo < romfs_count; lo++)
+    {
+        if(SPIF_read(NORMAL_FLASH, ROMFS_DIR_ADDR + lo * sizeof(romfs_entry_t), (uint8_t *)&entry, sizeof(entry)) != SPIF_OK)
+            return ROMFS_ERR_FLASH;
+        if(entry.hash != hash) break;
+
+        eq = ROMFS_NameEqual(entry.name, path);
+        if(eq == 0xFF) return ROMFS_ERR_FLASH;
+        if(eq)
+        {
+            file->offset = entry.offset;
+            file->size = entry.size;
+            file->pos = 0;
+            return ROMFS_OK;
+        }
+    }
+    return ROMFS_ERR_NOT_FOUND;
+}
+
+/*********************************************************************
+ * @fn      ROMFS_Read
+ *
+ * @brief   Reads from the current position straight into buf.
+ *
+ * @param   file - open file
+ *          buf - destination
+ *          len - bytes wanted
+ *
+ * @return  bytes read, 0 at the end of the file or on a flash error
+ */
+uint32_t ROMFS_Read(romfs_file_t *file, void *buf, uint32_t len)
+{
+    uint32_t left = file->size - file->pos;
+
+    if(len > left) len = left;
+    if(!len) return 0;
+
+    if(SPIF_read(NORMAL_FLASH, ROMFS_ADDR + file->offset + file->pos, buf, len) != SPIF_OK) return 0;
+    file->pos += len;
+    return len;
+}
+
+/*********************************************************************
+ * @fn      ROMFS_Seek
+ *
+ * @brief   Moves the position, anywhere from 0 to the file size.
+ *
+ * @param   file - open file
+ *          offset - signed distance
+ *          whence - ROMFS_SEEK_SET, ROMFS_SEEK_CUR or ROMFS_SEEK_END
+ *
+ * @return  ROMFS_OK, or ROMFS_ERR_SEEK with the position unchanged
+ */
+ROMFS_RET_t ROMFS_Seek(romfs_file_t *file, int32_t offset, uint8_t whence)
+{
+    int32_t pos;
+
+    switch(whence)
+    {
+        case ROMFS_SEEK_SET: pos = offset; break;
+        case ROMFS_SEEK_CUR: pos = (int32_t)file->pos + offset; break;
+        case ROMFS_SEEK_END: pos = (int32_t)file->size + offset; break;
+        default: return ROMFS_ERR_SEEK;
+    }
+    if(pos < 0 || (uint32_t)pos > file->size) return ROMFS_ERR_SEEK;
+
+    file->pos = (uint32_t)pos;
+    return ROMFS_OK;
+}
+
+/* Current position */
+uint32_t ROMFS_Tell(const romfs_file_t *file)
+{
+    return file->pos;
+}
+
+/* File size in bytes */
+uint32_t ROMFS_Size(const romfs_file_t *file)
+{
+    return file->size;
+}
+
+#endif /* ROMFS */
@@ -0,0 +1,87 @@
+/*
+ * romfs.h
+ *
+ *  Read-only asset filesystem in the external SPI flash, for tables, fonts
+ *  and calibration blobs that do not fit in the internal flash. The image
+ *  is built on the host by Tools/mkromfs and written at ROMFS_ADDR.
+ *
+ *  Image layout, little endian, every part 4 byte aligned:
+ *    header     romfs_hdr_t
+ *    directory  romfs_entry_t[count], sorted by hash, then by name
+ *    names      NUL terminated paths relative to the source directory
+ *    data       file contents, each extent starting 4 byte aligned
+ *  All offsets are from the start of the image. Padding is 0xFF.
+ *
+ *  A lookup is a binary search over the directory hashes, one 4 byte read
+ *  per step, then a streamed name compare for the entries with that hash.
+ *  Nothing is buffered in RAM beyond the file handle.
+ */
+
+#ifndef ROMFS_H_
+#define ROMFS_H_
+
+#include <ch32v00x.h>
+#include "spiflash.h"
+
+#define ROMFS_DISABLE   0
+#define ROMFS_ENABLE    1
+
+#ifndef ROMFS
+#define ROMFS   ROMFS_DISABLE
+#endif
+
+/* Start of the image, normal flash, clear of the logger ring and the staged update */
+#ifndef ROMFS_ADDR
+#define ROMFS_ADDR      0x00100000
+#endif
+
+#define ROMFS_MAGIC     0x464D4F52      /* "ROMF" */
+#define ROMFS_VERSION   1
+
+/* FNV-1a over the path bytes, without the terminating NUL */
+#define ROMFS_HASH_INIT     0x811C9DC5
+#define ROMFS_HASH_PRIME    0x01000193
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;        /* directory entries */
+    uint32_t size;         /* whole image in bytes */
+    uint32_t flags;        /* 0 */
+} romfs_hdr_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t name;         /* offset of the path */
+    uint32_t offset;       /* offset of the data, 4 byte aligned */
+    uint32_t size;
+} romfs_entry_t;
+
+/* Open file, the only per file state */
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t pos;
+} romfs_file_t;
+
+typedef enum {
+    ROMFS_OK = 0,
+    ROMFS_ERR_NOT_MOUNTED = 1,
+    ROMFS_ERR_BAD_IMAGE = 2,
+    ROMFS_ERR_NOT_FOUND = 3,
+    ROMFS_ERR_SEEK = 4,
+    ROMFS_ERR_FLASH = 5,
+} ROMFS_RET_t;
+
+#define ROMFS_SEEK_SET  0
+#define ROMFS_SEEK_CUR  1
+#define ROMFS_SEEK_END  2
+
+ROMFS_RET_t ROMFS_Mount(void);
+ROMFS_RET_t ROMFS_Open(romfs_file_t *file, const char *path);
+uint32_t ROMFS_Read(romfs_file_t *file, void *buf, uint32_t len);
+ROMFS_RET_t ROMFS_Seek(romfs_file_t *file, int32_t offset, uint8_t whence);
+uint32_t ROMFS_Tell(const romfs_file_t *file);
+uint32_t ROMFS_Size(const romfs_file_t *file);
+
+#endif /* ROMFS_H_ */
@@ -0,0 +1,365 @@
+/*
+ * sched.c
+ *
+ *  Cooperative run-to-completion scheduler, see sched.h.
+ */
+
+#include "sched.h"
+#include "debug.h"
+#include "power.h"
+#include "perf.h"
+
+typedef struct {
+    sched_fn_t fn;
+    const char *name;
+    uint32_t period;
+    uint32_t next;           /* tick the task is due at */
+    volatile uint8_t pending;
+    sched_stats_t stats;
+} sched_task_t;
+
+static sched_task_t sched_task[SCHED_MAX_TASKS];
+static uint8_t sched_count = 0;
+static int8_t sched_current = -1;
+
+static volatile uint32_t sched_tick = 0;
+static uint32_t sched_tick_cycles;
+static uint32_t sched_late = 0;      /* compare matches missed and resynchronised */
+static uint64_t sched_idle = 0;      /* cycles with no task ready */
+static uint32_t sched_since = 0;     /* tick of the last stats reset */
+
+void SysTick_Handler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+
+/*********************************************************************
+ * @fn      SysTick_Handler
+ *
+ * @brief   Millisecond tick. The compare value is advanced instead of
+ *          reloading the counter, so SysTick->CNT stays free running.
+ *
+ * @return  none
+ */
+void SysTick_Handler(void)
+{
+    SysTick->SR = 0;
+    SysTick->CMP += sched_tick_cycles;
+    sched_tick++;
+
+    /* Interrupts held off for more than a tick: restart from now */
+    if((int32_t)(SysTick->CNT - SysTick->CMP) >= 0)
+    {
+        SysTick->CMP = SysTick->CNT + sched_tick_cycles;
+        sched_late++;
+    }
+}
+
+/*********************************************************************
+ * @fn      SCHED_Init
+ *
+ * @brief   Starts the millisecond tick. Delay_Init() must have run.
+ *
+ * @return  none
+ */
+void SCHED_Init(void)
+{
+    NVIC_InitTypeDef NVIC_InitStructure = {0};
+
+    sched_tick_cycles = SystemCoreClock / 1000;
+
+    SysTick->SR = 0;
+    SysTick->CMP = SysTick->CNT + sched_tick_cycles;
+    SysTick->CTLR |= (1 << 1);           /* STIE, counting and clock unchanged */
+
+    NVIC_InitStructure.NVIC_IRQChannel = SysTicK_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+#if (SCHED_IDLE == SCHED_IDLE_STANDBY)
+    POWER_Init();
+#endif
+}
+
+/*********************************************************************
+ * @fn      SCHED_Retime
+ *
+ * @brief   Clock switch callback: rescales the tick and restarts the
+ *          current tick from now. Idle and run times already taken
+ *          stay in cycles of the clock they were measured at.
+ *
+ * @return  none
+ */
+void SCHED_Retime(void)
+{
+    sched_tick_cycles = SystemCoreClock / 1000;
+    SysTick->CMP = SysTick->CNT + sched_tick_cycles;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Add
+ *
+ * @brief   Registers a task. Tasks are checked in the order they were
+ *          added, so add latency sensitive ones first.
+ *
+ * @param   fn - task function.
+ *          name - shown by SCHED_Dump().
+ *          period - ms between runs, 0 for a task run only on SCHED_Signal().
+ *
+ * @return  Task ID, -1 when the table is full.
+ */
+int8_t SCHED_Add(sched_fn_t fn, const char *name, uint32_t period)
+{
+    sched_task_t *t;
+
+    if(sched_count >= SCHED_MAX_TASKS) return -1;
+
+    t = &sched_task[sched_count];
+    t->fn = fn;
+    t->name = name;
+    t->period = period;
+    t->next = sched_tick + period;
+    t->pending = 0;
+    t->stats.runs = 0;
+    t->stats.max = 0;
+    t->stats.total = 0;
+
+    return (int8_t)sched_count++;
+}
+
+/*********************************************************************
+ * @fn      SCHED_SetPeriod
+ *
+ * @brief   Changes the period of a task, counted from now.
+ *
+ * @return  none
+ */
+void SCHED_SetPeriod(int8_t id, uint32_t period)
+{
+    if(id < 0 || id >= sched_count) return;
+
+    sched_task[id].period = period;
+    sched_task[id].next = sched_tick + period;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Signal
+ *
+ * @brief   Makes a task run on the next pass. Safe from interrupts.
+ *
+ * @return  none
+ */
+void SCHED_Signal(int8_t id)
+{
+    if(id < 0 || id >= sched_count) return;
+
+    sched_task[id].pending = 1;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Self
+ *
+ * @brief   ID of the running task, -1 outside of tasks.
+ *
+ * @return  Task ID.
+ */
+int8_t SCHED_Self(void)
+{
+    return sched_current;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Now
+ *
+ * @brief   Milliseconds since SCHED_Init().
+ *
+ * @return  Tick count.
+ */
+uint32_t SCHED_Now(void)
+{
+    return sched_tick;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Run
+ *
+ * @brief   One pass over the task table, running every task that is
+ *          due or signalled. A periodic task that fell behind skips the
+ *          missed runs instead of bursting to catch up.
+ *
+ * @return  Number of tasks run.
+ */
+uint8_t SCHED_Run(void)
+{
+    sched_task_t *t;
+    uint32_t now, start, cycles;
+    uint8_t i, ran = 0;
+
+    for(i = 0; i < sched_count; i++)
+    {
+        t = &sched_task[i];
+        now = sched_tick;
+
+        if(t->pending)
+        {
+            t->pending = 0;
+        }
+        else if(t->period == 0 || (int32_t)(now - t->next) < 0)
+        {
+            continue;
+        }
+
+        if(t->period && (int32_t)(now - t->next) >= 0)
+        {
+            t->next += t->period;
+            if((int32_t)(now - t->next) >= 0) t->next = now + t->period;
+        }
+
+        sched_current = (int8_t)i;
+        start = SysTick->CNT;
+        t->fn();
+        cycles = SysTick->CNT - start;
+        sched_current = -1;
+
+        t->stats.runs++;
+        t->stats.total += cycles;
+        if(cycles > t->stats.max) t->stats.max = cycles;
+        ran++;
+    }
+
+    return ran;
+}
+
+#if (SCHED_IDLE == SCHED_IDLE_STANDBY)
+/*********************************************************************
+ * @fn      SCHED_Idle_Ms
+ *
+ * @brief   Time until the earliest periodic task is due.
+ *
+ * @return  ms, 0 when something is due or signalled.
+ */
+static uint32_t SCHED_Idle_Ms(void)
+{
+    uint32_t now = sched_tick, ms = 0xFFFFFFFF, d;
+    uint8_t i;
+
+    for(i = 0; i < sched_count; i++)
+    {
+        if(sched_task[i].pending) return 0;
+        if(sched_task[i].period == 0) continue;
+
+        d = sched_task[i].next - now;
+        if((int32_t)d <= 0) return 0;
+        if(d < ms) ms = d;
+    }
+
+    return ms;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Standby
+ *
+ * @brief   Standby until the next deadline if it is far enough away.
+ *          The deadline is taken again with interrupts off, so a task
+ *          signalled meanwhile is not slept over. The standby time is
+ *          added to the tick and counted as idle.
+ *
+ * @return  1 - slept, 0 - too close, the caller waits for a tick.
+ */
+static uint8_t SCHED_Standby(void)
+{
+    uint32_t ms;
+
+    if(SCHED_Idle_Ms() < SCHED_STANDBY_MIN_MS) return 0;
+
+    USART_Printf_Flush();
+    __disable_irq();
+    ms = SCHED_Idle_Ms();
+    ms = (ms < SCHED_STANDBY_MIN_MS) ? 0 : POWER_Standby(ms);
+    sched_tick += ms;
+    __enable_irq();
+
+    sched_idle += (uint64_t)ms * sched_tick_cycles;
+    return ms ? 1 : 0;
+}
+#endif
+
+/*********************************************************************
+ * @fn      SCHED_Loop
+ *
+ * @brief   Runs the scheduler forever, replaces the main loop. A task
+ *          signalled by an interrupt that lands between the last pass
+ *          and the sleep waits at most one tick. With SCHED_IDLE_STANDBY
+ *          only the AWU ends a standby, a task signalled from an
+ *          interrupt waits for the next periodic deadline.
+ *
+ * @return  none
+ */
+void SCHED_Loop(void)
+{
+    uint32_t start;
+
+    while(1)
+    {
+        if(SCHED_Run()) continue;
+
+        start = SysTick->CNT;
+#if (SCHED_IDLE == SCHED_IDLE_WFI)
+        __WFI();
+#elif (SCHED_IDLE == SCHED_IDLE_STANDBY)
+        if(!SCHED_Standby()) __WFI();
+#endif
+        sched_idle += SysTick->CNT - start;
+    }
+}
+
+/*********************************************************************
+ * @fn      SCHED_GetStats
+ *
+ * @brief   Copies the runtime statistics of one task.
+ *
+ * @return  none
+ */
+void SCHED_GetStats(int8_t id, sched_stats_t *stats)
+{
+    if(id < 0 || id >= sched_count) return;
+
+    *stats = sched_task[id].stats;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Dump
+ *
+ * @brief   Prints runs and cycles per task and the idle share since the
+ *          previous dump, then starts a new measurement window.
+ *
+ * @return  none
+ */
+void SCHED_Dump(void)
+{
+    uint64_t window = (uint64_t)(sched_tick - sched_since) * sched_tick_cycles;
+    uint64_t idle = (sched_idle < window) ? sched_idle : window;
+    sched_stats_t *s;
+    uint8_t i;
+
+    /* Scaled down so that idle * 1000 / window stays in 32 bits */
+    while(window >> 22)
+    {
+        window >>= 1;
+        idle >>= 1;
+    }
+
+    TF_LOG("\r\nSCHED tick %u ms, %u late, idle %u/1000\r\n", (unsigned)sched_tick, (unsigned)sched_late,
+           (unsigned)(window ? (uint32_t)idle * 1000 / (uint32_t)window : 0));
+    for(i = 0; i < sched_count; i++)
+    {
+        s = &sched_task[i].stats;
+        TF_LOG("%-10s n=%u avg=%u max=%u\r\n", sched_task[i].name, (unsigned)s->runs,
+               (unsigned)PERF_Avg(s->total, s->runs), (unsigned)s->max);
+        s->runs = 0;
+        s->max = 0;
+        s->total = 0;
+    }
+
+    sched_idle = 0;
+    sched_since = sched_tick;
+}
@@ -0,0 +1,62 @@
+/*
+ * sched.h
+ *
+ *  Cooperative run-to-completion scheduler for the APP main loop.
+ *
+ *  Tasks are plain functions that do a bounded amount of work and return.
+ *  A task runs when its period has elapsed (period in ms, 0 = event only)
+ *  or when SCHED_Signal() flagged it, from an interrupt or another task.
+ *  Long jobs such as SPI flash maintenance are split into steps: the task
+ *  does one step and, if there is more to do, signals itself with
+ *  SCHED_Signal(SCHED_Self()) so latency sensitive tasks get a turn first.
+ *
+ *  The millisecond tick comes from the SysTick compare interrupt; the
+ *  counter itself keeps running free (Delay, PERF and TRACE rely on it).
+ *  Every run is timed in HCLK cycles, and time with no task ready is
+ *  accounted as idle.
+ */
+
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <ch32v00x.h>
+
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS   8
+#endif
+
+/* What the loop does when no task is ready */
+#define SCHED_IDLE_SPIN   0  //Keep polling
+#define SCHED_IDLE_WFI    1  //Sleep until the next interrupt (at most one tick)
+#define SCHED_IDLE_STANDBY 2 //Standby until the next deadline, see power.h
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE   SCHED_IDLE_WFI
+#endif
+
+/* Shortest gap worth a standby with SCHED_IDLE_STANDBY, WFI below it */
+#ifndef SCHED_STANDBY_MIN_MS
+#define SCHED_STANDBY_MIN_MS   5
+#endif
+
+typedef void (*sched_fn_t)(void);
+
+typedef struct {
+    uint32_t runs;
+    uint32_t max;            /* longest run, cycles */
+    uint64_t total;          /* cycles */
+} sched_stats_t;
+
+void SCHED_Init(void);
+void SCHED_Retime(void);
+int8_t SCHED_Add(sched_fn_t fn, const char *name, uint32_t period);
+void SCHED_SetPeriod(int8_t id, uint32_t period);
+void SCHED_Signal(int8_t id);
+int8_t SCHED_Self(void);
+uint32_t SCHED_Now(void);
+uint8_t SCHED_Run(void);
+void SCHED_Loop(void) __attribute__((noreturn));
+void SCHED_GetStats(int8_t id, sched_stats_t *stats);
+void SCHED_Dump(void);
+
+#endif /* SCHED_H_ */
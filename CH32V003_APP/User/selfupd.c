@@ -0,0 +1,287 @@
+/*
+ * selfupd.c
+ *
+ *  In-application update: SELFUPD_Apply() checks the image staged in the
+ *  external SPI flash through SPIF_read() and then hands over to a RAM
+ *  resident installer that erases and programs the internal flash, verifies
+ *  it and resets straight into the new image, no IAP round trip.
+ */
+
+#include "selfupd.h"
+#include "debug.h"
+#include "clock.h"
+
+#if (SELFUPD == SELFUPD_ENABLE)
+
+#define SELFUPD_PAGE_SIZE     64      /* fast erase/program page */
+#define SELFUPD_RETRIES       3
+#define SELFUPD_SPIF_READ     0x03
+
+#define SELFUPD_FLASH_KEY1    0x45670123
+#define SELFUPD_FLASH_KEY2    0xCDEF89AB
+
+/* Installer helpers, all inlined: see SELFUPD_Install() */
+#define SELFUPD_INLINE        static inline __attribute__((always_inline))
+
+_Static_assert((SELFUPD_INFO_ADDR >> 12) != 1, "security register 1 is rewritten at every boot by main()");
+
+static u32 selfupd_page[SELFUPD_PAGE_SIZE / 4];
+
+SELFUPD_INLINE u16 selfupd_crc16(u16 crc, u8 data)
+{
+    u8 i;
+
+    crc ^= (u16)data << 8;
+    for(i = 0; i < 8; i++)
+    {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+SELFUPD_INLINE u8 selfupd_spi_xfer(u8 data)
+{
+    SPI1->DATAR = data;
+    while(!(SPI1->STATR & SPI_I2S_FLAG_RXNE))
+        ;
+    return SPI1->DATAR;
+}
+
+/*
+ * A 64 byte read never crosses a page, so with striped chips it lives on
+ * one chip: odd pages on the second. Concatenated chips keep the staged
+ * image on the first one.
+ */
+SELFUPD_INLINE void selfupd_spi_read(u32 addr, u8 *buf)
+{
+    u32 i;
+
+#if (FLASH_CHIPS > 1) && (SPIF_LAYOUT == SPIF_LAYOUT_STRIPE)
+    u8 chip = (addr >> 8) & 1;
+
+    addr = ((addr >> 9) << 8) | (addr & 0xFF);
+    if(chip) FLASH_CS1_PORT->BCR = FLASH_CS1_PIN;
+    else GPIOD->BCR = FLASH_CS_PIN;
+#else
+    GPIOD->BCR = FLASH_CS_PIN;
+#endif
+    selfupd_spi_xfer(SELFUPD_SPIF_READ);
+    selfupd_spi_xfer((u8)(addr >> 16));
+    selfupd_spi_xfer((u8)(addr >> 8));
+    selfupd_spi_xfer((u8)addr);
+    for(i = 0; i < SELFUPD_PAGE_SIZE; i++)
+    {
+        buf[i] = selfupd_spi_xfer(0xFF);
+    }
+    GPIOD->BSHR = FLASH_CS_PIN;
+#if (FLASH_CHIPS > 1)
+    FLASH_CS1_PORT->BSHR = FLASH_CS1_PIN;
+#endif
+}
+
+SELFUPD_INLINE void selfupd_erase(u32 adr)
+{
+    FLASH->CTLR |= ((uint32_t)0x00020000);
+    FLASH->ADDR = adr;
+    FLASH->CTLR |= ((uint32_t)0x00000040);
+    while(FLASH->STATR & ((uint32_t)0x00000001))
+        ;
+    FLASH->CTLR &= ~((uint32_t)0x00020000);
+}
+
+/* Same sequence as CH32_IAP_Program(), which may itself live in flash */
+SELFUPD_INLINE void selfupd_program(u32 adr, const u32 *buf)
+{
+    u32 j;
+
+    FLASH->CTLR |= ((uint32_t)0x00010000);
+    FLASH->CTLR |= ((uint32_t)0x00080000);
+    while(FLASH->STATR & ((uint32_t)0x00000001))
+        ;
+    FLASH->CTLR &= ~((uint32_t)0x00010000);
+    for(j = 0; j < SELFUPD_PAGE_SIZE / 4; j++)
+    {
+        FLASH->CTLR |= ((uint32_t)0x00010000);
+        *(__IO uint32_t *)(adr + 4 * j) = buf[j];
+        FLASH->CTLR |= ((uint32_t)0x00040000);
+        while(FLASH->STATR & ((uint32_t)0x00000001))
+            ;
+        FLASH->CTLR &= ~((uint32_t)0x00010000);
+    }
+    FLASH->CTLR |= ((uint32_t)0x00010000);
+    FLASH->ADDR = adr;
+    FLASH->CTLR |= ((uint32_t)0x00000040);
+    while(FLASH->STATR & ((uint32_t)0x00000001))
+        ;
+    FLASH->CTLR &= ~((uint32_t)0x00010000);
+}
+
+SELFUPD_INLINE u8 selfupd_page_ok(u32 adr, const u32 *buf)
+{
+    u32 j;
+
+    for(j = 0; j < SELFUPD_PAGE_SIZE / 4; j++)
+    {
+        if(*(__IO uint32_t *)(adr + 4 * j) != buf[j]) return 0;
+    }
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      SELFUPD_Install
+ *
+ * @brief   RAM resident installer. Once page 0 is erased nothing in flash
+ *          may run, so it calls no functions (helpers are inlined, no
+ *          libgcc arithmetic, no memset for the padding) and never
+ *          returns. Boot mode is already set to BOOT by the caller and
+ *          the CalAddr marker is erased first, so after any failure or
+ *          power loss the IAP keeps waiting for an upload instead of
+ *          starting the half written image; only a verified image gets
+ *          the marker back and a USER mode reset.
+ *
+ * @param   len - image length in bytes
+ *          crc - expected CRC16 of the image
+ *
+ * @return  none
+ */
+__RAMCODE __attribute__((noreturn, optimize("no-tree-loop-distribute-patterns")))
+static void SELFUPD_Install(u32 len, u16 crc)
+{
+    u32 off, adr, i, n;
+    u16 sum = 0xFFFF;
+    u8 t;
+
+    /* Image reads at HCLK/2, the plain 0x03 read is rated well above that */
+    SPI1->CTLR1 &= ~SPI_BaudRatePrescaler_256;
+    (void)SPI1->DATAR;
+
+    FLASH->KEYR = SELFUPD_FLASH_KEY1;
+    FLASH->KEYR = SELFUPD_FLASH_KEY2;
+    FLASH->MODEKEYR = SELFUPD_FLASH_KEY1;
+    FLASH->MODEKEYR = SELFUPD_FLASH_KEY2;
+
+    /* No valid application until the marker is written back */
+    selfupd_erase(CalAddr & 0xFFFFFFC0);
+
+    for(off = 0; off < len; off += SELFUPD_PAGE_SIZE)
+    {
+        adr = FLASH_Base + off;
+        n = len - off;
+        if(n > SELFUPD_PAGE_SIZE) n = SELFUPD_PAGE_SIZE;
+
+        selfupd_spi_read(SELFUPD_IMAGE_ADDR + off, (u8 *)selfupd_page);
+        for(i = n; i < SELFUPD_PAGE_SIZE; i++)
+        {
+            ((u8 *)selfupd_page)[i] = 0xFF;
+        }
+
+        for(t = 0; t < SELFUPD_RETRIES; t++)
+        {
+            selfupd_erase(adr);
+            selfupd_program(adr, selfupd_page);
+            if(selfupd_page_ok(adr, selfupd_page)) break;
+        }
+        if(t == SELFUPD_RETRIES) goto fail;
+
+        for(i = 0; i < n; i++)
+        {
+            sum = selfupd_crc16(sum, *(__IO uint8_t *)(adr + i));
+        }
+    }
+    if(sum != crc) goto fail;
+
+    for(i = 0; i < SELFUPD_PAGE_SIZE / 4; i++)
+    {
+        selfupd_page[i] = 0xFFFFFFFF;
+    }
+    selfupd_page[(CalAddr & (SELFUPD_PAGE_SIZE - 1)) / 4] = CheckNum;
+    selfupd_program(CalAddr & 0xFFFFFFC0, selfupd_page);
+
+    /* Start_Mode_USER, see SystemReset_StartMode() */
+    FLASH->BOOT_MODEKEYR = SELFUPD_FLASH_KEY1;
+    FLASH->BOOT_MODEKEYR = SELFUPD_FLASH_KEY2;
+    FLASH->STATR &= ~(1<<14);
+
+fail:
+    FLASH->CTLR |= ((uint32_t)0x00000080);
+    NVIC_SystemReset();
+    while(1)
+        ;
+}
+
+/*********************************************************************
+ * @fn      SELFUPD_Apply
+ *
+ * @brief   Installs the staged image if there is a valid one. The image
+ *          length and checksum are checked against the external flash
+ *          first, so a bad staging leaves the running application alone.
+ *
+ * @return  SELFUPD_NONE - nothing staged
+ *          SELFUPD_ERR_LEN / SELFUPD_ERR_CHECKSUM - staged image rejected
+ *          SELFUPD_ERR_FLASH - external flash timed out, nothing installed
+ *          Does not return when the image is installed.
+ */
+SELFUPD_RET_t SELFUPD_Apply(void)
+{
+    flash_info_t info;
+    u8 buf[SELFUPD_PAGE_SIZE];
+    u32 off, n, i;
+    u16 sum = 0xFFFF;
+
+    if(SPIF_read(SECURITY_AREA, SELFUPD_INFO_ADDR, (uint8_t *)&info, sizeof(info)) != SPIF_OK) return SELFUPD_ERR_FLASH;
+    if(info.isNewFlash != SELFUPD_STAGED) return SELFUPD_NONE;
+    if(info.lenNew == 0 || info.lenNew > SELFUPD_MAX_LEN) return SELFUPD_ERR_LEN;
+
+    /* Full speed for the check and the install, which ends in a reset */
+    CLOCK_Set(CLOCK_48MHZ);
+
+    for(off = 0; off < info.lenNew; off += n)
+    {
+        n = info.lenNew - off;
+        if(n > sizeof(buf)) n = sizeof(buf);
+        if(SPIF_read(NORMAL_FLASH, SELFUPD_IMAGE_ADDR + off, buf, n) != SPIF_OK) return SELFUPD_ERR_FLASH;
+        for(i = 0; i < n; i++) sum = selfupd_crc16(sum, buf[i]);
+    }
+    if(sum != SELFUPD_CRC(info)) return SELFUPD_ERR_CHECKSUM;
+
+    info.isNewFlash = SELFUPD_INSTALLING;
+    if(SPIF_write(SECURITY_AREA, SELFUPD_INFO_ADDR, (uint8_t *)&info, sizeof(info)) != SPIF_OK) return SELFUPD_ERR_FLASH;
+
+    /* The installer reads the chips directly, the record may still be programming */
+    if(SPIF_wait_idle() != SPIF_OK) return SELFUPD_ERR_FLASH;
+
+    TF_LOG("Installing %u byte image\r\n", (unsigned)info.lenNew);
+    USART_Printf_Flush();
+
+    __disable_irq();
+    SystemReset_StartMode(Start_Mode_BOOT);
+    SELFUPD_Install(info.lenNew, SELFUPD_CRC(info));
+}
+
+/*********************************************************************
+ * @fn      SELFUPD_Check
+ *
+ * @brief   Boot time hook: completes the record of an install that just
+ *          finished (we are running, so it verified) or starts one for a
+ *          freshly staged image.
+ *
+ * @return  SELFUPD_OK - this image was just installed
+ *          otherwise as SELFUPD_Apply()
+ */
+SELFUPD_RET_t SELFUPD_Check(void)
+{
+    flash_info_t info;
+
+    if(SPIF_read(SECURITY_AREA, SELFUPD_INFO_ADDR, (uint8_t *)&info, sizeof(info)) != SPIF_OK) return SELFUPD_ERR_FLASH;
+    if(info.isNewFlash == SELFUPD_INSTALLING)
+    {
+        /* On a failure the record stays INSTALLING and the next boot retries */
+        info.isNewFlash = SELFUPD_IDLE;
+        if(SPIF_write(SECURITY_AREA, SELFUPD_INFO_ADDR, (uint8_t *)&info, sizeof(info)) != SPIF_OK) return SELFUPD_ERR_FLASH;
+        return SELFUPD_OK;
+    }
+
+    return SELFUPD_Apply();
+}
+
+#endif /* SELFUPD */
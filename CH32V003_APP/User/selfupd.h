@@ -0,0 +1,69 @@
+/*
+ * selfupd.h
+ *
+ *  In-application update from an image staged in the external SPI flash.
+ *
+ *  Staging contract: the raw application image (as programmed from address
+ *  0) sits at SELFUPD_IMAGE_ADDR in the normal flash, and the flash_info_t
+ *  record at SELFUPD_INFO_ADDR in the security area describes it:
+ *    isNewFlash = SELFUPD_STAGED
+ *    lenNew     = image length in bytes, at most SELFUPD_MAX_LEN
+ *    chkNew     = low byte of the CRC-16/CCITT-FALSE of the image
+ *                 (poly 0x1021, init 0xFFFF, no reflection, no xor out)
+ *    dummy      = high byte of that CRC
+ *
+ *  The install runs with the boot mode set to BOOT and erases the CalAddr
+ *  marker first; the IAP stays in the bootloader while the marker is
+ *  missing, so an interrupted install is recovered by a new upload.
+ */
+
+#ifndef SELFUPD_H_
+#define SELFUPD_H_
+
+#include <ch32v00x.h>
+#include "spiflash.h"
+#include "iap.h"
+
+#define SELFUPD_DISABLE   0
+#define SELFUPD_ENABLE    1
+
+#ifndef SELFUPD
+#define SELFUPD   SELFUPD_DISABLE
+#endif
+
+/*
+ * Location of the flash_info_t record: security register 2, which holds
+ * nothing else. Register 1 (0x1000) is erased and rewritten on every
+ * boot by the flash demo in main().
+ */
+#ifndef SELFUPD_INFO_ADDR
+#define SELFUPD_INFO_ADDR     0x2000
+#endif
+
+/* Start of the staged image, normal flash */
+#ifndef SELFUPD_IMAGE_ADDR
+#define SELFUPD_IMAGE_ADDR    0x00008000
+#endif
+
+/* Everything below the CalAddr page can be replaced */
+#define SELFUPD_MAX_LEN       ((CalAddr & 0xFFFFFFC0) - FLASH_Base)
+
+/* flash_info_t.isNewFlash states, each one only clears bits of the previous */
+#define SELFUPD_STAGED        0xAA
+#define SELFUPD_INSTALLING    0xA0
+#define SELFUPD_IDLE          0x00
+
+#define SELFUPD_CRC(info)     ((u16)(info).chkNew | ((u16)(info).dummy << 8))
+
+typedef enum {
+    SELFUPD_OK = 0,
+    SELFUPD_NONE = 1,
+    SELFUPD_ERR_LEN = 2,
+    SELFUPD_ERR_CHECKSUM = 3,
+    SELFUPD_ERR_FLASH = 4,
+} SELFUPD_RET_t;
+
+SELFUPD_RET_t SELFUPD_Check(void);
+SELFUPD_RET_t SELFUPD_Apply(void);
+
+#endif /* SELFUPD_H_ */
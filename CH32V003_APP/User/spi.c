@@ -17,6 +17,12 @@ void SPI_FullDuplex_Init(void)
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_30MHz;
     GPIO_Init(GPIOD, &GPIO_InitStructure);
 
+#if (FLASH_CHIPS > 1)
+    FLASH_CS1_PORT->BSHR = FLASH_CS1_PIN;
+    GPIO_InitStructure.GPIO_Pin = FLASH_CS1_PIN;
+    GPIO_Init(FLASH_CS1_PORT, &GPIO_InitStructure);
+#endif
+
     GPIO_InitStructure.GPIO_Pin = GPIO_Pin_5;
     GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_30MHz;
@@ -46,16 +52,36 @@ void SPI_FullDuplex_Init(void)
     SPI_InitStructure.SPI_FirstBit = SPI_FirstBit_MSB;
     SPI_InitStructure.SPI_CRCPolynomial = 7;
     SPI_Init( SPI1, &SPI_InitStructure );
+    SPI_Retime();
 
     SPI_Cmd( SPI1, ENABLE );
 }
 
-void spi_write(uint8_t data) {
+/*********************************************************************
+ * @fn      SPI_Retime
+ *
+ * @brief   Picks the smallest prescaler keeping SCK at or below
+ *          SPI_SCK_HZ for the current HCLK. Also registered as a
+ *          clock switch callback; must not run mid transfer.
+ *
+ * @return  none
+ */
+void SPI_Retime(void)
+{
+    uint16_t br = 0;
+
+    /* BR = n divides by 2^(n+1) */
+    while((br < 7) && ((SystemCoreClock >> (br + 1)) > SPI_SCK_HZ)) br++;
+
+    SPI1->CTLR1 = (SPI1->CTLR1 & ~SPI_BaudRatePrescaler_256) | (br << 3);
+}
+
+__HIGHCODE void spi_write(uint8_t data) {
     SPI1->DATAR = data;
     while ((!(SPI1->STATR & SPI_I2S_FLAG_TXE)) || (SPI1->STATR & SPI_I2S_FLAG_BSY)){};
 }
 
-uint8_t spi_write_read(uint8_t data) {
+__HIGHCODE uint8_t spi_write_read(uint8_t data) {
     (void)SPI1->DATAR; // Clear RXNE by reading it
     spi_write(data);
     
@@ -63,10 +89,62 @@ uint8_t spi_write_read(uint8_t data) {
     return SPI1->DATAR;
 }
 
+/*********************************************************************
+ * @fn      spi_write_buf
+ *
+ * @brief   Clocks out a buffer, received bytes are discarded.
+ *
+ * @return  none
+ */
+__HIGHCODE void spi_write_buf(const uint8_t *buf, uint32_t len) {
+    while (len--) {
+        SPI1->DATAR = *buf++;
+        while ((!(SPI1->STATR & SPI_I2S_FLAG_TXE)) || (SPI1->STATR & SPI_I2S_FLAG_BSY)){};
+        (void)SPI1->DATAR; // Discard the received byte, no overrun
+    }
+}
+
+/*********************************************************************
+ * @fn      spi_read_buf
+ *
+ * @brief   Fills a buffer with received bytes while sending dummy.
+ *
+ * @return  none
+ */
+__HIGHCODE void spi_read_buf(uint8_t *buf, uint32_t len, uint8_t dummy) {
+    (void)SPI1->DATAR;
+    while (len--) {
+        SPI1->DATAR = dummy;
+        while ((!(SPI1->STATR & SPI_I2S_FLAG_TXE)) || (SPI1->STATR & SPI_I2S_FLAG_BSY)){};
+        *buf++ = SPI1->DATAR;
+    }
+}
+
 void flash_select() {
     GPIOD->BCR = FLASH_CS_PIN;
 }
 
+/*********************************************************************
+ * @fn      flash_select_chip
+ *
+ * @brief   Selects one of the FLASH_CHIPS flash chips.
+ *
+ * @return  none
+ */
+void flash_select_chip(uint8_t chip) {
+#if (FLASH_CHIPS > 1)
+    if (chip) {
+        FLASH_CS1_PORT->BCR = FLASH_CS1_PIN;
+        return;
+    }
+#endif
+    (void)chip;
+    GPIOD->BCR = FLASH_CS_PIN;
+}
+
 void flash_deselect() {
     GPIOD->BSHR = FLASH_CS_PIN;
+#if (FLASH_CHIPS > 1)
+    FLASH_CS1_PORT->BSHR = FLASH_CS1_PIN;
+#endif
 }
\ No newline at end of file
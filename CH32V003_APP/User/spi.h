@@ -2,14 +2,32 @@
 #define __SPI_H
 
 #include <ch32v00x.h>
+/* Flash chips on the bus, each with its own chip select */
+#ifndef FLASH_CHIPS
+#define FLASH_CHIPS   1
+#endif
+#if (FLASH_CHIPS > 2)
+#error "FLASH_CHIPS: at most two chip selects are wired"
+#endif
+
 /* Chip select */
 #define FLASH_CS_PIN  GPIO_Pin_0 // PD0
+#define FLASH_CS1_PORT GPIOC
+#define FLASH_CS1_PIN GPIO_Pin_3 // PC3, second chip
 
+/* Highest SCK rate used with the flash, the prescaler is picked per clock */
+#ifndef SPI_SCK_HZ
+#define SPI_SCK_HZ    187500
+#endif
 
 
 void SPI_FullDuplex_Init();
+void SPI_Retime(void);
 uint8_t spi_write_read(uint8_t data);
+void spi_write_buf(const uint8_t *buf, uint32_t len);
+void spi_read_buf(uint8_t *buf, uint32_t len, uint8_t dummy);
 void flash_select();
+void flash_select_chip(uint8_t chip);
 void flash_deselect();
 
 #define SPIF_CS_enable flash_select
@@ -6,6 +6,9 @@
 
 #define F_CPU 16000000UL
 #include "spiflash.h"
+#include "string.h"
+#include "perf.h"
+#include "trace.h"
 
 /* Winbound W25Q512JV instruction set */
 
@@ -25,6 +28,10 @@
 #define SPIF_INST_3B_ERASE_SEC_RES          0x44
 #define SPIF_INST_ERASE_32BLOCK             0x52
 #define SPIF_INST_ERASE                     0xC7
+#define SPIF_INST_POWER_DOWN                0xB9
+#define SPIF_INST_RELEASE_POWER_DOWN        0xAB
+#define SPIF_INST_ERASE_SUSPEND             0x75
+#define SPIF_INST_ERASE_RESUME              0x7A
 
 
 /* Winbound W25Q512JV status register */
@@ -33,17 +40,198 @@
 
 /*
 ** Winbound specs
-** SPIF_SIZE is 67108864, last sector is used temporally on writing operations.
+** SPIF_SIZE is 67108864 per chip, the last logical sector is used
+** temporally on writing operations.
 */
 #define SPIF_PAGE_SIZE                      256
 #define SPIF_SECTOR_SIZE                    4096
-#define SPIF_VIRT_SIZE                      67104768
 #define SPIF_SIZE                           67108864
+#define SPIF_TOTAL_SIZE                     ((uint32_t)SPIF_SIZE * FLASH_CHIPS)
+#define SPIF_VIRT_SIZE                      (SPIF_TOTAL_SIZE - SPIF_ERASE_SIZE)
+#define SPIF_SCRATCH                        SPIF_VIRT_SIZE
+#define SPIF_SEC_REG_SIZE                   256
+
+/* Stack buffer for sector copies, divides SPIF_PAGE_SIZE */
+#define SPIF_COPY_CHUNK                     32
+
+#if SPIF_CACHE_LINES
+/*
+** Cache line tag: line address | 0x2 for the security area | 0x1 valid.
+** Replacement picks an invalid line or the least recently used one.
+*/
+static uint32_t spif_cache_tag[SPIF_CACHE_LINES];
+static uint32_t spif_cache_used[SPIF_CACHE_LINES];
+static uint32_t spif_cache_clock;
+static uint8_t spif_cache_data[SPIF_CACHE_LINES][SPIF_CACHE_LINE_SIZE];
+#endif
+static SPIF_cache_stats_t spif_cache_stats;
+
+/*
+** Deep power-down state. Starts set: the chip does not reset with the MCU
+** and may still be asleep from before a software reset, the first access
+** releases it (harmless if it was awake).
+*/
+static uint8_t spif_pd_asleep = 1;
+static uint8_t spif_pd_pins;
+static uint8_t spif_chip;
+static uint32_t spif_pd_last;
+static SPIF_pd_stats_t spif_pd_stats;
+
+/* Program/erase cycle pending on each chip and when it was started */
+#define SPIF_OP_NONE 0xFF
+static uint8_t spif_op[FLASH_CHIPS] = { [0 ... FLASH_CHIPS - 1] = SPIF_OP_NONE };
+static uint32_t spif_op_start[FLASH_CHIPS];
+static SPIF_wait_stats_t spif_wait_stats[SPIF_OP_COUNT];
+
+/* Chips with a suspended sector erase, and how far the erase had got */
+static uint8_t spif_sus_mask;
+static uint32_t spif_sus_elapsed[FLASH_CHIPS];
+static uint32_t spif_resumed;
+
+/* Typical time and budget per operation, us */
+static const uint32_t spif_op_time[SPIF_OP_COUNT][2] = {
+	{ SPIF_TPP_TYP_US, SPIF_TPP_TIMEOUT_US },
+	{ SPIF_TSE_TYP_US, SPIF_TSE_TIMEOUT_US },
+	{ SPIF_TCE_TYP_US, SPIF_TCE_TIMEOUT_US },
+	{ SPIF_TSE_TYP_US, SPIF_TSE_TIMEOUT_US },
+};
+
+static void SPIF_select(void);
+
+/* Every instruction goes through SPIF_select(), which wakes the chip */
+#undef SPIF_CS_enable
+#define SPIF_CS_enable SPIF_select
+
+SPIF_RET_t SPIF_uncheck_read(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size);
 
 /************************************************************************/
 /*                         AUXILIARY FUNCTIONS                          */
 /************************************************************************/
 
+/*
+** Picks the chip holding a logical address (see SPIF_LAYOUT) for the next
+** instructions and turns the address into that chip's own. Returns how
+** many bytes from there are contiguous on the chip: up to the end of the
+** page when striped.
+*/
+static uint32_t SPIF_map(uint8_t security_area, uint32_t* address)
+{
+#if (FLASH_CHIPS > 1)
+	uint32_t logical = *address;
+
+	if (security_area)
+	{
+		spif_chip = 0;
+		return SPIF_SIZE - logical;
+	}
+#if (SPIF_LAYOUT == SPIF_LAYOUT_STRIPE)
+	spif_chip = (logical / SPIF_PAGE_SIZE) % FLASH_CHIPS;
+	*address = (logical / (SPIF_PAGE_SIZE * FLASH_CHIPS)) * SPIF_PAGE_SIZE + logical % SPIF_PAGE_SIZE;
+	return SPIF_PAGE_SIZE - logical % SPIF_PAGE_SIZE;
+#else
+	spif_chip = logical / SPIF_SIZE;
+	*address = logical % SPIF_SIZE;
+	return SPIF_SIZE - *address;
+#endif
+#else
+	(void)security_area;
+	return SPIF_SIZE - *address;
+#endif
+}
+
+/*
+** Drops every cache line overlapping the given range. Called before any
+** program or erase so that the cache never returns stale data.
+*/
+void SPIF_cache_invalidate_range(uint8_t security_area, uint32_t address, uint32_t size)
+{
+#if SPIF_CACHE_LINES
+	uint32_t first = address & ~(uint32_t)(SPIF_CACHE_LINE_SIZE - 1);
+	uint32_t line;
+
+	for (uint8_t i = 0; i < SPIF_CACHE_LINES; i++)
+	{
+		if (!(spif_cache_tag[i] & 0x1)) continue;
+		if (((spif_cache_tag[i] >> 1) & 0x1) != (security_area ? 1 : 0)) continue;
+
+		line = spif_cache_tag[i] & ~(uint32_t)(SPIF_CACHE_LINE_SIZE - 1);
+		if (line >= first && line < address + size)
+		{
+			spif_cache_tag[i] = 0;
+		}
+	}
+#else
+	(void)security_area;
+	(void)address;
+	(void)size;
+#endif
+}
+
+#if SPIF_CACHE_LINES
+/*
+** Reads through the cache. The request must be no longer than one line,
+** so it touches at most two lines.
+*/
+SPIF_RET_t SPIF_cache_read(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
+{
+	uint32_t line, tag, n;
+	uint8_t i, victim;
+	SPIF_RET_t ret;
+
+	while (size)
+	{
+		line = address & ~(uint32_t)(SPIF_CACHE_LINE_SIZE - 1);
+		tag = line | (security_area ? 0x2 : 0x0) | 0x1;
+		n = SPIF_CACHE_LINE_SIZE - (address - line);
+		if (n > size) n = size;
+
+		victim = 0;
+		for (i = 0; i < SPIF_CACHE_LINES; i++)
+		{
+			if (spif_cache_tag[i] == tag) break;
+			if (!(spif_cache_tag[victim] & 0x1)) continue;
+			if (!(spif_cache_tag[i] & 0x1) || spif_cache_used[i] < spif_cache_used[victim]) victim = i;
+		}
+
+		if (i < SPIF_CACHE_LINES)
+		{
+			spif_cache_stats.hits++;
+		}
+		else
+		{
+			spif_cache_stats.misses++;
+			if (spif_cache_tag[victim] & 0x1) spif_cache_stats.evictions++;
+
+			i = victim;
+			spif_cache_tag[i] = 0;
+			ret = SPIF_uncheck_read(security_area, line, spif_cache_data[i], SPIF_CACHE_LINE_SIZE);
+			if (ret != SPIF_OK) return ret;
+			spif_cache_tag[i] = tag;
+		}
+
+		spif_cache_used[i] = ++spif_cache_clock;
+		memcpy(buff, &spif_cache_data[i][address - line], n);
+
+		buff += n;
+		address += n;
+		size -= n;
+	}
+
+	return SPIF_OK;
+}
+#endif
+
+/*
+** Chip select for every instruction. Releases the chip from deep power-down
+** first and notes the access time for the idle power-down.
+*/
+static void SPIF_select(void)
+{
+	if (spif_pd_asleep) SPIF_release_power_down();
+	spif_pd_last = SysTick->CNT;
+	flash_select_chip(spif_chip);
+}
+
 /*
 ** Reads Status Register. May be used at any time, even while a Program,
 ** Erase or Write Status Register cycle is in progress
@@ -60,13 +248,132 @@ uint8_t SPIF_read_status()
 	return status;
 }
 
+/* Notes the program/erase cycle just started on the selected chip */
+static void SPIF_op_started(uint8_t op)
+{
+	spif_op[spif_chip] = op;
+	spif_op_start[spif_chip] = SysTick->CNT;
+}
+
+/*
+** Waits without touching the bus, in steps short enough for the SysTick
+** count not to wrap.
+*/
+static void SPIF_sleep_us(uint32_t us)
+{
+	uint32_t n;
+#if SPIF_POLL_WFI
+	uint32_t start;
+#endif
+
+	while (us)
+	{
+		n = (us > 1000000) ? 1000000 : us;
+#if SPIF_POLL_WFI
+		if (n >= 1000)
+		{
+			start = SysTick->CNT;
+			while (SysTick->CNT - start < n * (SystemCoreClock / 1000000)) __WFI();
+		}
+		else
+#endif
+		Delay_Us(n);
+		us -= n;
+	}
+}
+
+/*
+** Waits until the selected chip has finished its program/erase cycle, see
+** SPIF_OP_* in spiflash.h for the polling schedule. Time already spent
+** since the operation was started counts, so a wait long after a
+** SPIF_*_start() call polls at once. A wait that polled is traced with
+** its poll count and duration.
+*/
+static SPIF_RET_t SPIF_wait_ready(void)
+{
+	uint8_t chip = spif_chip;
+	uint8_t op = spif_op[chip];
+	uint32_t cyc_us = SystemCoreClock / 1000000;
+	uint32_t start = SysTick->CNT;
+	uint32_t polls = 0;
+	uint32_t elapsed, gap, cap, t;
+	uint8_t busy;
+	SPIF_RET_t ret = SPIF_OK;
+
+	spif_op[chip] = SPIF_OP_NONE;
+	if (op == SPIF_OP_NONE)
+	{
+		if (!(SPIF_read_status() & SPIF_STAT_BUSY)) return SPIF_OK;
+		op = SPIF_OP_OTHER;
+		polls = 1;
+		elapsed = 0;
+	}
+	else
+	{
+		elapsed = (start - spif_op_start[chip]) / cyc_us;
+	}
+
+	gap = spif_op_time[op][0] / 2;
+	gap = (elapsed < gap) ? gap - elapsed : 0;
+	cap = spif_op_time[op][0] / 4;
+	if (cap < SPIF_POLL_MIN_US) cap = SPIF_POLL_MIN_US;
+
+	for (;;)
+	{
+		t = SysTick->CNT;
+		SPIF_sleep_us(gap);
+		busy = SPIF_read_status() & SPIF_STAT_BUSY;
+		polls++;
+		elapsed += (SysTick->CNT - t) / cyc_us;
+		if (!busy) break;
+
+		if (elapsed >= spif_op_time[op][1])
+		{
+			spif_wait_stats[op].timeouts++;
+			ret = SPIF_ERR_TIMEOUT;
+			break;
+		}
+
+		gap = (polls == 1 || gap < SPIF_POLL_MIN_US) ? SPIF_POLL_MIN_US : gap * 2;
+		if (gap > cap) gap = cap;
+	}
+
+	spif_wait_stats[op].waits++;
+	spif_wait_stats[op].polls += polls;
+	if (polls > spif_wait_stats[op].max_polls) spif_wait_stats[op].max_polls = polls;
+
+	TRACE_EVENT(TRACE_SPIF_BUSY, polls, TRACE_NOW() - start);
+	return ret;
+}
+
+/*
+** Waits until every chip has finished its program/erase cycle. A
+** suspended erase is resumed and waited for as well.
+*/
+static SPIF_RET_t SPIF_wait_all(void)
+{
+	uint8_t chip = spif_chip;
+	SPIF_RET_t ret = SPIF_OK;
+
+	if (spif_sus_mask) ret = SPIF_erase_resume();
+
+	for (spif_chip = 0; spif_chip < FLASH_CHIPS; spif_chip++)
+	{
+		if (SPIF_wait_ready() != SPIF_OK) ret = SPIF_ERR_TIMEOUT;
+	}
+	spif_chip = chip;
+
+	return ret;
+}
+
 /*
 ** Sets WEL bit to 1, keep in mind that Write enable bit is
 ** automatically reset after completion of the Write Status
 ** Register, Erase/Program Security Registers, Page Program,
-** Sector Erase, Block Erase, Chip Erase among others.
+** Sector Erase, Block Erase, Chip Erase among others. WEL is set as soon
+** as the instruction ends, a chip that never shows it is not answering.
 */
-void SPIF_enable_write()
+SPIF_RET_t SPIF_enable_write()
 {
 	SPIF_CS_disable();
 	SPIF_CS_enable();
@@ -75,9 +382,12 @@ void SPIF_enable_write()
 
 	SPIF_CS_disable();
 
-	while (!(SPIF_read_status() & SPIF_STAT_WRITE_ENABLE)) {}
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		if (SPIF_read_status() & SPIF_STAT_WRITE_ENABLE) return SPIF_OK;
+	}
 
-	return;
+	return SPIF_ERR_TIMEOUT;
 }
 
 /*
@@ -87,28 +397,42 @@ void SPIF_enable_write()
 */
 SPIF_RET_t SPIF_uncheck_read(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
 {
+	uint32_t chip_address, count;
 
-	if (address > SPIF_SIZE) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
-	if (address + size > SPIF_SIZE) return SPIF_ERR_SIZE_OUTOF_RANGE;
+	if (address > SPIF_TOTAL_SIZE) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
+	if (address + size > SPIF_TOTAL_SIZE) return SPIF_ERR_SIZE_OUTOF_RANGE;
 
-	while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+	TRACE_EVENT(TRACE_SPIF_READ, address, size);
 
-	SPIF_CS_disable();
-	SPIF_CS_enable();
+	/* One read instruction per contiguous run on a chip */
+	while (size)
+	{
+		chip_address = address;
+		count = SPIF_map(security_area, &chip_address);
+		if (count > size) count = size;
 
-	SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_READ : SPIF_INST_3B_READ);
+		if (SPIF_wait_ready() != SPIF_OK) return SPIF_ERR_TIMEOUT;
 
-	SPIF_send_inst(address >> 16);
-	SPIF_send_inst(address >> 8);
-	SPIF_send_inst(address);
-	if(security_area) SPIF_send_inst(SPIF_INST_READ_RESPONSE);
+		SPIF_CS_disable();
+		SPIF_CS_enable();
 
-	for (uint32_t j = 0; j < size; j++)
-	{
-		buff[j] = SPIF_send_inst(SPIF_INST_READ_RESPONSE);
-	}
+		SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_READ : SPIF_INST_3B_READ);
 
-	SPIF_CS_disable();
+		SPIF_send_inst(chip_address >> 16);
+		SPIF_send_inst(chip_address >> 8);
+		SPIF_send_inst(chip_address);
+		if(security_area) SPIF_send_inst(SPIF_INST_READ_RESPONSE);
+
+		PERF_BEGIN(PERF_SPI_PAGE_READ);
+		spi_read_buf(buff, count, SPIF_INST_READ_RESPONSE);
+		PERF_END(PERF_SPI_PAGE_READ);
+
+		SPIF_CS_disable();
+
+		buff += count;
+		address += count;
+		size -= count;
+	}
 
 	return SPIF_OK;
 }
@@ -116,149 +440,286 @@ SPIF_RET_t SPIF_uncheck_read(uint8_t security_area, uint32_t address, uint8_t* b
 /*
 ** Auxiliary function to write given buffer to flash. It has all memory address
 ** space available, including the last sector used as temporary storage.
+** Each page waits only for its own chip, so with striped chips a page is
+** sent while the previous one is still programming on the other chip.
 */
 SPIF_RET_t SPIF_uncheck_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
 {
-	uint32_t offset = 0;
-	uint32_t page_address = 0;
-	uint32_t first_page = address - (address % SPIF_PAGE_SIZE);
-	uint32_t last_page = ( (address + size - 1) / SPIF_PAGE_SIZE ) * SPIF_PAGE_SIZE;
-	int32_t pages_count = (size / SPIF_PAGE_SIZE) - 1;
+	uint32_t chip_address = 0;
 	uint32_t write_count = 0;
 
 	if (size <= 0 ) return SPIF_ERR_MEM_INVALID_ADDR;
-	if (address > SPIF_SIZE) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
-	if (address + size > SPIF_SIZE) return SPIF_ERR_SIZE_OUTOF_RANGE;
+	if (address > SPIF_TOTAL_SIZE) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
+	if (address + size > SPIF_TOTAL_SIZE) return SPIF_ERR_SIZE_OUTOF_RANGE;
 
-	while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+	SPIF_cache_invalidate_range(security_area, address, size);
 
-	/* Write first page */
+	TRACE_EVENT(TRACE_SPIF_WRITE, address, size);
 
-	SPIF_enable_write();
+	while (size)
+	{
+		/* Up to the end of the page */
+		chip_address = address;
+		SPIF_map(security_area, &chip_address);
+		write_count = SPIF_PAGE_SIZE - (address % SPIF_PAGE_SIZE);
+		if (write_count > size) write_count = size;
 
-	SPIF_CS_disable();
-	SPIF_CS_enable();
+		if (SPIF_wait_ready() != SPIF_OK || SPIF_enable_write() != SPIF_OK) return SPIF_ERR_TIMEOUT;
 
-	SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_WRITE : SPIF_INST_3B_WRITE);
-	SPIF_send_inst(address >> 16);
-	SPIF_send_inst(address >> 8);
-	SPIF_send_inst(address);
+		SPIF_CS_disable();
+		SPIF_CS_enable();
 
+		SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_WRITE : SPIF_INST_3B_WRITE);
+		SPIF_send_inst(chip_address >> 16);
+		SPIF_send_inst(chip_address >> 8);
+		SPIF_send_inst(chip_address);
 
-	if ( (address + size) >= (first_page + SPIF_PAGE_SIZE) )
-	{
-		write_count = first_page + SPIF_PAGE_SIZE - address;
-	}
-	else
-	{
-		write_count = size;
-	}
+		spi_write_buf(buff, write_count);
 
-	for (uint16_t j = 0; j < write_count; j++)
-	{
-		SPIF_send_inst(buff[j]);
+		SPIF_CS_disable();
+		SPIF_op_started(SPIF_OP_PROGRAM);
+
+		buff += write_count;
+		address += write_count;
+		size -= write_count;
 	}
 
-	SPIF_CS_disable();
+	return SPIF_OK;
+}
 
-	while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+/************************************************************************/
+/*                          EXPORTED FUNCTIONS                          */
+/************************************************************************/
 
-	/* Write pages in the middle */
+/*
+** Fill the whole flash with 0xFF, it may take some time. All chips erase at
+** once. A chip that does not answer is skipped.
+*/
+void SPIF_erase(void)
+{
+	if (spif_sus_mask) SPIF_erase_resume();
+	SPIF_cache_invalidate();
+
+	TRACE_EVENT(TRACE_SPIF_ERASE, 0, 2);
 
-	for (int32_t i = 0; i < pages_count; i++)
+	for (spif_chip = 0; spif_chip < FLASH_CHIPS; spif_chip++)
 	{
-		offset = i * SPIF_PAGE_SIZE + write_count;
-		page_address = first_page +  SPIF_PAGE_SIZE + (i * SPIF_PAGE_SIZE);
-		SPIF_enable_write();
+		if (SPIF_wait_ready() != SPIF_OK || SPIF_enable_write() != SPIF_OK) continue;
 
 		SPIF_CS_disable();
 		SPIF_CS_enable();
 
-		SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_WRITE : SPIF_INST_3B_WRITE);
-		SPIF_send_inst(page_address >> 16);
-		SPIF_send_inst(page_address >> 8);
-		SPIF_send_inst(page_address);
+		SPIF_send_inst(SPIF_INST_ERASE);
 
+		SPIF_CS_disable();
+		SPIF_op_started(SPIF_OP_CHIP_ERASE);
+	}
+	spif_chip = 0;
 
-		for (uint16_t j = 0; j < SPIF_PAGE_SIZE; j++)
-		{
-			SPIF_send_inst(buff[offset + j]);
-		}
+	return;
+}
 
-		SPIF_CS_disable();
+/* Fill the given sector with 0xFF, */
+void SPIF_3B_erase_page(uint8_t page)
+{
+	if (spif_sus_mask) SPIF_erase_resume();
+	SPIF_cache_invalidate_range(SECURITY_AREA, (uint32_t)(page & 0x0F) << 12, SPIF_SECTOR_SIZE);
 
-		while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+	TRACE_EVENT(TRACE_SPIF_ERASE, (uint32_t)(page & 0x0F) << 12, 1);
+	spif_chip = 0;
+	if (SPIF_wait_ready() != SPIF_OK || SPIF_enable_write() != SPIF_OK) return;
 
-	}
+	SPIF_CS_disable();
+	SPIF_CS_enable();
+
+	SPIF_send_inst(SPIF_INST_3B_ERASE_SEC_RES);
+
+	SPIF_send_inst(0x00);
+	SPIF_send_inst((page << 4) & 0xF0);
+	SPIF_send_inst(0x00);
+
+
+	SPIF_CS_disable();
+	SPIF_op_started(SPIF_OP_SECTOR_ERASE);
+
+	return;
+}
+
+/*
+** Starts a logical sector erase (SPIF_ERASE_SIZE, one 4KB sector on each
+** chip when striped) and returns without waiting for it to finish, so the
+** caller can keep working while the chips are busy (poll with
+** SPIF_is_busy() before issuing the next command).
+*/
+SPIF_RET_t SPIF_erase_sector_start(uint32_t address)
+{
+	uint32_t chip_address;
+
+	if (address >= SPIF_TOTAL_SIZE) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
+
+	address -= (address % SPIF_ERASE_SIZE);
+
+	/* The chips take no new erase while one is suspended */
+	if (spif_sus_mask && SPIF_erase_resume() != SPIF_OK) return SPIF_ERR_TIMEOUT;
+
+	SPIF_cache_invalidate_range(NORMAL_FLASH, address, SPIF_ERASE_SIZE);
 
+	TRACE_EVENT(TRACE_SPIF_ERASE, address, 0);
 
-	if(last_page && (first_page != last_page) )
+	for (uint32_t i = 0; i < SPIF_ERASE_SIZE / SPIF_SECTOR_SIZE; i++)
 	{
-		offset = last_page - address;
-		write_count = address + size - last_page;
+		chip_address = address + i * SPIF_PAGE_SIZE;
+		SPIF_map(NORMAL_FLASH, &chip_address);
 
-		SPIF_enable_write();
+		if (SPIF_wait_ready() != SPIF_OK || SPIF_enable_write() != SPIF_OK) return SPIF_ERR_TIMEOUT;
 
 		SPIF_CS_disable();
 		SPIF_CS_enable();
 
-		SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_WRITE : SPIF_INST_3B_WRITE);
-		SPIF_send_inst(last_page >> 16);
-		SPIF_send_inst(last_page >> 8);
-		SPIF_send_inst(last_page);
+		SPIF_send_inst(SPIF_INST_3B_ERASE_SECT);
+		SPIF_send_inst(chip_address >> 16);
+		SPIF_send_inst(chip_address >> 8);
+		SPIF_send_inst(chip_address);
 
-		for (uint16_t j = 0; j < write_count ; j++)
-		{
-			SPIF_send_inst(buff[offset + j]);
-		}
-        SPIF_CS_disable();
-		while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+		SPIF_CS_disable();
+		SPIF_op_started(SPIF_OP_SECTOR_ERASE);
 	}
 
 	return SPIF_OK;
 }
 
-/************************************************************************/
-/*                          EXPORTED FUNCTIONS                          */
-/************************************************************************/
-
-/* Fill the whole flash with 0xFF, it may take some time. */
-void SPIF_erase(void)
+/*
+** Programs up to one page and returns as soon as the data has been clocked
+** out. The range must not cross a page boundary and must already be erased.
+*/
+SPIF_RET_t SPIF_page_program_start(uint32_t address, uint8_t* buff, uint16_t size)
 {
-	while ((SPIF_read_status() & SPIF_STAT_BUSY)) {}
+	uint32_t chip_address = address;
 
-	SPIF_enable_write();
+	if (address >= SPIF_TOTAL_SIZE) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
+	if ((address % SPIF_PAGE_SIZE) + size > SPIF_PAGE_SIZE) return SPIF_ERR_SIZE_OUTOF_RANGE;
+
+	SPIF_cache_invalidate_range(NORMAL_FLASH, address, size);
+
+	TRACE_EVENT(TRACE_SPIF_PROGRAM, address, size);
+	SPIF_map(NORMAL_FLASH, &chip_address);
+	if (SPIF_wait_ready() != SPIF_OK || SPIF_enable_write() != SPIF_OK) return SPIF_ERR_TIMEOUT;
 
 	SPIF_CS_disable();
 	SPIF_CS_enable();
 
-	SPIF_send_inst(SPIF_INST_ERASE);
+	SPIF_send_inst(SPIF_INST_3B_WRITE);
+	SPIF_send_inst(chip_address >> 16);
+	SPIF_send_inst(chip_address >> 8);
+	SPIF_send_inst(chip_address);
+
+	PERF_BEGIN(PERF_SPI_PAGE_WRITE);
+	spi_write_buf(buff, size);
+	PERF_END(PERF_SPI_PAGE_WRITE);
 
 	SPIF_CS_disable();
+	SPIF_op_started(SPIF_OP_PROGRAM);
 
-	return;
+	return SPIF_OK;
 }
 
-/* Fill the given sector with 0xFF, */
-void SPIF_3B_erase_page(uint8_t page)
+/*
+** Suspends the sector erases running on the chips so that pages outside
+** the sectors being erased can be programmed and read meanwhile. A chip
+** is ready again within tSUS. Until SPIF_erase_resume() only page
+** programs and reads may be issued; any erase, SPIF_wait_idle() and the
+** power-down resume first. The time spent suspended does not count
+** against the erase budget. Returns SPIF_ERR_TIMEOUT if a chip is still
+** busy after 2 * tSUS, e.g. with a cycle that cannot be suspended.
+*/
+SPIF_RET_t SPIF_erase_suspend(void)
 {
-	while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+	uint8_t chip = spif_chip;
+	uint32_t cyc_us = SystemCoreClock / 1000000;
+	uint32_t start;
+	SPIF_RET_t ret = SPIF_OK;
 
-	SPIF_enable_write();
+	/* A suspend right after a resume must wait tSUS */
+	while (SysTick->CNT - spif_resumed < SPIF_TSUS_US * cyc_us);
 
-	SPIF_CS_disable();
-	SPIF_CS_enable();
+	for (spif_chip = 0; spif_chip < FLASH_CHIPS; spif_chip++)
+	{
+		if (spif_op[spif_chip] != SPIF_OP_SECTOR_ERASE) continue;
 
-	SPIF_send_inst(SPIF_INST_3B_ERASE_SEC_RES);
+		SPIF_CS_disable();
+		SPIF_CS_enable();
+		SPIF_send_inst(SPIF_INST_ERASE_SUSPEND);
+		SPIF_CS_disable();
 
-	SPIF_send_inst(0x00);
-	SPIF_send_inst((page << 4) & 0xF0);
-	SPIF_send_inst(0x00);
+		start = SysTick->CNT;
+		while (SPIF_read_status() & SPIF_STAT_BUSY)
+		{
+			if (SysTick->CNT - start >= 2 * SPIF_TSUS_US * cyc_us)
+			{
+				ret = SPIF_ERR_TIMEOUT;
+				break;
+			}
+		}
+		if (ret != SPIF_OK) break;
 
+		/* Also taken when the erase ended just before, the resume is then ignored */
+		spif_sus_elapsed[spif_chip] = start - spif_op_start[spif_chip];
+		spif_sus_mask |= 1 << spif_chip;
+		spif_op[spif_chip] = SPIF_OP_NONE;
+	}
+	spif_chip = chip;
 
-	SPIF_CS_disable();
+	return ret;
+}
 
-	return;
+/*
+** Resumes the erases stopped by SPIF_erase_suspend(), once what was
+** programmed meanwhile has finished. Their budget continues from where
+** it was suspended.
+*/
+SPIF_RET_t SPIF_erase_resume(void)
+{
+	uint8_t chip = spif_chip;
+	SPIF_RET_t ret = SPIF_OK;
+
+	for (spif_chip = 0; spif_chip < FLASH_CHIPS; spif_chip++)
+	{
+		if (!(spif_sus_mask & (1 << spif_chip))) continue;
+
+		if (SPIF_wait_ready() != SPIF_OK) ret = SPIF_ERR_TIMEOUT;
+
+		SPIF_CS_disable();
+		SPIF_CS_enable();
+		SPIF_send_inst(SPIF_INST_ERASE_RESUME);
+		SPIF_CS_disable();
+
+		spif_op[spif_chip] = SPIF_OP_SECTOR_ERASE;
+		spif_op_start[spif_chip] = SysTick->CNT - spif_sus_elapsed[spif_chip];
+	}
+	spif_sus_mask = 0;
+	spif_resumed = SysTick->CNT;
+	spif_chip = chip;
+
+	return ret;
+}
+
+/*
+** Return 1 while a program/erase cycle is still in progress on any chip.
+** A single poll per chip, the caller paces the calls.
+*/
+uint8_t SPIF_is_busy(void)
+{
+	uint8_t chip = spif_chip;
+	uint8_t busy = 0;
+
+	for (spif_chip = 0; spif_chip < FLASH_CHIPS; spif_chip++)
+	{
+		if (SPIF_read_status() & SPIF_STAT_BUSY) busy = 1;
+		else spif_op[spif_chip] = SPIF_OP_NONE;
+	}
+	spif_chip = chip;
+
+	return busy;
 }
 
 /* Return page size in bytes. */
@@ -267,10 +728,10 @@ uint16_t SPIF_get_page_size(void)
 	return SPIF_PAGE_SIZE;
 }
 
-/* Return sector size in bytes */
+/* Return the erase unit in bytes, a sector on each chip when striped */
 uint16_t SPIF_get_sector_size(void)
 {
-	return SPIF_SECTOR_SIZE;
+	return SPIF_ERASE_SIZE;
 }
 
 /* Return usable flash size in bytes */
@@ -286,85 +747,208 @@ SPIF_RET_t SPIF_read(uint8_t security_area, uint32_t address, uint8_t* buff, uin
 	if (address > SPIF_VIRT_SIZE )  return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
 	if (address + size > SPIF_VIRT_SIZE ) return SPIF_ERR_SIZE_OUTOF_RANGE;
 
+#if SPIF_CACHE_LINES
+	if (size <= SPIF_CACHE_LINE_SIZE) return SPIF_cache_read(security_area, address, buff, size);
+	spif_cache_stats.bypass++;
+#endif
+
 	return SPIF_uncheck_read(security_area, address, buff, size);
 }
 
 /*
-** Attempts to write data, if any involved page has no compatible data (writing
-** 1's where there is a 0's) then returns SPIF_ERR_INCOMPATIBLE_WRITE. Any previous
-** pages that were compatible are writen.
+** Deep power-down: the chip ignores everything but the release instruction
+** until the next access releases it. A running program/erase cycle is
+** waited for first, the chip does not accept the instruction while busy.
 */
-SPIF_RET_t SPIF_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
+void SPIF_power_down(void)
 {
-	uint32_t offset = 0;
-	uint32_t page_address = 0;
-	uint32_t remainder = size % SPIF_PAGE_SIZE;
-	uint8_t read_byte = 0;
-	uint8_t result = 0;
+	if (spif_pd_asleep) return;
 
-	/* Check for size errors */
-	if (address > SPIF_VIRT_SIZE ) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
-	if (address + size > SPIF_VIRT_SIZE ) return SPIF_ERR_SIZE_OUTOF_RANGE;
-
-	while (SPIF_read_status() & SPIF_STAT_BUSY) {}
+	if (SPIF_wait_all() != SPIF_OK) return;
 
-	for (uint32_t i = 0; i < (size / SPIF_PAGE_SIZE); i++)
+	for (uint8_t chip = 0; chip < FLASH_CHIPS; chip++)
 	{
-		offset = i * SPIF_PAGE_SIZE;
-		page_address = address + offset;
-
-		/* Check if compatible */
 		SPIF_CS_disable();
-		SPIF_CS_enable();
+		flash_select_chip(chip);
+		SPIF_send_inst(SPIF_INST_POWER_DOWN);
+		SPIF_CS_disable();
+	}
 
-		SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_READ : SPIF_INST_3B_READ);
-		//SPIF_send_inst(address >> 24);
-		SPIF_send_inst(address >> 16);
-		SPIF_send_inst(address >> 8);
-		SPIF_send_inst(address);
+	spif_pd_asleep = 1;
+	spif_pd_stats.sleeps++;
+}
 
-		for (uint32_t j = 0; j < SPIF_PAGE_SIZE; j++)
-		{
-			read_byte = SPIF_send_inst(SPIF_INST_READ_RESPONSE);
-			result = (~buff[offset + j]) | read_byte;
-			if( result != 0xFF) return SPIF_ERR_INCOMPATIBLE_WRITE;
-		}
+/*
+** Wakes the chip from deep power-down, it accepts commands after tRES1.
+** The time spent here is added to the wake cost.
+*/
+void SPIF_release_power_down(void)
+{
+	uint32_t start;
+
+	if (!spif_pd_asleep) return;
 
+	start = SysTick->CNT;
+	for (uint8_t chip = 0; chip < FLASH_CHIPS; chip++)
+	{
+		SPIF_CS_disable();
+		flash_select_chip(chip);
+		SPIF_send_inst(SPIF_INST_RELEASE_POWER_DOWN);
 		SPIF_CS_disable();
+	}
 
-		/* Write page */
-		SPIF_fast_write(security_area, page_address, buff+offset, SPIF_PAGE_SIZE);
+	Delay_Us(SPIF_TRES1_US);
+
+	spif_pd_asleep = 0;
+	spif_pd_stats.wakes++;
+	spif_pd_stats.wake_cycles += SysTick->CNT - start;
+}
+
+/*
+** Idle power-down, call periodically. With SPIF_PD_AUTO the chip goes to
+** deep power-down once nothing touched it for SPIF_PD_IDLE_MS, unless a
+** caller pinned it awake or a program/erase is still running or
+** suspended.
+*/
+void SPIF_pd_poll(void)
+{
+#if (SPIF_PD_POLICY == SPIF_PD_AUTO)
+	if (spif_pd_asleep || spif_pd_pins || spif_sus_mask) return;
+	if (SysTick->CNT - spif_pd_last < SPIF_PD_IDLE_MS * (SystemCoreClock / 1000)) return;
+	if (SPIF_is_busy()) return;
+
+	SPIF_power_down();
+#endif
+}
+
+/*
+** Pins the chip awake (pin = 1, woken now if asleep) or drops one pin
+** (pin = 0). Pins nest; the idle power-down waits until none is left.
+*/
+void SPIF_pd_pin(uint8_t pin)
+{
+	if (pin)
+	{
+		spif_pd_pins++;
+		SPIF_release_power_down();
 	}
+	else if (spif_pd_pins)
+	{
+		spif_pd_pins--;
+	}
+}
+
+/* Copy the power-down counters. */
+void SPIF_pd_get_stats(SPIF_pd_stats_t* stats)
+{
+	*stats = spif_pd_stats;
+}
 
-	if( remainder != 0 )
+/* Drop every cached line. */
+void SPIF_cache_invalidate(void)
+{
+#if SPIF_CACHE_LINES
+	memset(spif_cache_tag, 0, sizeof(spif_cache_tag));
+#endif
+}
+
+/*
+** Waits until every chip has finished its program/erase cycle. Writes
+** return before the last page is programmed, call this before accessing
+** the chips without the driver or before a reset.
+*/
+SPIF_RET_t SPIF_wait_idle(void)
+{
+	return SPIF_wait_all();
+}
+
+/* Copy the wait counters of one SPIF_OP_* kind. */
+void SPIF_wait_get_stats(uint8_t op, SPIF_wait_stats_t* stats)
+{
+	*stats = spif_wait_stats[op];
+}
+
+/* Copy the cache hit/miss/eviction counters. */
+void SPIF_cache_get_stats(SPIF_cache_stats_t* stats)
+{
+	*stats = spif_cache_stats;
+}
+
+/*
+** Returns SPIF_OK if the range can be programmed over what is stored, i.e.
+** the new data only clears bits. Reads one run per chip, waiting only for
+** the chip being read.
+*/
+static SPIF_RET_t SPIF_is_compatible(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
+{
+	uint32_t chip_address, count;
+	uint8_t read_byte = 0;
+	uint8_t result = 0;
+
+	while (size)
 	{
-		offset = size - remainder;
-		page_address = address + offset;
+		chip_address = address;
+		count = SPIF_map(security_area, &chip_address);
+		if (count > size) count = size;
+
+		if (SPIF_wait_ready() != SPIF_OK) return SPIF_ERR_TIMEOUT;
 
 		SPIF_CS_disable();
 		SPIF_CS_enable();
 
 		SPIF_send_inst(security_area ? SPIF_INST_3B_SEC_READ : SPIF_INST_3B_READ);
-		SPIF_send_inst(page_address >> 16);
-		SPIF_send_inst(page_address >> 8);
-		SPIF_send_inst(page_address);
+		SPIF_send_inst(chip_address >> 16);
+		SPIF_send_inst(chip_address >> 8);
+		SPIF_send_inst(chip_address);
+		if(security_area) SPIF_send_inst(SPIF_INST_READ_RESPONSE);
 
-		for (uint32_t j = 0; j < 1; j++)
+		for (uint32_t j = 0; j < count; j++)
 		{
 			read_byte = SPIF_send_inst(SPIF_INST_READ_RESPONSE);
-			result = (~buff[offset + j]) | read_byte;
-			if( result != 0xFF) return SPIF_ERR_INCOMPATIBLE_WRITE;
+			result = (~buff[j]) | read_byte;
+			if( result != 0xFF)
+			{
+				SPIF_CS_disable();
+				return SPIF_ERR_INCOMPATIBLE_WRITE;
+			}
 		}
 
 		SPIF_CS_disable();
 
-		SPIF_fast_write(security_area, page_address, buff+offset, remainder);
-
+		buff += count;
+		address += count;
+		size -= count;
 	}
 
 	return SPIF_OK;
 }
 
+/*
+** Attempts to write data. If any byte is not compatible with what is stored
+** (writing 1's where there are 0's) nothing is written and
+** SPIF_ERR_INCOMPATIBLE_WRITE is returned. Returns once the last page has
+** been sent; every later operation waits only for the chip it uses, so with
+** striped chips consecutive pages, also of consecutive calls, program in
+** parallel.
+*/
+SPIF_RET_t SPIF_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
+{
+	SPIF_RET_t ret;
+
+	/* Check for size errors */
+	if (address > SPIF_VIRT_SIZE ) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
+	if (address + size > SPIF_VIRT_SIZE ) return SPIF_ERR_SIZE_OUTOF_RANGE;
+	if (size == 0) return SPIF_OK;
+
+	PERF_BEGIN(PERF_SPIF_WRITE);
+
+	ret = SPIF_is_compatible(security_area, address, buff, size);
+	if (ret == SPIF_OK) ret = SPIF_uncheck_write(security_area, address, buff, size);
+
+	PERF_END(PERF_SPIF_WRITE);
+	return ret;
+}
+
 /*
 ** Write without erasing involved sectors. ONLY use when given sectors
 ** are filled with 0xFF (erased), otherwise the sectors may end up with
@@ -399,3 +983,78 @@ SPIF_RET_t SPIF_force_write(uint8_t security_area, uint32_t address, uint8_t* bu
 	return ret;
 }
 
+/*
+** Copies size bytes between flash locations through a stack buffer, with
+** the part of [address, address + size) that falls inside the source
+** window replaced by the new data. Chunks that read erased are not
+** programmed. Stops at the first flash error.
+*/
+static SPIF_RET_t SPIF_merge_copy(uint8_t src_area, uint32_t src, uint8_t dst_area, uint32_t dst,
+		uint32_t len, uint32_t address, uint8_t* buff, uint32_t size)
+{
+	uint8_t chunk[SPIF_COPY_CHUNK];
+	uint32_t lo, hi, j;
+	SPIF_RET_t ret;
+
+	for (uint32_t off = 0; off < len; off += SPIF_COPY_CHUNK)
+	{
+		ret = SPIF_uncheck_read(src_area, src + off, chunk, SPIF_COPY_CHUNK);
+		if (ret != SPIF_OK) return ret;
+
+		lo = (src + off > address) ? src + off : address;
+		hi = (src + off + SPIF_COPY_CHUNK < address + size) ? src + off + SPIF_COPY_CHUNK : address + size;
+		if (buff && lo < hi) memcpy(chunk + (lo - src - off), buff + (lo - address), hi - lo);
+
+		for (j = 0; j < SPIF_COPY_CHUNK && chunk[j] == 0xFF; j++) {}
+		if (j < SPIF_COPY_CHUNK)
+		{
+			ret = SPIF_uncheck_write(dst_area, dst + off, chunk, SPIF_COPY_CHUNK);
+			if (ret != SPIF_OK) return ret;
+		}
+	}
+
+	return SPIF_OK;
+}
+
+/*
+** Erase-aware write: every erase unit the range touches (a logical sector,
+** or a 256 byte security register) is copied to the scratch sector with the
+** new data merged in, erased and copied back. Not power-fail safe, a reset
+** between the erase and the copy back leaves the unit only in the scratch
+** sector.
+*/
+SPIF_RET_t SPIF_slow_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size)
+{
+	uint32_t unit = security_area ? SPIF_SEC_REG_SIZE : SPIF_ERASE_SIZE;
+	uint32_t base;
+	SPIF_RET_t ret = SPIF_OK;
+
+	if (size == 0) return SPIF_OK;
+	if (security_area)
+	{
+		if ((address % SPIF_SEC_REG_SIZE) + size > SPIF_SEC_REG_SIZE) return SPIF_ERR_SIZE_OUTOF_RANGE;
+	}
+	else
+	{
+		if (address > SPIF_VIRT_SIZE ) return SPIF_ERR_MEM_ADDR_OUTOF_RANGE;
+		if (address + size > SPIF_VIRT_SIZE ) return SPIF_ERR_SIZE_OUTOF_RANGE;
+	}
+
+	PERF_BEGIN(PERF_SPIF_WRITE);
+
+	for (base = address - (address % unit); base < address + size; base += unit)
+	{
+		ret = SPIF_erase_sector_start(SPIF_SCRATCH);
+		if (ret == SPIF_OK) ret = SPIF_merge_copy(security_area, base, NORMAL_FLASH, SPIF_SCRATCH, unit, address, buff, size);
+		if (ret != SPIF_OK) break;
+
+		if (security_area) SPIF_3B_erase_page(base >> 12);
+		else ret = SPIF_erase_sector_start(base);
+		if (ret == SPIF_OK) ret = SPIF_merge_copy(NORMAL_FLASH, SPIF_SCRATCH, security_area, base, unit, 0, NULL, 0);
+		if (ret != SPIF_OK) break;
+	}
+
+	PERF_END(PERF_SPIF_WRITE);
+	return ret;
+}
+
@@ -25,6 +25,7 @@ typedef enum {
 	SPIF_ERR_SIZE_OUTOF_RANGE = 2,
 	SPIF_ERR_MEM_INVALID_ADDR = 3,
 	SPIF_ERR_INCOMPATIBLE_WRITE = 4,
+	SPIF_ERR_TIMEOUT = 5,
 } SPIF_RET_t;
 
 typedef struct {
@@ -39,9 +40,141 @@ typedef struct {
 #define NORMAL_FLASH 0
 #define SECURITY_AREA 1
 
+/*
+** Address layout with FLASH_CHIPS 2. STRIPE interleaves 256 byte pages
+** between the chips: while one chip is busy programming a page the next
+** page already goes to the other, and a logical sector is the two chip
+** sectors erased together. CONCAT places chip 1 after chip 0 for
+** capacity. The security registers are always chip 0's.
+*/
+#define SPIF_LAYOUT_STRIPE 0
+#define SPIF_LAYOUT_CONCAT 1
+
+#ifndef SPIF_LAYOUT
+#define SPIF_LAYOUT SPIF_LAYOUT_STRIPE
+#endif
+
+/* Logical erase unit, what SPIF_erase_sector_start() clears */
+#if (FLASH_CHIPS > 1) && (SPIF_LAYOUT == SPIF_LAYOUT_STRIPE)
+#define SPIF_ERASE_SIZE (4096 * FLASH_CHIPS)
+#else
+#define SPIF_ERASE_SIZE 4096
+#endif
+
+/*
+** Optional read cache in RAM: SPIF_CACHE_LINES lines of SPIF_CACHE_LINE_SIZE
+** bytes (power of two, 4..256). Reads up to one line long are served from
+** the cache, longer reads go straight to the chip. Writes and erases
+** invalidate the lines they touch. 0 lines disables the cache.
+*/
+#ifndef SPIF_CACHE_LINES
+#define SPIF_CACHE_LINES 4
+#endif
+
+#ifndef SPIF_CACHE_LINE_SIZE
+#define SPIF_CACHE_LINE_SIZE 32
+#endif
+
+/* Deep power-down release time (tRES1) */
+#ifndef SPIF_TRES1_US
+#define SPIF_TRES1_US 8
+#endif
+
+/*
+** Deep power-down policy. Any access to a sleeping chip releases it first,
+** the policy only decides whether SPIF_pd_poll() puts an idle chip to sleep.
+*/
+#define SPIF_PD_NEVER 0
+#define SPIF_PD_AUTO  1
+
+#ifndef SPIF_PD_POLICY
+#define SPIF_PD_POLICY SPIF_PD_AUTO
+#endif
+
+/* Time without access before SPIF_pd_poll() powers the chip down */
+#ifndef SPIF_PD_IDLE_MS
+#define SPIF_PD_IDLE_MS 50
+#endif
+
+/*
+** Busy polling. A wait sleeps until half the typical time of the pending
+** operation is over, then polls the status with gaps doubling from
+** SPIF_POLL_MIN_US up to a quarter of the typical time, and gives up with
+** SPIF_ERR_TIMEOUT once the operation's budget is spent. Times are us,
+** typical from the W25Q512JV datasheet, budgets about twice its maximum.
+*/
+#define SPIF_OP_PROGRAM      0
+#define SPIF_OP_SECTOR_ERASE 1
+#define SPIF_OP_CHIP_ERASE   2
+#define SPIF_OP_OTHER        3  /* found busy with nothing pending, e.g. after a reset */
+#define SPIF_OP_COUNT        4
+
+#ifndef SPIF_TPP_TYP_US
+#define SPIF_TPP_TYP_US      400
+#endif
+#ifndef SPIF_TPP_TIMEOUT_US
+#define SPIF_TPP_TIMEOUT_US  6000
+#endif
+#ifndef SPIF_TSE_TYP_US
+#define SPIF_TSE_TYP_US      45000
+#endif
+#ifndef SPIF_TSE_TIMEOUT_US
+#define SPIF_TSE_TIMEOUT_US  800000
+#endif
+#ifndef SPIF_TCE_TYP_US
+#define SPIF_TCE_TYP_US      150000000
+#endif
+#ifndef SPIF_TCE_TIMEOUT_US
+#define SPIF_TCE_TIMEOUT_US  800000000
+#endif
+
+/* Erase suspend latency (tSUS), also the least time from a resume to the next suspend */
+#ifndef SPIF_TSUS_US
+#define SPIF_TSUS_US         20
+#endif
+
+#ifndef SPIF_POLL_MIN_US
+#define SPIF_POLL_MIN_US     10
+#endif
+
+/*
+** 1: sleep with WFI between polls when the gap is 1 ms or more. Needs a
+** periodic interrupt to wake up, such as the SCHED tick.
+*/
+#ifndef SPIF_POLL_WFI
+#define SPIF_POLL_WFI        0
+#endif
+
+typedef struct {
+	uint32_t waits;        /* waits on a pending or busy operation */
+	uint32_t polls;        /* status reads, all waits */
+	uint32_t max_polls;    /* most status reads in one wait */
+	uint32_t timeouts;
+} SPIF_wait_stats_t;
+
+typedef struct {
+	uint32_t sleeps;
+	uint32_t wakes;
+	uint32_t wake_cycles;
+} SPIF_pd_stats_t;
+
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	uint32_t bypass;
+} SPIF_cache_stats_t;
+
 /* SPI Flash operations */
 SPIF_API void SPIF_erase(void);
 SPIF_API void SPIF_3B_erase_page(uint8_t page);
+SPIF_API SPIF_RET_t SPIF_erase_sector_start(uint32_t address);
+SPIF_API SPIF_RET_t SPIF_page_program_start(uint32_t address, uint8_t* buff, uint16_t size);
+SPIF_API SPIF_RET_t SPIF_erase_suspend(void);
+SPIF_API SPIF_RET_t SPIF_erase_resume(void);
+SPIF_API uint8_t SPIF_is_busy(void);
+SPIF_API SPIF_RET_t SPIF_wait_idle(void);
+SPIF_API void SPIF_wait_get_stats(uint8_t op, SPIF_wait_stats_t* stats);
 SPIF_API uint16_t SPIF_get_page_size(void);
 SPIF_API uint16_t SPIF_get_sector_size(void);
 SPIF_API uint32_t SPIF_get_size(void);
@@ -50,5 +183,12 @@ SPIF_API SPIF_RET_t SPIF_write(uint8_t security_area, uint32_t address, uint8_t*
 SPIF_API SPIF_RET_t SPIF_fast_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size);
 SPIF_API SPIF_RET_t SPIF_force_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size);
 SPIF_API SPIF_RET_t SPIF_slow_write(uint8_t security_area, uint32_t address, uint8_t* buff, uint32_t size);
+SPIF_API void SPIF_power_down(void);
+SPIF_API void SPIF_release_power_down(void);
+SPIF_API void SPIF_pd_poll(void);
+SPIF_API void SPIF_pd_pin(uint8_t pin);
+SPIF_API void SPIF_pd_get_stats(SPIF_pd_stats_t* stats);
+SPIF_API void SPIF_cache_invalidate(void);
+SPIF_API void SPIF_cache_get_stats(SPIF_cache_stats_t* stats);
 
 #endif /* SPIFLASH_H_ */
\ No newline at end of file
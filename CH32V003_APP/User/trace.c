@@ -0,0 +1,82 @@
+/*
+ * trace.c
+ *
+ *  Event trace ring and its dump over the debug output.
+ */
+
+#include "trace.h"
+
+#if (TRACE == TRACE_ENABLE)
+
+#include "debug.h"
+
+extern int _write(int fd, char *buf, int size);
+
+trace_event_t trace_ring[TRACE_DEPTH];
+uint32_t trace_head = 0;
+
+/*********************************************************************
+ * @fn      TRACE_Clear
+ *
+ * @brief   Empties the ring.
+ *
+ * @return  none
+ */
+void TRACE_Clear(void)
+{
+    trace_head = 0;
+}
+
+/*********************************************************************
+ * @fn      TRACE_Dump
+ *
+ * @brief   Sends the recorded events, oldest first, as one binary frame
+ *          on the debug UART or SDI. Events traced from interrupts
+ *          while it runs may overwrite the oldest records on the way.
+ *
+ * @return  none
+ */
+void TRACE_Dump(void)
+{
+    uint8_t hdr[8];
+    uint32_t head = trace_head;
+    uint32_t first, count, clk, i, j;
+    uint16_t sum = 0;
+    const uint8_t *p;
+
+    count = (head > TRACE_DEPTH) ? TRACE_DEPTH : head;
+    first = head - count;
+    clk = SystemCoreClock;
+
+    hdr[0] = TRACE_SYNC1;
+    hdr[1] = TRACE_SYNC2;
+    hdr[2] = (uint8_t)count;
+    hdr[3] = (uint8_t)(count >> 8);
+    hdr[4] = (uint8_t)clk;
+    hdr[5] = (uint8_t)(clk >> 8);
+    hdr[6] = (uint8_t)(clk >> 16);
+    hdr[7] = (uint8_t)(clk >> 24);
+    _write(1, (char *)hdr, 8);
+    for(i = 2; i < 8; i++) sum += hdr[i];
+
+    hdr[0] = (uint8_t)head;
+    hdr[1] = (uint8_t)(head >> 8);
+    hdr[2] = (uint8_t)(head >> 16);
+    hdr[3] = (uint8_t)(head >> 24);
+    _write(1, (char *)hdr, 4);
+    for(i = 0; i < 4; i++) sum += hdr[i];
+
+    /* Records go out as they are in RAM, the core is little endian */
+    for(i = first; i != head; i++)
+    {
+        p = (const uint8_t *)&trace_ring[i & (TRACE_DEPTH - 1)];
+        _write(1, (char *)p, sizeof(trace_event_t));
+        for(j = 0; j < sizeof(trace_event_t); j++) sum += p[j];
+    }
+
+    hdr[0] = (uint8_t)sum;
+    hdr[1] = (uint8_t)(sum >> 8);
+    _write(1, (char *)hdr, 2);
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * trace.h
+ *
+ *  Binary event trace: a RAM ring of fixed size records (SysTick
+ *  timestamp, event ID, two 32 bit arguments). TRACE() costs a handful of
+ *  stores and does not touch the UART, so it can sit in timing sensitive
+ *  paths; TRACE_Dump() sends the ring as one frame that Tools/tracedecode
+ *  turns into a timeline. Everything compiles to nothing unless TRACE is
+ *  set to TRACE_ENABLE.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <ch32v00x.h>
+
+#define TRACE_DISABLE   0
+#define TRACE_ENABLE    1
+
+#ifndef TRACE
+#define TRACE   TRACE_DISABLE
+#endif
+
+/* Records kept, power of two, 16 bytes each */
+#ifndef TRACE_DEPTH
+#define TRACE_DEPTH     16
+#endif
+
+/* Dump frame: sync, count16, clock32, total32, records, sum16 (all LE) */
+#define TRACE_SYNC1     0xD7
+#define TRACE_SYNC2     0x7D
+
+/* Event IDs, keep Tools/tracedecode in step */
+typedef enum {
+    TRACE_SPIF_READ = 1,     /* address, size */
+    TRACE_SPIF_WRITE,        /* address, size */
+    TRACE_SPIF_ERASE,        /* address, 0 = sector, 1 = security register, 2 = chip */
+    TRACE_SPIF_PROGRAM,      /* address, size (non blocking page program) */
+    TRACE_SPIF_BUSY,         /* status polls, cycles spent waiting */
+    TRACE_IAP_RX,            /* command, length (frame header received) */
+    TRACE_IAP_RX_BAD,        /* command, computed checksum */
+    TRACE_IAP_CMD,           /* command, status */
+    TRACE_IAP_PROGRAM,       /* flash address, 0 */
+    TRACE_USER = 0x80,       /* free for ad hoc events */
+} trace_id_t;
+
+typedef struct {
+    uint32_t ts;             /* SysTick->CNT, HCLK cycles */
+    uint32_t id;
+    uint32_t a0;
+    uint32_t a1;
+} trace_event_t;
+
+#if (TRACE == TRACE_ENABLE)
+
+extern trace_event_t trace_ring[TRACE_DEPTH];
+extern uint32_t trace_head;
+
+/*
+ * Not interrupt safe on purpose (RV32EC has no atomics): an interrupt that
+ * traces between the index load and store shares the slot, which costs one
+ * record, not a crash.
+ */
+__attribute__((always_inline)) static inline void TRACE_Record(uint32_t id, uint32_t a0, uint32_t a1)
+{
+    trace_event_t *e = &trace_ring[trace_head++ & (TRACE_DEPTH - 1)];
+
+    e->ts = SysTick->CNT;
+    e->id = id;
+    e->a0 = a0;
+    e->a1 = a1;
+}
+
+#define TRACE_EVENT(id, a0, a1)   TRACE_Record((id), (uint32_t)(a0), (uint32_t)(a1))
+#define TRACE_NOW()               (SysTick->CNT)
+
+void TRACE_Clear(void);
+void TRACE_Dump(void);
+
+#else
+
+#define TRACE_EVENT(id, a0, a1)   ((void)0)
+#define TRACE_NOW()               0
+#define TRACE_Clear()             ((void)0)
+#define TRACE_Dump()              ((void)0)
+
+#endif
+
+#endif /* TRACE_H_ */
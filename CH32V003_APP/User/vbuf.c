@@ -0,0 +1,146 @@
+/*
+ * vbuf.c
+ *
+ *  Virtual buffer over the external SPI flash, see vbuf.h. Each frame
+ *  carries the virtual address it holds and a use stamp; a fault takes the
+ *  frame with the oldest stamp, writing it back first if it is dirty.
+ */
+
+#include "vbuf.h"
+
+#if (VBUF == VBUF_ENABLE)
+
+#define VBUF_VALID    0x01
+#define VBUF_DIRTY    0x02
+
+typedef struct {
+    uint32_t tag;          /* virtual address of data[0] */
+    uint16_t stamp;
+    uint8_t flags;
+    uint8_t data[VBUF_FRAME_SIZE];
+} vbuf_frame_t;
+
+static vbuf_frame_t vbuf_frames[VBUF_FRAMES];
+static uint16_t vbuf_clock;
+static vbuf_stats_t vbuf_stats;
+
+/*********************************************************************
+ * @fn      VBUF_WriteBack
+ *
+ * @brief   Writes a dirty frame back, erasing the sector if needed.
+ *
+ * @return  none
+ */
+static void VBUF_WriteBack(vbuf_frame_t *f)
+{
+    if((f->flags & (VBUF_VALID | VBUF_DIRTY)) != (VBUF_VALID | VBUF_DIRTY)) return;
+
+    if(SPIF_force_write(NORMAL_FLASH, VBUF_ADDR + f->tag, f->data, VBUF_FRAME_SIZE) != SPIF_OK) vbuf_stats.errors++;
+    else vbuf_stats.writebacks++;
+    f->flags &= ~VBUF_DIRTY;
+}
+
+/* Frame holding a virtual address, NULL if none */
+static vbuf_frame_t *VBUF_Find(uint32_t tag)
+{
+    uint8_t i;
+
+    for(i = 0; i < VBUF_FRAMES; i++)
+    {
+        if((vbuf_frames[i].flags & VBUF_VALID) && vbuf_frames[i].tag == tag) return &vbuf_frames[i];
+    }
+    return NULL;
+}
+
+/*********************************************************************
+ * @fn      VBUF_Get
+ *
+ * @brief   Maps a virtual address into RAM, faulting its frame in if
+ *          needed.
+ *
+ * @param   addr - virtual address, below VBUF_SIZE
+ *
+ * @return  pointer to the byte, NULL if out of range
+ */
+void *VBUF_Get(uint32_t addr)
+{
+    uint32_t tag = addr & ~(uint32_t)(VBUF_FRAME_SIZE - 1);
+    vbuf_frame_t *f;
+    uint8_t i;
+
+    if(addr >= VBUF_SIZE) return NULL;
+    vbuf_stats.gets++;
+
+    f = VBUF_Find(tag);
+    if(!f)
+    {
+        /* Invalid frames first, then the least recently used one */
+        f = &vbuf_frames[0];
+        for(i = 0; i < VBUF_FRAMES; i++)
+        {
+            if(!(vbuf_frames[i].flags & VBUF_VALID))
+            {
+                f = &vbuf_frames[i];
+                break;
+            }
+            if((uint16_t)(vbuf_clock - vbuf_frames[i].stamp) > (uint16_t)(vbuf_clock - f->stamp)) f = &vbuf_frames[i];
+        }
+
+        VBUF_WriteBack(f);
+        vbuf_stats.faults++;
+        f->flags = 0;
+        if(SPIF_read(NORMAL_FLASH, VBUF_ADDR + tag, f->data, VBUF_FRAME_SIZE) != SPIF_OK) vbuf_stats.errors++;
+        f->tag = tag;
+        f->flags = VBUF_VALID;
+    }
+
+    f->stamp = vbuf_clock++;
+    return &f->data[addr - tag];
+}
+
+/*********************************************************************
+ * @fn      VBUF_Dirty
+ *
+ * @brief   Marks the frame holding addr as changed. The frame must be
+ *          resident, i.e. addr obtained from VBUF_Get() and not evicted.
+ *
+ * @param   addr - virtual address
+ *
+ * @return  none
+ */
+void VBUF_Dirty(uint32_t addr)
+{
+    vbuf_frame_t *f = VBUF_Find(addr & ~(uint32_t)(VBUF_FRAME_SIZE - 1));
+
+    if(f) f->flags |= VBUF_DIRTY;
+}
+
+/*********************************************************************
+ * @fn      VBUF_Flush
+ *
+ * @brief   Writes every dirty frame back, frames stay resident.
+ *
+ * @return  none
+ */
+void VBUF_Flush(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < VBUF_FRAMES; i++) VBUF_WriteBack(&vbuf_frames[i]);
+}
+
+/* Drops every frame without writing it back, e.g. after the region was erased */
+void VBUF_Invalidate(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < VBUF_FRAMES; i++) vbuf_frames[i].flags = 0;
+}
+
+/* Copy the fault and write-back counters. */
+void VBUF_GetStats(vbuf_stats_t *stats)
+{
+    *stats = vbuf_stats;
+}
+
+#endif /* VBUF */
@@ -0,0 +1,57 @@
+/*
+ * vbuf.h
+ *
+ *  Virtual buffer: a byte array of VBUF_SIZE bytes kept in the external
+ *  SPI flash at VBUF_ADDR and seen through VBUF_FRAMES frames of
+ *  VBUF_FRAME_SIZE bytes in RAM, least recently used frame replaced.
+ *
+ *  VBUF_Get() returns a RAM pointer to a virtual address, valid up to the
+ *  end of its frame and until VBUF_FRAMES other frames have been faulted
+ *  in. Records whose size divides VBUF_FRAME_SIZE never straddle frames.
+ *  Changes must be announced with VBUF_Dirty(); dirty frames are written
+ *  back with SPIF_force_write() when evicted or on VBUF_Flush().
+ */
+
+#ifndef VBUF_H_
+#define VBUF_H_
+
+#include <ch32v00x.h>
+#include "spiflash.h"
+
+#define VBUF_DISABLE   0
+#define VBUF_ENABLE    1
+
+#ifndef VBUF
+#define VBUF   VBUF_DISABLE
+#endif
+
+/* Backing region, normal flash, sector aligned */
+#ifndef VBUF_ADDR
+#define VBUF_ADDR        0x00300000
+#endif
+#ifndef VBUF_SIZE
+#define VBUF_SIZE        0x00010000
+#endif
+
+/* RAM frames, the size a power of two dividing the flash page */
+#ifndef VBUF_FRAMES
+#define VBUF_FRAMES      2
+#endif
+#ifndef VBUF_FRAME_SIZE
+#define VBUF_FRAME_SIZE  128
+#endif
+
+typedef struct {
+    uint32_t gets;
+    uint32_t faults;       /* gets that had to read the flash */
+    uint32_t writebacks;   /* dirty frames written back */
+    uint32_t errors;       /* flash errors, data of that frame lost */
+} vbuf_stats_t;
+
+void *VBUF_Get(uint32_t addr);
+void VBUF_Dirty(uint32_t addr);
+void VBUF_Flush(void);
+void VBUF_Invalidate(void);
+void VBUF_GetStats(vbuf_stats_t *stats);
+
+#endif /* VBUF_H_ */
@@ -19,6 +19,7 @@
 
 #include <ch32v00x.h>
 #include <stdio.h>
+#include "tinyfmt.h"
 
 /* UART Printf Definition */
 #define DEBUG_UART1_NoRemap   1  //Tx-PD5
@@ -39,12 +40,24 @@
 #define SDI_PRINT   SDI_PR_CLOSE
 #endif
 
+/* Printf Definition */
+#define DEBUG_PRINTF_NEWLIB   0  //newlib printf
+#define DEBUG_PRINTF_TINY     1  //printf() is TF_Printf(), see tinyfmt.h
+
+#ifndef DEBUG_PRINTF
+#define DEBUG_PRINTF   DEBUG_PRINTF_TINY
+#endif
+
 void Delay_Init(void);
 void Delay_Us(uint32_t n);
 void Delay_Ms(uint32_t n);
 void USART_Printf_Init(uint32_t baudrate);
 void SDI_Printf_Enable(void);
 
+#if (DEBUG_PRINTF == DEBUG_PRINTF_TINY)
+#define printf   TF_Printf
+#endif
+
 #ifdef __cplusplus
 }
 #endif
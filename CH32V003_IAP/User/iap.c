@@ -10,7 +10,7 @@
  * microcontroller manufactured by Nanjing Qinheng Microelectronics.
  *******************************************************************************/
 #include "iap.h"
-#include "string.h"
+#include "memops.h"
 #include "flash.h"
 #include "core_riscv.h"
 
@@ -58,7 +58,7 @@ void USART1_CFG(void)
  */
 u8 RecData_Deal(void)
 {
-    u8 i, s, Lenth;
+    u8 s, Lenth;
 
     Lenth = isp_cmd_t->UART.Len;
 
@@ -70,16 +70,12 @@ u8 RecData_Deal(void)
             break;
 
         case CMD_IAP_PROM:
-            for (i = 0; i < Lenth; i++) {
-                Fast_Program_Buf[CodeLen + i] = isp_cmd_t->UART.data[i];
-            }
+            memcpy(&Fast_Program_Buf[CodeLen], isp_cmd_t->UART.data, Lenth);
             CodeLen += Lenth;
             if (CodeLen >= 64) {
                 CH32_IAP_Program(Program_addr, (u32*) Fast_Program_Buf);
                 CodeLen -= 64;
-                for (i = 0; i < CodeLen; i++) {
-                    Fast_Program_Buf[i] = Fast_Program_Buf[64 + i];
-                }
+                memcpy(Fast_Program_Buf, &Fast_Program_Buf[64], CodeLen);
 
                 Program_addr += 0x40;
 
@@ -93,20 +89,15 @@ u8 RecData_Deal(void)
             {
                 Verify_Star_flag = 1;
 
-                for (i = 0; i < (64 - CodeLen); i++) {
-                    Fast_Program_Buf[CodeLen + i] = 0xFF;
-                }
+                memset(&Fast_Program_Buf[CodeLen], 0xFF, 64 - CodeLen);
 
                 CH32_IAP_Program(Program_addr, (u32*) Fast_Program_Buf);
                 CodeLen = 0;
             }
 
             s = ERR_SUCCESS;
-            for (i = 0; i < Lenth; i++) {
-                if (isp_cmd_t->UART.data[i] != *(u8*) (Verify_addr + i)) {
-                    s = ERR_ERROR;
-                    break;
-                }
+            if (memcmp(isp_cmd_t->UART.data, (u8*) Verify_addr, Lenth) != 0) {
+                s = ERR_ERROR;
             }
 
             Verify_addr += Lenth;
@@ -299,3 +290,272 @@ void UART_Rx_Deal(void)
     }
 }
 
+#if (IAP_TRANSPORT != IAP_TRANSPORT_UART)
+
+/*********************************************************************
+ * @fn      Frame_Load
+ *
+ * @brief   Checks a fixed size frame (see iap.h) and copies its command
+ *          into isp_cmd_t
+ *
+ * @param   f - IAP_SPI_FRAME bytes
+ *
+ * @return  1 - frame loaded
+ *          0 - bad frame
+ */
+static u8 Frame_Load(const u8 *f)
+{
+    u16 Data_add = 0;
+    u8 i;
+
+    for(i = 2; i < IAP_SPI_FRAME - 4; i++)
+    {
+        Data_add += f[i];
+    }
+    if(f[0] != Uart_Sync_Head1 || f[1] != Uart_Sync_Head2 || f[3] > 64
+       || f[IAP_SPI_FRAME - 4] != (u8)Data_add || f[IAP_SPI_FRAME - 3] != (u8)(Data_add >> 8)
+       || f[IAP_SPI_FRAME - 2] != Uart_Sync_Head2 || f[IAP_SPI_FRAME - 1] != Uart_Sync_Head1)
+    {
+        return 0;
+    }
+
+    isp_cmd_t->UART.Cmd = f[2];
+    isp_cmd_t->UART.Len = f[3];
+    memcpy(isp_cmd_t->UART.data, &f[8], 64);
+    return 1;
+}
+
+#endif
+
+#if (IAP_TRANSPORT == IAP_TRANSPORT_SPI)
+
+#define SPI_RDY_HIGH()    (IAP_SPI_RDY_PORT->BSHR = (1 << IAP_SPI_RDY_PIN))
+#define SPI_RDY_LOW()     (IAP_SPI_RDY_PORT->BCR = (1 << IAP_SPI_RDY_PIN))
+#define SPI_HALF_FLAG(h)  ((h) ? DMA_TCIF2 : DMA_HTIF2)
+
+u8 Spi_Rx_Buf[2 * IAP_SPI_FRAME];
+u8 Spi_Half = 0;
+volatile u8 Spi_Status = 0;
+
+/*********************************************************************
+ * @fn      SPI_Rx_Restart
+ *
+ * @brief   Restarts the receive DMA at the first half, once NSS is high
+ *
+ * @return  none
+ */
+static void SPI_Rx_Restart(void)
+{
+    while((GPIOC->INDR & GPIO_Pin_1) == 0);
+
+    DMA1_Channel2->CFGR = 0;
+    DMA1_Channel2->CNTR = sizeof(Spi_Rx_Buf);
+    DMA1->INTFCR = DMA_CGIF2 | DMA_CTCIF2 | DMA_CHTIF2 | DMA_CTEIF2;
+    (void)SPI1->DATAR;
+    DMA1_Channel2->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_CIRC | DMA_CFGR1_EN;
+    Spi_Half = 0;
+}
+
+/*********************************************************************
+ * @fn      SPI1_Slave_CFG
+ *
+ * @brief   SPI1 slave: DMA1 channel 2 receives frames into the two
+ *          halves of Spi_Rx_Buf, channel 3 repeats Spi_Status on MISO.
+ *
+ * @return  none
+ */
+void SPI1_Slave_CFG(void)
+{
+    RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+    RCC->APB2PCENR |= RCC_APB2Periph_SPI1 | RCC_APB2Periph_GPIOC | RCC_APB2Periph_GPIOD;
+
+    /* PC1 NSS, PC5 SCK, PC6 MOSI floating inputs, PC7 MISO AF push-pull */
+    GPIOC->CFGLR = (GPIOC->CFGLR & 0x000FFF0F) | 0xB4400040;
+
+    SPI_RDY_LOW();
+    IAP_SPI_RDY_PORT->CFGLR = (IAP_SPI_RDY_PORT->CFGLR & ~((u32)0x0F << (IAP_SPI_RDY_PIN * 4)))
+                            | ((u32)0x03 << (IAP_SPI_RDY_PIN * 4));
+
+    DMA1_Channel2->PADDR = (u32)&SPI1->DATAR;
+    DMA1_Channel2->MADDR = (u32)Spi_Rx_Buf;
+    DMA1_Channel3->PADDR = (u32)&SPI1->DATAR;
+    DMA1_Channel3->MADDR = (u32)&Spi_Status;
+    DMA1_Channel3->CNTR = 1;
+    DMA1_Channel3->CFGR = DMA_CFGR1_DIR | DMA_CFGR1_CIRC | DMA_CFGR1_EN;
+    SPI_Rx_Restart();
+
+    SPI1->CTLR2 = 0x0003;   /* RXDMAEN, TXDMAEN */
+    SPI1->CTLR1 = 0x0040;   /* Slave, mode 0, 8 bit, hardware NSS, SPE */
+
+    SPI_RDY_HIGH();
+}
+
+/*********************************************************************
+ * @fn      SPI_Rx_Deal
+ *
+ * @brief   Handles the next received frame, if any. The ready line is
+ *          low while the frame is processed and stays low if the other
+ *          half has filled meanwhile.
+ *
+ * @return  1 - a frame was handled (or dropped)
+ *          0 - nothing received
+ */
+u8 SPI_Rx_Deal(void)
+{
+    if((DMA1->INTFR & SPI_HALF_FLAG(Spi_Half)) == 0) return 0;
+    SPI_RDY_LOW();
+    DMA1->INTFCR = SPI_HALF_FLAG(Spi_Half);
+
+    if(!Frame_Load(&Spi_Rx_Buf[Spi_Half * IAP_SPI_FRAME]))
+    {
+        SPI_Rx_Restart();
+        SPI_RDY_HIGH();
+        return 1;
+    }
+    Spi_Half ^= 1;
+
+    if(isp_cmd_t->UART.Cmd == CMD_IAP_ERASE) Spi_Status &= ~IAP_SPI_ERROR;
+    if(RecData_Deal() == ERR_ERROR) Spi_Status |= IAP_SPI_ERROR;
+    Spi_Status = (Spi_Status & IAP_SPI_ERROR) | ((Spi_Status + 1) & ~IAP_SPI_ERROR);
+
+    if((DMA1->INTFR & SPI_HALF_FLAG(Spi_Half)) == 0) SPI_RDY_HIGH();
+    return 1;
+}
+
+#endif
+
+#if (IAP_TRANSPORT == IAP_TRANSPORT_I2C)
+
+u8 I2c_Rx_Buf[IAP_SPI_FRAME];
+i2c_reply_t I2c_Reply;
+u32 I2c_Start;
+
+/*********************************************************************
+ * @fn      I2C1_Slave_CFG
+ *
+ * @brief   I2C1 slave at IAP_I2C_ADDR: DMA1 channel 7 receives frames,
+ *          channel 6 sends I2c_Reply. Also starts SysTick free running
+ *          at HCLK/8 as the time base of the telemetry.
+ *
+ * @return  none
+ */
+void I2C1_Slave_CFG(void)
+{
+    RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+    RCC->APB2PCENR |= RCC_APB2Periph_GPIOC;
+    RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+
+    /* PC1 SDA, PC2 SCL AF open-drain */
+    GPIOC->CFGLR = (GPIOC->CFGLR & 0xFFFFF00F) | 0x00000FF0;
+
+    SysTick->CTLR = 0;
+    SysTick->CNT = 0;
+    SysTick->CTLR = 1;      /* STE, HCLK/8, count up */
+
+    I2c_Reply.tick_per_ms = IAP_I2C_TICK_PER_MS;
+
+    DMA1_Channel7->PADDR = (u32)&I2C1->DATAR;
+    DMA1_Channel7->MADDR = (u32)I2c_Rx_Buf;
+    DMA1_Channel6->PADDR = (u32)&I2C1->DATAR;
+    DMA1_Channel6->MADDR = (u32)&I2c_Reply;
+
+    I2C1->CTLR2 = I2C_CTLR2_DMAEN | (HSI_VALUE / 1000000);
+    I2C1->OADDR1 = IAP_I2C_ADDR << 1;
+    I2C1->CTLR1 = I2C_CTLR1_PE;
+    I2C1->CTLR1 = I2C_CTLR1_PE | I2C_CTLR1_ACK;
+}
+
+/*********************************************************************
+ * @fn      I2C_Frame_Deal
+ *
+ * @brief   Handles the frame written since the last address match, if
+ *          any, and updates I2c_Reply
+ *
+ * @return  1 - a frame was handled (or dropped)
+ *          0 - nothing received
+ */
+static u8 I2C_Frame_Deal(void)
+{
+    u8 n = IAP_SPI_FRAME - DMA1_Channel7->CNTR;
+    u8 s;
+
+    if((DMA1_Channel7->CFGR & DMA_CFGR1_EN) == 0) return 0;
+    DMA1_Channel7->CFGR = 0;
+    if(n == 0) return 0;
+
+    if(n != IAP_SPI_FRAME || !Frame_Load(I2c_Rx_Buf))
+    {
+        I2c_Reply.status = IAP_I2C_BAD_FRAME;
+        return 1;
+    }
+
+    if(isp_cmd_t->UART.Cmd == CMD_IAP_ERASE)
+    {
+        I2c_Start = SysTick->CNT;
+        I2c_Reply.frames = 0;
+        I2c_Reply.bytes = 0;
+    }
+    if(isp_cmd_t->UART.Cmd == CMD_IAP_PROM) I2c_Reply.bytes += isp_cmd_t->UART.Len;
+
+    s = RecData_Deal();
+    I2c_Reply.status = (s == ERR_ERROR) ? ERR_ERROR : ERR_SUCCESS;
+    I2c_Reply.frames++;
+    I2c_Reply.ticks = SysTick->CNT - I2c_Start;
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      I2C_Rx_Deal
+ *
+ * @brief   Polls I2C1. A frame is processed after its STOP (or the
+ *          repeated START of the status read), so SCL is only stretched
+ *          when this board is addressed again while still programming.
+ *
+ * @return  1 - a frame was handled (or dropped)
+ *          0 - nothing received
+ */
+u8 I2C_Rx_Deal(void)
+{
+    u16 sr1 = I2C1->STAR1;
+    u8 r = 0;
+
+    if(sr1 & I2C_STAR1_STOPF)
+    {
+        I2C1->CTLR1 |= I2C_CTLR1_PE;    /* clears STOPF after the STAR1 read */
+        r = I2C_Frame_Deal();
+    }
+
+    if(sr1 & I2C_STAR1_AF)
+    {
+        I2C1->STAR1 = (u16)~I2C_STAR1_AF;
+        DMA1_Channel6->CFGR = 0;
+    }
+
+    if(sr1 & I2C_STAR1_ADDR)
+    {
+        r |= I2C_Frame_Deal();
+
+        /* Reading STAR2 clears ADDR, SCL then stays low until the DMA serves DATAR */
+        if(I2C1->STAR2 & I2C_STAR2_TRA)
+        {
+            DMA1_Channel6->CFGR = 0;
+            DMA1_Channel6->CNTR = sizeof(I2c_Reply);
+            DMA1_Channel6->CFGR = DMA_CFGR1_DIR | DMA_CFGR1_MINC | DMA_CFGR1_EN;
+        }
+        else
+        {
+            DMA1_Channel7->CFGR = 0;
+            DMA1_Channel7->CNTR = IAP_SPI_FRAME;
+            DMA1_Channel7->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_EN;
+        }
+    }
+    else if(sr1 & I2C_STAR1_BTF)
+    {
+        /* Controller went past the reply or the frame, don't hold the bus */
+        if(sr1 & I2C_STAR1_TXE) I2C1->DATAR = 0xFF;
+        else (void)I2C1->DATAR;
+    }
+    return r;
+}
+
+#endif
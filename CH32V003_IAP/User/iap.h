@@ -34,6 +34,64 @@
 #define CalAddr           (0x08004000-4)
 #define CheckNum          (0x5aa55aa5)
 
+/*
+ * Update transport. Only one is built, the IAP has to fit in 1920 bytes.
+ *
+ * IAP_TRANSPORT_SPI: SPI1 slave (mode 0, MSB first) on PC5 SCK, PC6 MOSI,
+ * PC7 MISO, PC1 NSS, driven by a host MCU while the external flash is
+ * deselected. Every frame is IAP_SPI_FRAME bytes between NSS edges:
+ *   AA 55 cmd len arg[4] data[64] sum16 55 AA
+ * arg and data always present (zero padded), sum over cmd..data. DMA
+ * receives into two frame buffers, so the next frame can come in while
+ * one is programmed.
+ *
+ * Flow control: the host starts a frame only while the ready line is high,
+ * sampled at least IAP_SPI_RDY_US after raising NSS. Every MISO byte is
+ * the status: bits 0..6 count the frames processed, bit 7 is set once a
+ * command failed (VERIFY mismatch) and cleared by ERASE. A bad frame is dropped together with anything received
+ * after it, the count tells the host where to resume. CMD_JUMP_IAP is a
+ * no-op that can be sent to read the final status.
+ *
+ * IAP_TRANSPORT_I2C: I2C1 slave at IAP_I2C_ADDR on PC1 SDA, PC2 SCL, so
+ * several boards with different addresses share one controller. A write
+ * carries one frame in the SPI format above, ended by STOP or by the
+ * repeated START of a read. DMA moves the frame; it is processed after
+ * the bus is released, so SCL is only stretched if the board is
+ * addressed again while it still erases or programs. A read returns
+ * i2c_reply_t (read exactly that many bytes): the status of the last
+ * frame and, counted from ERASE, the frames, the PROM bytes and the
+ * SysTick ticks spent, so the controller gets each target's bytes/s as
+ *   bytes * tick_per_ms * 1000 / ticks
+ */
+#define IAP_TRANSPORT_UART  0
+#define IAP_TRANSPORT_SPI   1
+#define IAP_TRANSPORT_I2C   2
+
+#ifndef IAP_TRANSPORT
+#define IAP_TRANSPORT       IAP_TRANSPORT_UART
+#endif
+
+#define IAP_SPI_FRAME       (4 + 4 + 64 + 4)
+#define IAP_SPI_ERROR       0x80
+#define IAP_SPI_RDY_US      20
+#define IAP_SPI_RDY_PORT    GPIOD
+#define IAP_SPI_RDY_PIN     3                   /* PD3, high = ready */
+
+#ifndef IAP_I2C_ADDR
+#define IAP_I2C_ADDR        0x30                /* 7 bit, set per board */
+#endif
+#define IAP_I2C_BAD_FRAME   0xFF
+#define IAP_I2C_TICK_PER_MS (HSI_VALUE / 8000)  /* SysTick at HCLK/8 */
+
+typedef struct __attribute__ ((packed)) {
+    u8  status;         /* ERR_SUCCESS, ERR_ERROR or IAP_I2C_BAD_FRAME */
+    u8  reserved;       /* keeps the fields below aligned */
+    u16 frames;         /* a full 16K image is over 500 frames */
+    u16 bytes;
+    u16 tick_per_ms;
+    u32 ticks;
+} i2c_reply_t;
+
 typedef union __attribute__ ((aligned(4)))_ISP_CMD {
 
 struct{
@@ -59,6 +117,10 @@ u8 PC0_Check(void);
 void USART1_CFG(void);
 void UART_Rx_Deal(void);
 void UART1_SendData(u8 data);
+void SPI1_Slave_CFG(void);
+u8 SPI_Rx_Deal(void);
+void I2C1_Slave_CFG(void);
+u8 I2C_Rx_Deal(void);
 
 #endif
 
@@ -10,7 +10,7 @@
  * microcontroller manufactured by Nanjing Qinheng Microelectronics.
  *******************************************************************************/
 /*
- * IAP routine: this routine support only UART mode,
+ * IAP routine: UART mode, or SPI/I2C slave mode with IAP_TRANSPORT (see iap.h),
  * and you can choose the command method or the IO method to jump to the APP .
  * Key  parameters: CalAddr - address in flash (same in APP), note that this address needs to be unused.
  *                  CheckNum - The value of 'CalAddr' that needs to be modified.
@@ -34,6 +34,9 @@ extern u8 End_Flag;
 
 #define UPGRADE_MODE   UPGRADE_MODE_COMMAND
 
+/* Set by CMD_IAP_END (or the APP installer) once a whole image verified */
+#define APP_VALID()    (*(__IO u32 *)CalAddr == CheckNum)
+
 /*********************************************************************
  * @fn      IAP_2_APP
  *
@@ -57,10 +60,58 @@ void IAP_2_APP(void)
  */
 int main(void)
 {
+#if (IAP_TRANSPORT == IAP_TRANSPORT_SPI)
+    u32 t;
+
+    Delay_Init();
+    SPI1_Slave_CFG();
+
+    /* Boot window of about 5 s, kept open for good once the host sends a
+     * frame or while there is no valid APP */
+    for(t = 0; ; t++)
+    {
+        if(SPI_Rx_Deal()) break;
+        Delay_Us(10);
+        if(t >= 500000 && APP_VALID()) IAP_2_APP();
+    }
+
+    while(End_Flag == 0)
+    {
+        SPI_Rx_Deal();
+    }
+    IAP_2_APP();
+#elif (IAP_TRANSPORT == IAP_TRANSPORT_I2C)
+    I2C1_Slave_CFG();
+
+    /* Boot window of about 5 s on the free running SysTick, open for good
+     * while there is no valid APP */
+    while(I2C_Rx_Deal() == 0)
+    {
+        if(SysTick->CNT > 5000 * IAP_I2C_TICK_PER_MS && APP_VALID()) IAP_2_APP();
+    }
+
+    while(End_Flag == 0)
+    {
+        I2C_Rx_Deal();
+    }
+    IAP_2_APP();
+#else
     u8 iap2app_counter = 0;
+
     RCC->APB2PCENR |= RCC_APB2Periph_GPIOD| RCC_APB2Periph_USART1|RCC_APB2Periph_GPIOC;/* Enable GPIOD,USART1, GPIOC  clock */
     USART1_CFG();
     Delay_Init();
+
+    /* Interrupted upload or install: no APP to go back to, wait for a new image */
+    if(!APP_VALID())
+    {
+        while(End_Flag == 0)
+        {
+            UART_Rx_Deal();
+        }
+        IAP_2_APP();
+    }
+
     while(1){
         UART1_SendData(0x42);
         UART1_SendData(0x6F);
@@ -72,6 +123,7 @@ int main(void)
         iap2app_counter++;
         if (iap2app_counter == 10) IAP_2_APP();
     }
+#endif
 
     
 }
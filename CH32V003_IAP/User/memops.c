@@ -0,0 +1,141 @@
+/*
+ * memops.c
+ *
+ *  memcpy, memset and memcmp with aligned 32 bit accesses in the middle
+ *  and byte loops for the unaligned head and tail. The core traps on
+ *  misaligned word accesses, so a source that is not aligned like the
+ *  destination is read as aligned words and shifted into place. Kept
+ *  small enough for the IAP image, no unrolling.
+ */
+
+#include "memops.h"
+#include <stdint.h>
+
+#if (MEMOPS == MEMOPS_ENABLE)
+
+/* Keep GCC from turning the byte loops back into memcpy/memset calls */
+#define MEMOPS_FN   __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+/*********************************************************************
+ * @fn      memcpy
+ *
+ * @brief   Copies n bytes, the areas must not overlap.
+ *
+ * @return  dst
+ */
+MEMOPS_FN void *memcpy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    const uint32_t *ws;
+    uint32_t lo, hi, sh;
+
+    if(n >= 8)
+    {
+        while((uintptr_t)d & 3)
+        {
+            *d++ = *s++;
+            n--;
+        }
+
+        sh = ((uintptr_t)s & 3) << 3;
+        if(sh == 0)
+        {
+            for(; n >= 4; n -= 4, d += 4, s += 4)
+            {
+                *(uint32_t *)d = *(const uint32_t *)s;
+            }
+        }
+        else
+        {
+            /* Little endian merge of two aligned source words; the last
+               load may touch up to 3 bytes past the area, same word */
+            ws = (const uint32_t *)(s - (sh >> 3));
+            lo = *ws++;
+            for(; n >= 4; n -= 4, d += 4, s += 4)
+            {
+                hi = *ws++;
+                *(uint32_t *)d = (lo >> sh) | (hi << (32 - sh));
+                lo = hi;
+            }
+        }
+    }
+
+    while(n--)
+    {
+        *d++ = *s++;
+    }
+    return dst;
+}
+
+/*********************************************************************
+ * @fn      memset
+ *
+ * @brief   Fills n bytes with value.
+ *
+ * @return  dst
+ */
+MEMOPS_FN void *memset(void *dst, int value, size_t n)
+{
+    uint8_t *d = dst;
+    uint32_t w = (uint8_t)value;
+
+    if(n >= 8)
+    {
+        w |= w << 8;
+        w |= w << 16;
+        while((uintptr_t)d & 3)
+        {
+            *d++ = (uint8_t)w;
+            n--;
+        }
+        for(; n >= 4; n -= 4, d += 4)
+        {
+            *(uint32_t *)d = w;
+        }
+    }
+
+    while(n--)
+    {
+        *d++ = (uint8_t)w;
+    }
+    return dst;
+}
+
+/*********************************************************************
+ * @fn      memcmp
+ *
+ * @brief   Compares n bytes. Words are compared while both pointers
+ *          share the same alignment, the first differing word is then
+ *          resolved byte by byte.
+ *
+ * @return  <0, 0 or >0 like the first differing byte pair.
+ */
+MEMOPS_FN int memcmp(const void *a, const void *b, size_t n)
+{
+    const uint8_t *p = a;
+    const uint8_t *q = b;
+
+    if(n >= 8 && !(((uintptr_t)p ^ (uintptr_t)q) & 3))
+    {
+        while((uintptr_t)p & 3)
+        {
+            if(*p != *q) return *p - *q;
+            p++;
+            q++;
+            n--;
+        }
+        for(; n >= 4; n -= 4, p += 4, q += 4)
+        {
+            if(*(const uint32_t *)p != *(const uint32_t *)q) break;
+        }
+    }
+
+    for(; n; n--, p++, q++)
+    {
+        if(*p != *q) return *p - *q;
+    }
+    return 0;
+}
+
+#endif
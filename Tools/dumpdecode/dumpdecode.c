@@ -0,0 +1,165 @@
+/*
+ * dumpdecode.c
+ *
+ *  Host side decoder for the binary frames sent by Dump_Raw() when the APP
+ *  is built with DUMP_MODE = DUMP_MODE_RAW. Reads the captured debug UART
+ *  stream, passes plain text through and turns every frame into hex rows,
+ *  or into one .bin file per frame with -o.
+ *
+ *  Build:  cc -O2 -o dumpdecode dumpdecode.c
+ *  Usage:  dumpdecode [-o outdir] [capture]      (stdin when no file given)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DUMP_RAW_SYNC1   0xD5
+#define DUMP_RAW_SYNC2   0x5D
+
+static const char *out_dir = NULL;
+static unsigned frames_ok = 0;
+static unsigned frames_bad = 0;
+
+/* Reads exactly n bytes, 0 at end of input */
+static int read_exact(FILE *in, uint8_t *buf, size_t n)
+{
+    return fread(buf, 1, n, in) == n;
+}
+
+static void print_rows(const char *title, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    uint32_t i, j;
+
+    printf("\n%s:\n", title[0] ? title : "(untitled)");
+    for (i = 0; i < len; i += 16)
+    {
+        printf("%08X: ", (unsigned)(addr + i));
+        for (j = i; j < i + 16 && j < len; j++) printf("%02X ", data[j]);
+        printf("\n");
+    }
+}
+
+static void save_frame(const char *title, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    char path[512];
+    char name[256];
+    size_t i;
+    FILE *f;
+
+    /* Keep file names portable */
+    snprintf(name, sizeof(name), "%s", title[0] ? title : "dump");
+    for (i = 0; name[i]; i++)
+    {
+        if (!((name[i] >= 'A' && name[i] <= 'Z') || (name[i] >= 'a' && name[i] <= 'z') ||
+              (name[i] >= '0' && name[i] <= '9') || name[i] == '-')) name[i] = '_';
+    }
+
+    snprintf(path, sizeof(path), "%s/%03u_%s_%08X.bin", out_dir, frames_ok, name, (unsigned)addr);
+    f = fopen(path, "wb");
+    if (!f)
+    {
+        perror(path);
+        return;
+    }
+    fwrite(data, 1, len, f);
+    fclose(f);
+    printf("[%s: %u bytes at 0x%08X -> %s]\n", title, (unsigned)len, (unsigned)addr, path);
+}
+
+/* Decodes the frame following a sync, returns 0 at end of input */
+static int decode_frame(FILE *in)
+{
+    uint8_t tlen, hdr[6], sum_le[2];
+    char title[256];
+    uint8_t *data;
+    uint32_t addr, len, i;
+    uint16_t sum;
+
+    if (!read_exact(in, &tlen, 1)) return 0;
+    if (!read_exact(in, (uint8_t *)title, tlen)) return 0;
+    title[tlen] = '\0';
+    if (!read_exact(in, hdr, sizeof(hdr))) return 0;
+
+    addr = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+    len = hdr[4] | (hdr[5] << 8);
+
+    data = malloc(len ? len : 1);
+    if (!data) return 0;
+    if (!read_exact(in, data, len) || !read_exact(in, sum_le, 2))
+    {
+        free(data);
+        return 0;
+    }
+
+    sum = tlen;
+    for (i = 0; i < tlen; i++) sum += (uint8_t)title[i];
+    for (i = 0; i < sizeof(hdr); i++) sum += hdr[i];
+    for (i = 0; i < len; i++) sum += data[i];
+
+    if (sum != (uint16_t)(sum_le[0] | (sum_le[1] << 8)))
+    {
+        frames_bad++;
+        fprintf(stderr, "checksum error in frame '%s' at 0x%08X\n", title, (unsigned)addr);
+    }
+    else if (out_dir)
+    {
+        save_frame(title, addr, data, len);
+        frames_ok++;
+    }
+    else
+    {
+        print_rows(title, addr, data, len);
+        frames_ok++;
+    }
+
+    free(data);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    int c, prev = -1;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+        {
+            out_dir = argv[++i];
+        }
+        else if (argv[i][0] == '-' && argv[i][1])
+        {
+            fprintf(stderr, "usage: %s [-o outdir] [capture]\n", argv[0]);
+            return 2;
+        }
+        else
+        {
+            in = fopen(argv[i], "rb");
+            if (!in)
+            {
+                perror(argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    /* Text is echoed unchanged, frames are recognised by their sync pair */
+    while ((c = fgetc(in)) != EOF)
+    {
+        if (prev == DUMP_RAW_SYNC1 && c == DUMP_RAW_SYNC2)
+        {
+            prev = -1;
+            if (!decode_frame(in)) break;
+            continue;
+        }
+        if (prev >= 0) putchar(prev);
+        prev = c;
+    }
+    if (prev >= 0 && prev != DUMP_RAW_SYNC1) putchar(prev);
+
+    fprintf(stderr, "%u frame(s) decoded, %u with checksum errors\n", frames_ok, frames_bad);
+    return frames_bad ? 1 : 0;
+}
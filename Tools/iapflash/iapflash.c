@@ -0,0 +1,381 @@
+/*
+ * iapflash.c
+ *
+ *  Production flasher: uploads one image to many boards at once through
+ *  the UART IAP protocol, one serial port per board.
+ *
+ *  A single thread drives every port from an epoll loop. The image is
+ *  read once and turned into the complete frame sequence once (see
+ *  iap_upload_load()); all ports send from that shared, read-only copy
+ *  and only keep their position, parser and timers. The protocol has no
+ *  compressed frame type, so the prebuilt frames are the most compact
+ *  form that can go on the wire unchanged.
+ *
+ *  Each port runs its own state machine:
+ *    JUMP   -> CMD_JUMP_IAP to the APP (with -j)
+ *    REBOOT -> wait for the IAP to come up
+ *    RUN    -> ERASE, PROM..., VERIFY..., END from the shared frames,
+ *              one frame in flight, retried on timeout
+ *    DONE / FAIL
+ *
+ *  The IAP only resets its program and verify positions on CMD_IAP_END,
+ *  so a failed verify cannot be retried in place: the board is reported
+ *  and has to be reset and flashed again.
+ *
+ *  Try it without boards using iaptarget, which simulates targets on
+ *  pseudo-terminals:
+ *    iaptarget -n 8 > ports & iapflash -j app.bin $(cat ports)
+ *
+ *  Build:  cc -O2 -I../iapproto -o iapflash iapflash.c ../iapproto/iapproto.c
+ *  Usage:  iapflash [options] image.bin|image.hex port...
+ *            -b baud      serial speed (default 460800)
+ *            -j           send CMD_JUMP_IAP first, then wait for the IAP
+ *            -d ms        time the target needs to reboot after -j (default 500)
+ *            -c bytes     data bytes per frame, 4..64 (default 64)
+ *            -t ms        answer timeout (default 200, 10x for the erase)
+ *            -r n         retries per frame (default 3)
+ *            -x           do not send CMD_IAP_END
+ *            -v           print every state change
+ *  Exit status is the number of boards that failed, capped at 255.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "iapproto.h"
+
+enum { ST_JUMP, ST_REBOOT, ST_RUN, ST_DONE, ST_FAIL };
+
+typedef struct {
+    const char *path;
+    int fd;
+    uint8_t state;
+    uint32_t k;                     /* frame being sent or answered */
+    const iap_frame_t *out;         /* frame being written */
+    uint8_t out_off;
+    iap_answer_rx_t rx;
+    unsigned tries;                 /* attempts of the current frame */
+    double deadline;                /* answer timeout or end of reboot wait */
+    double t_start, t_end, t_sent;
+    double phase_time[PH_COUNT];
+    uint32_t retries, wire;
+    const char *error;
+} target_t;
+
+static iap_upload_t up;
+static iap_frame_t jump_frame;
+static target_t *targets;
+static int ntargets;
+static int epfd;
+
+static unsigned timeout_ms = 200;
+static unsigned delay_ms = 500;
+static unsigned max_retries = 3;
+static int no_end = 0;
+static int verbose = 0;
+
+static void target_log(const target_t *t, const char *what)
+{
+    if (verbose) fprintf(stderr, "%8.3f %s: %s\n", iap_now() - t->t_start, t->path, what);
+}
+
+static void target_fail(target_t *t, const char *why)
+{
+    t->state = ST_FAIL;
+    t->error = why;
+    t->t_end = iap_now();
+    target_log(t, why);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, t->fd, NULL);
+}
+
+static void target_done(target_t *t)
+{
+    t->state = ST_DONE;
+    t->t_end = iap_now();
+    target_log(t, "done");
+    epoll_ctl(epfd, EPOLL_CTL_DEL, t->fd, NULL);
+}
+
+/* Writes what the port takes of the current frame, the rest on EPOLLOUT */
+static void target_flush(target_t *t)
+{
+    struct epoll_event ev = { EPOLLIN, { .ptr = t } };
+    ssize_t w;
+
+    while (t->out && t->out_off < t->out->len)
+    {
+        w = write(t->fd, t->out->buf + t->out_off, t->out->len - t->out_off);
+        if (w < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN)
+            {
+                target_fail(t, "write error");
+                return;
+            }
+            ev.events = EPOLLIN | EPOLLOUT;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd, &ev);
+            return;
+        }
+        t->out_off += (uint8_t)w;
+        t->wire += (uint32_t)w;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd, &ev);
+
+    /* END is not answered */
+    if (t->out && t->out->phase == PH_END)
+    {
+        tcdrain(t->fd);
+        t->phase_time[PH_END] += iap_now() - t->t_sent;
+        target_done(t);
+    }
+}
+
+static void target_send(target_t *t, const iap_frame_t *f)
+{
+    double now = iap_now();
+
+    if (t->tries++) t->retries++;
+    t->out = f;
+    t->out_off = 0;
+    t->rx.n = 0;
+    t->t_sent = now;
+    t->deadline = now + ((f->phase == PH_ERASE) ? timeout_ms * 10 : timeout_ms) / 1000.0;
+    target_flush(t);
+}
+
+/* Sends the frame at t->k, skipping END when asked to */
+static void target_next(target_t *t)
+{
+    if (t->k < up.count && up.frames[t->k].phase == PH_END && no_end) t->k = up.count;
+    if (t->k >= up.count)
+    {
+        target_done(t);
+        return;
+    }
+    t->tries = 0;
+    target_send(t, &up.frames[t->k]);
+}
+
+static void target_answer(target_t *t, int st)
+{
+    const iap_frame_t *f = t->out;
+
+    if (!f || t->out_off < f->len) return;            /* stray bytes */
+    t->phase_time[f->phase] += iap_now() - t->t_sent;
+    t->out = NULL;
+
+    if (t->state == ST_JUMP)
+    {
+        if (st != ERR_SUCCESS)
+        {
+            target_fail(t, "CMD_JUMP_IAP refused");
+            return;
+        }
+        t->state = ST_REBOOT;
+        t->deadline = iap_now() + delay_ms / 1000.0;
+        target_log(t, "rebooting");
+        return;
+    }
+
+    if (st == ERR_SUCCESS)
+    {
+        t->k++;
+        target_next(t);
+        return;
+    }
+    target_fail(t, (f->phase == PH_VERIFY) ? "verify error" : "error answer");
+}
+
+static void target_timeout(target_t *t)
+{
+    if (t->state == ST_REBOOT)
+    {
+        t->state = ST_RUN;
+        t->k = 0;
+        tcflush(t->fd, TCIFLUSH);
+        target_next(t);
+        return;
+    }
+    if (t->tries > max_retries)
+    {
+        target_fail(t, "no answer");
+        return;
+    }
+    target_log(t, "timeout, retrying");
+    tcflush(t->fd, TCIFLUSH);
+    target_send(t, t->out);
+}
+
+static void target_read(target_t *t)
+{
+    uint8_t buf[256];
+    ssize_t n, i;
+    int st;
+
+    n = read(t->fd, buf, sizeof(buf));
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        target_fail(t, "port closed");
+        return;
+    }
+    for (i = 0; i < n && (t->state == ST_JUMP || t->state == ST_RUN); i++)
+    {
+        st = iap_answer_feed(&t->rx, buf[i]);
+        if (st >= 0) target_answer(t, st);
+    }
+}
+
+static int active(const target_t *t)
+{
+    return t->state != ST_DONE && t->state != ST_FAIL;
+}
+
+static void report(double wall)
+{
+    static const char *state_name[] = { "jump", "reboot", "run", "ok", "FAIL" };
+    target_t *t;
+    int i, p, ok = 0;
+    uint32_t wire = 0, retries = 0;
+
+    fprintf(stderr, "\n%-20s %-5s %8s %8s %8s %8s %5s  %s\n", "port", "state", "erase", "program",
+            "verify", "total", "rtry", "error");
+    for (i = 0; i < ntargets; i++)
+    {
+        t = &targets[i];
+        if (!t->t_end) t->t_end = iap_now();
+        fprintf(stderr, "%-20s %-5s", t->path, state_name[t->state]);
+        for (p = PH_ERASE; p <= PH_VERIFY; p++) fprintf(stderr, " %8.1f", t->phase_time[p] * 1e3);
+        fprintf(stderr, " %8.1f %5u  %s\n", (t->t_end - t->t_start) * 1e3, t->retries, t->error ? t->error : "");
+        ok += (t->state == ST_DONE);
+        wire += t->wire;
+        retries += t->retries;
+    }
+    fprintf(stderr, "%d of %d boards ok in %.3f s, %u image bytes each, %.0f B/s aggregate, "
+                    "%u bytes sent, %u retries\n",
+            ok, ntargets, wall, up.len, wall > 0 ? (double)ok * up.len / wall : 0.0, wire, retries);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b baud] [-j] [-d ms] [-c bytes] [-t ms] [-r n] [-x] [-v] image port...\n", prog);
+    exit(255);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    const char **ports;
+    unsigned baud = 460800, chunk = IAP_DATA_MAX;
+    int jump = 0, nports = 0, i, n, left, failed = 0;
+    struct epoll_event ev, evs[32];
+    double t0, now, next;
+    target_t *t;
+
+    ports = calloc(argc, sizeof(*ports));
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            if (!path) path = argv[i];
+            else ports[nports++] = argv[i];
+            continue;
+        }
+        switch (argv[i][1])
+        {
+        case 'j': jump = 1; continue;
+        case 'x': no_end = 1; continue;
+        case 'v': verbose = 1; continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        switch (argv[i][1])
+        {
+        case 'b': baud = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'd': delay_ms = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'c': chunk = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 't': timeout_ms = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'r': max_retries = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!path || !nports || chunk < 4 || chunk > IAP_DATA_MAX) usage(argv[0]);
+
+    if (!iap_upload_load(&up, path, chunk)) return 255;
+    iap_frame_build(&jump_frame, CMD_JUMP_IAP, 0, NULL, 0, PH_JUMP);
+
+    epfd = epoll_create1(0);
+    targets = calloc(nports, sizeof(target_t));
+    t0 = iap_now();
+    for (i = 0; i < nports; i++)
+    {
+        t = &targets[ntargets++];
+        t->path = ports[i];
+        t->t_start = t0;
+        t->fd = iap_port_open(ports[i], baud);
+        if (t->fd < 0)
+        {
+            t->state = ST_FAIL;
+            t->error = "cannot open";
+            t->t_end = t0;
+            continue;
+        }
+        fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK);
+        tcflush(t->fd, TCIFLUSH);
+        ev.events = EPOLLIN;
+        ev.data.ptr = t;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd, &ev);
+
+        if (jump)
+        {
+            t->state = ST_JUMP;
+            t->tries = 0;
+            target_send(t, &jump_frame);
+        }
+        else
+        {
+            t->state = ST_RUN;
+            target_next(t);
+        }
+    }
+
+    for (;;)
+    {
+        /* Sleep until the earliest deadline */
+        now = iap_now();
+        next = 0;
+        for (i = 0; i < ntargets; i++)
+        {
+            t = &targets[i];
+            if (!active(t)) continue;
+            if (t->deadline <= now) target_timeout(t);
+            if (active(t) && (!next || t->deadline < next)) next = t->deadline;
+        }
+        if (!next) break;
+
+        left = (int)((next - iap_now()) * 1000) + 1;
+        n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), left > 0 ? left : 0);
+        for (i = 0; i < n; i++)
+        {
+            t = evs[i].data.ptr;
+            if (!active(t)) continue;
+            if (evs[i].events & EPOLLOUT) target_flush(t);
+            if (active(t) && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) target_read(t);
+        }
+    }
+
+    report(iap_now() - t0);
+    for (i = 0; i < ntargets; i++)
+    {
+        if (targets[i].fd >= 0) close(targets[i].fd);
+        failed += (targets[i].state != ST_DONE);
+    }
+    return failed > 255 ? 255 : failed;
+}
@@ -0,0 +1,234 @@
+/*
+ * iapload.c
+ *
+ *  Host side uploader for the UART IAP protocol of iap.h: frames
+ *  AA 55 cmd len [4 byte arg] [data] sum16 55 AA, answered with
+ *  AA 55 00 status 55 AA (no answer to CMD_IAP_END).
+ *
+ *  Sequence: optional CMD_JUMP_IAP to a running APP, CMD_IAP_ERASE,
+ *  CMD_IAP_PROM for the image in chunks, CMD_IAP_VERIFY for the image
+ *  again (the first VERIFY also flushes the last partial 64 byte page),
+ *  then CMD_IAP_END which marks the image valid and starts it.
+ *
+ *  The target receives with a one byte buffer and no flow control, and
+ *  the frames carry no sequence number, so only one frame can be in
+ *  flight: the next one may only start once the previous is answered.
+ *  All frames are therefore built before the first is sent and each goes
+ *  out in a single write(), leaving the host nothing to do between the
+ *  answer and the next frame.
+ *
+ *  A frame with a bad checksum is dropped silently by the target, so a
+ *  missing answer is retried. A lost answer to a PROM frame would make
+ *  the retry append the data twice; verify catches that. The IAP only
+ *  resets its program and verify positions on CMD_IAP_END, so after a
+ *  verify error the board has to be reset and the upload run again:
+ *  iapload stops at the first rejected frame, never sends CMD_IAP_END
+ *  after it and never starts over by itself.
+ *
+ *  Works with a serial port or a pseudo-terminal, e.g. one connected to
+ *  rvsim or a target emulator.
+ *
+ *  Build:  cc -O2 -I../iapproto -o iapload iapload.c ../iapproto/iapproto.c
+ *  Usage:  iapload [options] port image.bin|image.hex
+ *            -b baud      serial speed (default 460800)
+ *            -j           send CMD_JUMP_IAP first, then wait for the IAP
+ *            -d ms        time the target needs to reboot after -j (default 500)
+ *            -c bytes     data bytes per frame, 4..64 (default 64)
+ *            -t ms        answer timeout (default 200, 10x for the erase)
+ *            -r n         retries per frame (default 3)
+ *            -x           do not send CMD_IAP_END
+ *            -v           print every frame
+ *  Exit:   0 done, 1 no answer or port/image error, 2 bad options,
+ *          3 a frame was rejected, the board must be reset first
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "iapproto.h"
+
+typedef struct {
+    uint32_t frames;
+    uint32_t bytes;          /* image bytes carried */
+    uint32_t wire;           /* bytes sent */
+    uint32_t retries;
+    double time;             /* s, first write to last answer */
+    double rtt_min, rtt_max, rtt_sum;
+} phase_stats_t;
+
+static int port_fd = -1;
+static unsigned timeout_ms = 200;
+static unsigned retries = 3;
+static int verbose = 0;
+static phase_stats_t stats[PH_COUNT];
+
+/* Waits for an answer, returns the status byte or -1 on timeout */
+static int answer_wait(unsigned ms)
+{
+    iap_answer_rx_t rx = { { 0 }, 0 };
+    double end = iap_now() + ms / 1000.0;
+    struct pollfd pfd = { port_fd, POLLIN, 0 };
+    uint8_t c;
+    int left, st;
+
+    for (;;)
+    {
+        left = (int)((end - iap_now()) * 1000);
+        if (left <= 0 || poll(&pfd, 1, left) <= 0) return -1;
+        if (read(port_fd, &c, 1) != 1) continue;
+        st = iap_answer_feed(&rx, c);
+        if (st >= 0) return st;
+    }
+}
+
+/* Sends one frame and waits for its answer. Returns the status, -1 if never answered */
+static int frame_send(const iap_frame_t *f, unsigned ms)
+{
+    phase_stats_t *s = &stats[f->phase];
+    unsigned attempt;
+    double t0, rtt;
+    int st = -1;
+
+    for (attempt = 0; attempt <= retries; attempt++)
+    {
+        if (attempt) s->retries++;
+        tcflush(port_fd, TCIFLUSH);
+
+        t0 = iap_now();
+        if (!iap_write_all(port_fd, f->buf, f->len)) return -1;
+        s->wire += f->len;
+        if (f->buf[2] == CMD_IAP_END)
+        {
+            tcdrain(port_fd);
+            st = ERR_SUCCESS;
+        }
+        else st = answer_wait(ms);
+        rtt = iap_now() - t0;
+
+        if (verbose)
+        {
+            fprintf(stderr, "%-7s len %2u -> %s %.3f ms\n", iap_phase_name[f->phase], f->buf[3],
+                    st < 0 ? "timeout" : st ? "error" : "ok", rtt * 1e3);
+        }
+        if (st < 0) continue;
+
+        if (!s->frames || rtt < s->rtt_min) s->rtt_min = rtt;
+        if (rtt > s->rtt_max) s->rtt_max = rtt;
+        s->rtt_sum += rtt;
+        s->frames++;
+        s->bytes += f->bytes;
+        s->time += rtt;
+        break;
+    }
+    return st;
+}
+
+static void report(uint32_t image_len, double total)
+{
+    phase_stats_t *s;
+    uint32_t wire = 0, retry = 0;
+    int i;
+
+    fprintf(stderr, "\n%-8s %6s %7s %7s %4s %9s %9s %8s %8s %8s\n", "phase", "frames", "bytes", "wire",
+            "rtry", "time ms", "B/s", "rtt min", "avg", "max");
+    for (i = 0; i < PH_COUNT; i++)
+    {
+        s = &stats[i];
+        wire += s->wire;
+        retry += s->retries;
+        if (!s->frames && !s->retries) continue;
+        fprintf(stderr, "%-8s %6u %7u %7u %4u %9.1f %9.0f %8.3f %8.3f %8.3f\n", iap_phase_name[i], s->frames,
+                s->bytes, s->wire, s->retries, s->time * 1e3, s->time > 0 ? s->bytes / s->time : 0.0,
+                s->rtt_min * 1e3, s->frames ? s->rtt_sum / s->frames * 1e3 : 0.0, s->rtt_max * 1e3);
+    }
+    fprintf(stderr, "total: %u image bytes in %.3f s, %.0f B/s, %u bytes sent, %u retries\n",
+            image_len, total, total > 0 ? image_len / total : 0.0, wire, retry);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b baud] [-j] [-d ms] [-c bytes] [-t ms] [-r n] [-x] [-v] port image\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *port = NULL, *path = NULL;
+    unsigned baud = 460800, delay_ms = 500, chunk = IAP_DATA_MAX;
+    int jump = 0, no_end = 0, i, st = 0;
+    static iap_upload_t up;
+    iap_frame_t *f = NULL;
+    uint32_t k;
+    double t0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            if (!port) port = argv[i];
+            else if (!path) path = argv[i];
+            else usage(argv[0]);
+            continue;
+        }
+        switch (argv[i][1])
+        {
+        case 'j': jump = 1; continue;
+        case 'x': no_end = 1; continue;
+        case 'v': verbose = 1; continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        switch (argv[i][1])
+        {
+        case 'b': baud = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'd': delay_ms = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'c': chunk = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 't': timeout_ms = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'r': retries = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!port || !path || chunk < 4 || chunk > IAP_DATA_MAX) usage(argv[0]);
+
+    if (!iap_upload_load(&up, path, chunk)) return 1;
+
+    port_fd = iap_port_open(port, baud);
+    if (port_fd < 0) return 1;
+    t0 = iap_now();
+
+    if (jump)
+    {
+        iap_frame_t j;
+
+        iap_frame_build(&j, CMD_JUMP_IAP, 0, NULL, 0, PH_JUMP);
+        if (frame_send(&j, timeout_ms) != ERR_SUCCESS)
+        {
+            fprintf(stderr, "no answer to CMD_JUMP_IAP\n");
+            report(up.len, iap_now() - t0);
+            return 1;
+        }
+        usleep(delay_ms * 1000);
+    }
+
+    for (k = 0; k < up.count; k++)
+    {
+        f = &up.frames[k];
+        if (f->phase == PH_END && no_end) continue;
+        st = frame_send(f, (f->phase == PH_ERASE) ? timeout_ms * 10 : timeout_ms);
+        if (st == ERR_SUCCESS) continue;
+
+        if (st < 0) fprintf(stderr, "%s frame %u not answered after %u retries\n", iap_phase_name[f->phase], k, retries);
+        else fprintf(stderr, "%s failed at frame %u, reset the board and start again\n", iap_phase_name[f->phase], k);
+        break;
+    }
+
+    report(up.len, iap_now() - t0);
+    close(port_fd);
+    free(up.frames);
+    if (st == ERR_SUCCESS) return 0;
+    return (st < 0) ? 1 : 3;
+}
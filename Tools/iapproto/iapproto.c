@@ -0,0 +1,303 @@
+/*
+ * iapproto.c
+ *
+ *  Host side UART IAP protocol helpers, see iapproto.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iapproto.h"
+
+#define FLASH_Base   0x08000000u
+
+const char *iap_phase_name[PH_COUNT] = { "jump", "erase", "program", "verify", "end" };
+
+double iap_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Builds one frame, arg is only sent for ERASE and VERIFY */
+void iap_frame_build(iap_frame_t *f, uint8_t cmd, uint32_t arg, const uint8_t *data, uint8_t len, uint8_t phase)
+{
+    uint16_t sum = 0;
+    uint8_t *p = f->buf;
+    int i;
+
+    *p++ = Uart_Sync_Head1;
+    *p++ = Uart_Sync_Head2;
+    *p++ = cmd;
+    *p++ = len;
+    if (cmd == CMD_IAP_ERASE || cmd == CMD_IAP_VERIFY)
+    {
+        for (i = 0; i < 4; i++) *p++ = (uint8_t)(arg >> (i * 8));
+    }
+    if (cmd == CMD_IAP_PROM || cmd == CMD_IAP_VERIFY)
+    {
+        memcpy(p, data, len);
+        p += len;
+    }
+    for (i = 2; i < p - f->buf; i++) sum += f->buf[i];
+    *p++ = (uint8_t)sum;
+    *p++ = (uint8_t)(sum >> 8);
+    *p++ = Uart_Sync_Head2;
+    *p++ = Uart_Sync_Head1;
+    f->len = (uint8_t)(p - f->buf);
+    f->phase = phase;
+    f->bytes = (cmd == CMD_IAP_PROM || cmd == CMD_IAP_VERIFY) ? len : 0;
+}
+
+/*
+ * Feeds one received byte to the answer parser. Anything that is not an
+ * answer (the IAP prints text while it waits) is skipped. Returns the
+ * status byte once an answer is complete, -1 otherwise.
+ */
+int iap_answer_feed(iap_answer_rx_t *rx, uint8_t c)
+{
+    static const uint8_t head[3] = { Uart_Sync_Head1, Uart_Sync_Head2, 0x00 };
+
+    rx->a[rx->n++] = c;
+    if (rx->n <= 3 && c != head[rx->n - 1])
+    {
+        rx->n = (c == Uart_Sync_Head1) ? 1 : 0;
+        if (rx->n) rx->a[0] = c;
+        return -1;
+    }
+    if (rx->n < IAP_ANSWER_LEN) return -1;
+
+    rx->n = 0;
+    if (rx->a[4] == Uart_Sync_Head2 && rx->a[5] == Uart_Sync_Head1) return rx->a[3];
+    return -1;
+}
+
+/*
+ * Feeds one received byte to the frame parser, the way UART_Rx_Deal()
+ * reads it. Returns 1 when a frame with a good checksum and trailer is in
+ * rx->buf, -1 when a complete frame was bad (the target drops those
+ * without answering), 0 otherwise.
+ */
+int iap_frame_feed(iap_frame_rx_t *rx, uint8_t c)
+{
+    uint16_t sum = 0;
+    uint8_t cmd, i, end;
+
+    if ((rx->n == 0 && c != Uart_Sync_Head1) || (rx->n == 1 && c != Uart_Sync_Head2))
+    {
+        rx->n = 0;
+        return 0;
+    }
+    rx->buf[rx->n++] = c;
+
+    if (rx->n == 4)
+    {
+        cmd = rx->buf[2];
+        if (c > IAP_DATA_MAX)
+        {
+            rx->n = 0;
+            return -1;
+        }
+        rx->need = 4 + 4;
+        if (cmd == CMD_IAP_ERASE || cmd == CMD_IAP_VERIFY) rx->need += 4;
+        if (cmd == CMD_IAP_PROM || cmd == CMD_IAP_VERIFY) rx->need += c;
+    }
+    if (rx->n < 4 || rx->n < rx->need) return 0;
+
+    rx->n = 0;
+    end = rx->need - 4;
+    for (i = 2; i < end; i++) sum += rx->buf[i];
+    if (rx->buf[end] != (uint8_t)sum || rx->buf[end + 1] != (uint8_t)(sum >> 8)) return -1;
+    if (rx->buf[end + 2] != Uart_Sync_Head2 || rx->buf[end + 3] != Uart_Sync_Head1) return -1;
+    return 1;
+}
+
+static int hex_byte(const char *s)
+{
+    unsigned v;
+
+    return (sscanf(s, "%2x", &v) == 1) ? (int)v : -1;
+}
+
+/* Intel HEX as written by the MounRiver build, linked at 0 or FLASH_Base */
+static int load_hex(iap_upload_t *u, FILE *in, const char *path)
+{
+    char line[600];
+    uint32_t base = 0, addr, i;
+    int n, type, b, sum;
+
+    memset(u->image, 0xFF, sizeof(u->image));
+    u->len = 0;
+    while (fgets(line, sizeof(line), in))
+    {
+        if (line[0] != ':') continue;
+        n = hex_byte(line + 1);
+        addr = (hex_byte(line + 3) << 8) | hex_byte(line + 5);
+        type = hex_byte(line + 7);
+        if (n < 0 || type < 0 || strlen(line) < (size_t)(11 + 2 * n)) goto bad;
+
+        sum = n + (addr >> 8) + (addr & 0xFF) + type;
+        for (i = 0; i <= (uint32_t)n; i++) sum += hex_byte(line + 9 + 2 * i);
+        if (sum & 0xFF) goto bad;
+
+        switch (type)
+        {
+        case 0:
+            addr += base;
+            if (addr >= FLASH_Base) addr -= FLASH_Base;
+            if (addr + n > IAP_IMAGE_MAX)
+            {
+                fprintf(stderr, "%s: data at 0x%X beyond %u bytes\n", path, (unsigned)addr, IAP_IMAGE_MAX);
+                return 0;
+            }
+            for (i = 0; i < (uint32_t)n; i++)
+            {
+                b = hex_byte(line + 9 + 2 * i);
+                u->image[addr + i] = (uint8_t)b;
+            }
+            if (addr + n > u->len) u->len = addr + n;
+            break;
+        case 1:
+            return 1;
+        case 2:
+            base = (uint32_t)((hex_byte(line + 9) << 8) | hex_byte(line + 11)) << 4;
+            break;
+        case 4:
+            base = (uint32_t)((hex_byte(line + 9) << 8) | hex_byte(line + 11)) << 16;
+            break;
+        }
+    }
+    return 1;
+
+bad:
+    fprintf(stderr, "%s: bad record: %s", path, line);
+    return 0;
+}
+
+/*
+ * Reads a .bin or Intel .hex image and builds every frame of the upload:
+ * ERASE, PROM in chunks, VERIFY in chunks (the first one also makes the
+ * target write its last partial page) and END.
+ */
+int iap_upload_load(iap_upload_t *u, const char *path, unsigned chunk)
+{
+    FILE *in = fopen(path, "rb");
+    uint32_t off, n;
+    int c, ok = 1;
+
+    if (!in)
+    {
+        perror(path);
+        return 0;
+    }
+    c = fgetc(in);
+    ungetc(c, in);
+    if (c == ':') ok = load_hex(u, in, path);
+    else
+    {
+        u->len = (uint32_t)fread(u->image, 1, sizeof(u->image), in);
+        if (fgetc(in) != EOF)
+        {
+            fprintf(stderr, "%s: larger than %u bytes\n", path, IAP_IMAGE_MAX);
+            ok = 0;
+        }
+    }
+    fclose(in);
+    if (!ok) return 0;
+    if (!u->len)
+    {
+        fprintf(stderr, "%s: empty\n", path);
+        return 0;
+    }
+
+    u->frames = calloc(2 + 2 * ((u->len + chunk - 1) / chunk), sizeof(iap_frame_t));
+    u->count = 0;
+    iap_frame_build(&u->frames[u->count++], CMD_IAP_ERASE, u->len, NULL, 0, PH_ERASE);
+    for (off = 0; off < u->len; off += n)
+    {
+        n = (u->len - off < chunk) ? u->len - off : chunk;
+        iap_frame_build(&u->frames[u->count++], CMD_IAP_PROM, 0, u->image + off, (uint8_t)n, PH_PROM);
+    }
+    for (off = 0; off < u->len; off += n)
+    {
+        n = (u->len - off < chunk) ? u->len - off : chunk;
+        iap_frame_build(&u->frames[u->count++], CMD_IAP_VERIFY, off, u->image + off, (uint8_t)n, PH_VERIFY);
+    }
+    iap_frame_build(&u->frames[u->count++], CMD_IAP_END, 0, NULL, 0, PH_END);
+    return 1;
+}
+
+static speed_t baud_code(unsigned baud)
+{
+    switch (baud)
+    {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    }
+    return 0;
+}
+
+/* Opens a serial port or pty in raw 8N1 mode, returns the fd or -1 */
+int iap_port_open(const char *path, unsigned baud)
+{
+    struct termios t;
+    speed_t sp = baud_code(baud);
+    int fd;
+
+    if (!sp)
+    {
+        fprintf(stderr, "unsupported baud rate %u\n", baud);
+        return -1;
+    }
+    fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if (tcgetattr(fd, &t) == 0)
+    {
+        cfmakeraw(&t);
+        t.c_cflag |= CLOCAL | CREAD;
+        t.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+        t.c_cc[VMIN] = 0;
+        t.c_cc[VTIME] = 0;
+        cfsetispeed(&t, sp);
+        cfsetospeed(&t, sp);
+        tcsetattr(fd, TCSANOW, &t);
+    }
+    return fd;
+}
+
+int iap_write_all(int fd, const uint8_t *p, uint32_t n)
+{
+    ssize_t w;
+
+    while (n)
+    {
+        w = write(fd, p, n);
+        if (w < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("write");
+            return 0;
+        }
+        p += w;
+        n -= (uint32_t)w;
+    }
+    return 1;
+}
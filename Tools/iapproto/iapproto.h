@@ -0,0 +1,76 @@
+/*
+ * iapproto.h
+ *
+ *  Host side pieces of the UART IAP protocol of iap.h, shared by
+ *  iapload, iapflash and iaptarget: frame building and parsing for both
+ *  directions, image loading and serial port setup.
+ *
+ *  Host frame:    AA 55 cmd len [arg, 4 bytes LE] [data] sum16 LE 55 AA
+ *                 arg for ERASE and VERIFY, data for PROM and VERIFY,
+ *                 sum over cmd..data
+ *  Target answer: AA 55 00 status 55 AA, none for CMD_IAP_END
+ */
+
+#ifndef IAPPROTO_H_
+#define IAPPROTO_H_
+
+#include <stdint.h>
+
+/* iap.h */
+#define Uart_Sync_Head1   0xaa
+#define Uart_Sync_Head2   0x55
+
+#define CMD_IAP_PROM      0x80
+#define CMD_IAP_ERASE     0x81
+#define CMD_IAP_VERIFY    0x82
+#define CMD_IAP_END       0x83
+#define CMD_JUMP_IAP      0x84
+
+#define ERR_SUCCESS       0x00
+#define ERR_ERROR         0x01
+
+#define IAP_DATA_MAX      64
+#define IAP_IMAGE_MAX     (0x4000 - 64)    /* last page holds CalAddr */
+#define IAP_FRAME_MAX     (4 + 4 + IAP_DATA_MAX + 4)
+#define IAP_ANSWER_LEN    6
+
+enum { PH_JUMP, PH_ERASE, PH_PROM, PH_VERIFY, PH_END, PH_COUNT };
+
+extern const char *iap_phase_name[PH_COUNT];
+
+typedef struct {
+    uint8_t buf[IAP_FRAME_MAX];
+    uint8_t len;
+    uint8_t phase;
+    uint8_t bytes;           /* image bytes carried */
+} iap_frame_t;
+
+/* Every frame of one upload, built once */
+typedef struct {
+    uint8_t image[IAP_IMAGE_MAX];
+    uint32_t len;
+    iap_frame_t *frames;
+    uint32_t count;
+} iap_upload_t;
+
+/* Answer parser state */
+typedef struct {
+    uint8_t a[IAP_ANSWER_LEN];
+    uint8_t n;
+} iap_answer_rx_t;
+
+/* Frame parser state (target side) */
+typedef struct {
+    uint8_t buf[IAP_FRAME_MAX];
+    uint8_t n, need;
+} iap_frame_rx_t;
+
+void iap_frame_build(iap_frame_t *f, uint8_t cmd, uint32_t arg, const uint8_t *data, uint8_t len, uint8_t phase);
+int iap_answer_feed(iap_answer_rx_t *rx, uint8_t c);
+int iap_frame_feed(iap_frame_rx_t *rx, uint8_t c);
+int iap_upload_load(iap_upload_t *u, const char *path, unsigned chunk);
+int iap_port_open(const char *path, unsigned baud);
+int iap_write_all(int fd, const uint8_t *p, uint32_t n);
+double iap_now(void);
+
+#endif /* IAPPROTO_H_ */
@@ -0,0 +1,351 @@
+/*
+ * iaptarget.c
+ *
+ *  Simulated boards for testing iapload and iapflash without hardware.
+ *  Each target sits behind a pseudo-terminal and answers the UART IAP
+ *  protocol the way the APP (CMD_JUMP_IAP only) and CH32V003_IAP's
+ *  UART_Rx_Deal()/RecData_Deal() do, including the 64 byte program
+ *  buffer that is only flushed by the first VERIFY.
+ *
+ *  Answers are delayed by the time the frame and the answer take on the
+ *  wire at the given baud rate, plus the flash erase/program time, so the
+ *  host sees roughly the round trips of a real board. Line errors can be
+ *  injected: a dropped frame (bad checksum, not answered) or a lost
+ *  answer (frame executed, answer not sent).
+ *
+ *  The slave side path of every target is printed on stdout, one per
+ *  line, then the targets run until interrupted, or until all of them
+ *  completed an upload with -1. Each finished upload is reported on
+ *  stderr and, with -o, the flash contents written to dir/targetN.bin.
+ *
+ *  Build:  cc -O2 -I../iapproto -o iaptarget iaptarget.c ../iapproto/iapproto.c
+ *  Usage:  iaptarget [options]
+ *            -n count     number of targets (default 1)
+ *            -b baud      wire speed to simulate, 0 for none (default 460800)
+ *            -a           start in the APP, expecting CMD_JUMP_IAP first
+ *            -e percent   frames dropped as line errors (default 0)
+ *            -l percent   answers lost after the frame was executed (default 0)
+ *            -F index     target that fails verify (stuck flash bit)
+ *            -s seed      random seed for the error injection
+ *            -o dir       write the flash of each target after END
+ *            -1           exit once every target finished one upload
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "iapproto.h"
+
+#define FLASH_SIZE        0x4000
+#define CalAddr           (FLASH_SIZE - 4)
+#define CheckNum          0x5aa55aa5u
+
+/* Target timing in ms, approximate CH32V003 values */
+#define T_MASS_ERASE_MS   40.0
+#define T_PAGE_PROG_MS    1.5
+#define T_REBOOT_MS       20.0
+
+enum { MODE_APP, MODE_IAP, MODE_REBOOT };
+
+typedef struct {
+    int master, slave, index;
+    const char *name;
+    uint8_t mode;
+    uint8_t reboot_wait;                /* answer to CMD_JUMP_IAP sent */
+    iap_frame_rx_t rx;
+    uint8_t flash[FLASH_SIZE];
+    uint8_t prog_buf[128];
+    uint16_t code_len;
+    uint32_t program_addr, verify_addr;
+    uint8_t verify_started;
+    uint8_t answer[IAP_ANSWER_LEN + 8];
+    uint8_t answer_len;
+    double answer_at;                   /* 0 when nothing is pending */
+    double busy_ms;                     /* flash time of the current frame */
+    unsigned uploads, frames, dropped, lost;
+} target_t;
+
+static target_t *targets;
+static int ntargets = 1;
+static unsigned baud = 460800;
+static int start_app = 0;
+static unsigned drop_pct = 0, lose_pct = 0;
+static int bad_target = -1;
+static const char *out_dir = NULL;
+static int once = 0;
+
+static double wire_ms(unsigned bytes)
+{
+    return baud ? bytes * 10 * 1000.0 / baud : 0;
+}
+
+static void answer(target_t *t, uint8_t status)
+{
+    static const uint8_t a[IAP_ANSWER_LEN] = { Uart_Sync_Head1, Uart_Sync_Head2, 0x00, 0x00, Uart_Sync_Head2, Uart_Sync_Head1 };
+
+    memcpy(t->answer, a, sizeof(a));
+    t->answer[3] = status;
+    t->answer_len = IAP_ANSWER_LEN;
+}
+
+static void program_page(target_t *t, const uint8_t *src)
+{
+    if (t->program_addr + 64 <= FLASH_SIZE)
+    {
+        memcpy(&t->flash[t->program_addr], src, 64);
+        if (t->index == bad_target) t->flash[t->program_addr + 5] &= 0xFE;
+    }
+    t->busy_ms += T_PAGE_PROG_MS;
+}
+
+static void save_flash(const target_t *t)
+{
+    char path[512];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/target%d.bin", out_dir, t->index);
+    f = fopen(path, "wb");
+    if (!f)
+    {
+        perror(path);
+        return;
+    }
+    fwrite(t->flash, 1, sizeof(t->flash), f);
+    fclose(f);
+}
+
+/* RecData_Deal() of the APP or the IAP, depending on the mode */
+static void execute(target_t *t, const uint8_t *fr)
+{
+    uint8_t cmd = fr[2], len = fr[3];
+    const uint8_t *data = fr + ((cmd == CMD_IAP_VERIFY) ? 8 : 4);
+    uint8_t st = ERR_SUCCESS;
+
+    t->answer_len = 0;
+    t->busy_ms = 0;
+
+    if (t->mode == MODE_APP)
+    {
+        if (cmd == CMD_JUMP_IAP)
+        {
+            answer(t, ERR_SUCCESS);
+            t->mode = MODE_REBOOT;
+        }
+        else answer(t, ERR_ERROR);
+        return;
+    }
+
+    switch (cmd)
+    {
+    case CMD_IAP_ERASE:
+        memset(t->flash, 0xFF, sizeof(t->flash));
+        t->busy_ms = T_MASS_ERASE_MS;
+        break;
+    case CMD_IAP_PROM:
+        memcpy(&t->prog_buf[t->code_len], data, len);
+        t->code_len += len;
+        if (t->code_len >= 64)
+        {
+            program_page(t, t->prog_buf);
+            t->code_len -= 64;
+            memmove(t->prog_buf, &t->prog_buf[64], t->code_len);
+            t->program_addr += 64;
+        }
+        break;
+    case CMD_IAP_VERIFY:
+        if (!t->verify_started)
+        {
+            t->verify_started = 1;
+            memset(&t->prog_buf[t->code_len], 0xFF, 64 - t->code_len);
+            program_page(t, t->prog_buf);
+            t->code_len = 0;
+        }
+        if (t->verify_addr + len > FLASH_SIZE || memcmp(data, &t->flash[t->verify_addr], len)) st = ERR_ERROR;
+        t->verify_addr += len;
+        break;
+    case CMD_IAP_END:
+        t->verify_started = 0;
+        t->program_addr = t->verify_addr = 0;
+        t->flash[CalAddr] = (uint8_t)CheckNum;
+        t->flash[CalAddr + 1] = (uint8_t)(CheckNum >> 8);
+        t->flash[CalAddr + 2] = (uint8_t)(CheckNum >> 16);
+        t->flash[CalAddr + 3] = (uint8_t)(CheckNum >> 24);
+        t->uploads++;
+        fprintf(stderr, "%s: upload %u done, %u frames, %u dropped, %u answers lost\n", t->name, t->uploads,
+                t->frames, t->dropped, t->lost);
+        if (out_dir) save_flash(t);
+        t->mode = MODE_APP;
+        return;
+    case CMD_JUMP_IAP:
+        break;
+    default:
+        st = ERR_ERROR;
+    }
+    answer(t, st);
+}
+
+static void target_read(target_t *t)
+{
+    uint8_t buf[256];
+    ssize_t n, i;
+    int r;
+
+    n = read(t->master, buf, sizeof(buf));
+    if (n <= 0) return;
+
+    for (i = 0; i < n; i++)
+    {
+        /* Input while rebooting or busy is lost, as with the real receiver */
+        if (t->mode == MODE_REBOOT || t->answer_at) continue;
+
+        r = iap_frame_feed(&t->rx, buf[i]);
+        if (r == 0) continue;
+        t->frames++;
+        if (r < 0) continue;
+        if (drop_pct && (unsigned)(rand() % 100) < drop_pct)
+        {
+            t->dropped++;
+            continue;
+        }
+
+        execute(t, t->rx.buf);
+        if (lose_pct && t->answer_len && (unsigned)(rand() % 100) < lose_pct)
+        {
+            t->lost++;
+            t->answer_len = 0;
+        }
+        t->answer_at = iap_now() + (wire_ms(t->rx.need + t->answer_len) + t->busy_ms) / 1000.0;
+    }
+}
+
+/* Sends answers that are due and finishes reboots */
+static void target_tick(target_t *t, double now)
+{
+    static const char boot[] = "Boot\r\n";
+
+    if (!t->answer_at || now < t->answer_at) return;
+    t->answer_at = 0;
+    if (t->answer_len)
+    {
+        iap_write_all(t->master, t->answer, t->answer_len);
+        t->answer_len = 0;
+    }
+    if (t->mode != MODE_REBOOT) return;
+
+    /* Answer to CMD_JUMP_IAP sent: the IAP starts a little later */
+    if (!t->reboot_wait)
+    {
+        t->reboot_wait = 1;
+        t->answer_at = now + T_REBOOT_MS / 1000.0;
+        return;
+    }
+    t->reboot_wait = 0;
+    t->mode = MODE_IAP;
+    t->rx.n = 0;
+    t->code_len = 0;
+    t->verify_started = 0;
+    t->program_addr = t->verify_addr = 0;
+    iap_write_all(t->master, (const uint8_t *)boot, sizeof(boot) - 1);
+}
+
+static int target_open(target_t *t, int index)
+{
+    struct termios tio;
+
+    t->index = index;
+    t->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (t->master < 0 || grantpt(t->master) || unlockpt(t->master))
+    {
+        perror("posix_openpt");
+        return 0;
+    }
+    t->name = strdup(ptsname(t->master));
+
+    /* Kept open so the settings stick and the master never sees a hangup */
+    t->slave = open(t->name, O_RDWR | O_NOCTTY);
+    if (t->slave >= 0 && tcgetattr(t->slave, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(t->slave, TCSANOW, &tio);
+    }
+    memset(t->flash, 0xFF, sizeof(t->flash));
+    t->mode = start_app ? MODE_APP : MODE_IAP;
+    return 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n count] [-b baud] [-a] [-e pct] [-l pct] [-F index] [-s seed] [-o dir] [-1]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct epoll_event ev, evs[32];
+    double now, next;
+    int epfd, i, n, left, done;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-') usage(argv[0]);
+        switch (argv[i][1])
+        {
+        case 'a': start_app = 1; continue;
+        case '1': once = 1; continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        switch (argv[i][1])
+        {
+        case 'n': ntargets = atoi(argv[++i]); break;
+        case 'b': baud = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'e': drop_pct = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'l': lose_pct = (unsigned)strtoul(argv[++i], NULL, 0); break;
+        case 'F': bad_target = atoi(argv[++i]); break;
+        case 's': srand((unsigned)strtoul(argv[++i], NULL, 0)); break;
+        case 'o': out_dir = argv[++i]; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (ntargets < 1) usage(argv[0]);
+
+    epfd = epoll_create1(0);
+    targets = calloc(ntargets, sizeof(target_t));
+    for (i = 0; i < ntargets; i++)
+    {
+        if (!target_open(&targets[i], i)) return 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &targets[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, targets[i].master, &ev);
+        printf("%s\n", targets[i].name);
+    }
+    fflush(stdout);
+
+    for (;;)
+    {
+        now = iap_now();
+        next = 0;
+        done = 0;
+        for (i = 0; i < ntargets; i++)
+        {
+            target_tick(&targets[i], now);
+            if (targets[i].answer_at && (!next || targets[i].answer_at < next)) next = targets[i].answer_at;
+            done += (targets[i].uploads > 0);
+        }
+        if (once && done == ntargets) break;
+
+        left = next ? (int)((next - iap_now()) * 1000) + 1 : -1;
+        n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), (next && left < 0) ? 0 : left);
+        for (i = 0; i < n; i++) target_read(evs[i].data.ptr);
+    }
+    return 0;
+}
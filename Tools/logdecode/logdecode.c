@@ -0,0 +1,239 @@
+/*
+ * logdecode.c
+ *
+ *  Host side decoder for the binary records sent by TF_LOG() when the
+ *  firmware is built with TFMT_LOG = TFMT_LOG_BINARY. The format strings
+ *  are taken from the .logfmt section of the matching ELF file, %s
+ *  arguments (string addresses) from its loaded sections. Plain text in
+ *  the capture is passed through unchanged.
+ *
+ *  Build:  cc -O2 -o logdecode logdecode.c
+ *  Usage:  logdecode firmware.elf [capture]      (stdin when no file given)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TFMT_LOG_SYNC1      0xD6
+#define TFMT_LOG_SYNC2      0x6D
+#define TFMT_LOG_MAX_ARGS   8
+
+#define SHT_NOBITS          8
+#define SHF_ALLOC           0x2
+
+static uint8_t *elf;
+static size_t elf_size;
+static const char *fmt_base;
+static uint32_t fmt_size;
+static unsigned records_ok = 0;
+static unsigned records_bad = 0;
+
+static uint32_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+/* Reads exactly n bytes, 0 at end of input */
+static int read_exact(FILE *in, uint8_t *buf, size_t n)
+{
+    return fread(buf, 1, n, in) == n;
+}
+
+static int load_elf(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    uint32_t shoff, shentsize, shnum, shstrndx, i;
+    const uint8_t *sh, *strsh;
+    long n;
+
+    if (!f)
+    {
+        perror(path);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    elf = malloc(n > 0 ? n : 1);
+    if (!elf || n < 52 || !read_exact(f, elf, n))
+    {
+        fprintf(stderr, "%s: cannot read\n", path);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    elf_size = n;
+
+    /* 32 bit little endian only, that is all the CH32V00x toolchain makes */
+    if (memcmp(elf, "\x7f" "ELF", 4) || elf[4] != 1 || elf[5] != 1)
+    {
+        fprintf(stderr, "%s: not a 32 bit little endian ELF file\n", path);
+        return 0;
+    }
+
+    shoff = rd32(elf + 32);
+    shentsize = rd16(elf + 46);
+    shnum = rd16(elf + 48);
+    shstrndx = rd16(elf + 50);
+    if (shoff + shnum * shentsize > elf_size || shstrndx >= shnum)
+    {
+        fprintf(stderr, "%s: bad section table\n", path);
+        return 0;
+    }
+
+    strsh = elf + shoff + shstrndx * shentsize;
+    for (i = 0; i < shnum; i++)
+    {
+        sh = elf + shoff + i * shentsize;
+        if (!strcmp((const char *)elf + rd32(strsh + 16) + rd32(sh), ".logfmt"))
+        {
+            fmt_base = (const char *)elf + rd32(sh + 16);
+            fmt_size = rd32(sh + 20);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "%s: no .logfmt section (built without TFMT_LOG_BINARY?)\n", path);
+    return 0;
+}
+
+/* String at a target address, taken from the loaded sections of the ELF */
+static const char *target_string(uint32_t addr)
+{
+    uint32_t shoff = rd32(elf + 32), shentsize = rd16(elf + 46), shnum = rd16(elf + 48), i;
+    const uint8_t *sh;
+
+    for (i = 0; i < shnum; i++)
+    {
+        sh = elf + shoff + i * shentsize;
+        if (!(rd32(sh + 8) & SHF_ALLOC) || rd32(sh + 4) == SHT_NOBITS) continue;
+        if (addr >= rd32(sh + 12) && addr < rd32(sh + 12) + rd32(sh + 20))
+        {
+            return (const char *)elf + rd32(sh + 16) + (addr - rd32(sh + 12));
+        }
+    }
+    return NULL;
+}
+
+/* Prints fmt with the record arguments, same subset as TF_Printf() */
+static void print_record(const char *fmt, const uint32_t *args, unsigned nargs)
+{
+    char spec[16];
+    unsigned a = 0, n;
+    const char *s;
+    char ram[24];
+
+    while (*fmt)
+    {
+        if (*fmt != '%')
+        {
+            putchar(*fmt++);
+            continue;
+        }
+
+        n = 0;
+        spec[n++] = *fmt++;
+        while ((*fmt == '-' || *fmt == '0' || (*fmt >= '1' && *fmt <= '9')) && n < sizeof(spec) - 3)
+        {
+            spec[n++] = *fmt++;
+        }
+        while (*fmt >= '0' && *fmt <= '9' && n < sizeof(spec) - 3) spec[n++] = *fmt++;
+        if (*fmt == 'l') fmt++;
+        if (!*fmt) break;
+        spec[n++] = *fmt;
+        spec[n] = '\0';
+
+        switch (*fmt++)
+        {
+            case 'd':
+                printf(spec, a < nargs ? (int32_t)args[a] : 0);
+                a++;
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'c':
+                printf(spec, a < nargs ? args[a] : 0);
+                a++;
+                break;
+
+            case 's':
+                s = a < nargs ? target_string(args[a]) : NULL;
+                if (!s)
+                {
+                    snprintf(ram, sizeof(ram), "<0x%08X>", a < nargs ? (unsigned)args[a] : 0);
+                    s = ram;
+                }
+                printf(spec, s);
+                a++;
+                break;
+
+            default:
+                putchar(fmt[-1]);
+                break;
+        }
+    }
+}
+
+/* Decodes the record following a sync, returns 0 at end of input */
+static int decode_record(FILE *in)
+{
+    uint8_t hdr[3], raw[4 * TFMT_LOG_MAX_ARGS];
+    uint32_t args[TFMT_LOG_MAX_ARGS];
+    uint32_t id, i;
+
+    if (!read_exact(in, hdr, sizeof(hdr))) return 0;
+    id = rd16(hdr);
+    if (hdr[2] > TFMT_LOG_MAX_ARGS || id >= fmt_size)
+    {
+        records_bad++;
+        fprintf(stderr, "bad record id %u nargs %u\n", (unsigned)id, hdr[2]);
+        return 1;
+    }
+    if (!read_exact(in, raw, 4 * hdr[2])) return 0;
+    for (i = 0; i < hdr[2]; i++) args[i] = rd32(raw + 4 * i);
+
+    print_record(fmt_base + id, args, hdr[2]);
+    records_ok++;
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    int c, prev = -1;
+
+    if (argc < 2 || argc > 3 || argv[1][0] == '-')
+    {
+        fprintf(stderr, "usage: %s firmware.elf [capture]\n", argv[0]);
+        return 2;
+    }
+    if (!load_elf(argv[1])) return 1;
+    if (argc == 3)
+    {
+        in = fopen(argv[2], "rb");
+        if (!in)
+        {
+            perror(argv[2]);
+            return 1;
+        }
+    }
+
+    /* Text is echoed unchanged, records are recognised by their sync pair */
+    while ((c = fgetc(in)) != EOF)
+    {
+        if (prev == TFMT_LOG_SYNC1 && c == TFMT_LOG_SYNC2)
+        {
+            prev = -1;
+            if (!decode_record(in)) break;
+            continue;
+        }
+        if (prev >= 0) putchar(prev);
+        prev = c;
+    }
+    if (prev >= 0 && prev != TFMT_LOG_SYNC1) putchar(prev);
+
+    fprintf(stderr, "%u record(s) decoded, %u bad\n", records_ok, records_bad);
+    return records_bad ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * memops_test.c
+ *
+ *  Host check and benchmark of the word wise memcpy/memset/memcmp in
+ *  CH32V003_APP/User/memops.c (the IAP has the same file). The file is
+ *  compiled in here under the names MEM_Copy/MEM_Set/MEM_Compare and
+ *  compared against the C library for every source and destination
+ *  alignment 0..3 and every length 0..N:
+ *    - memcpy: destination bytes and the guard bytes around them
+ *    - memset: the same, for several fill values (also one above 0xFF)
+ *    - memcmp: equal areas, and one difference at every position, both
+ *      signs
+ *  Then every routine is timed against a plain byte loop, which is what
+ *  newlib nano's versions are. The host numbers only show relative cost
+ *  and catch regressions, on the target the APP's PERF regions are the
+ *  reference.
+ *
+ *  Build:  cc -O2 -I../../CH32V003_APP/User -o memops_test memops_test.c
+ *  Usage:  memops_test [-n maxlen] [-b]
+ *            -n maxlen    longest length checked (default 256)
+ *            -b           run the benchmark only
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* memops.c under other names, string.h is already in so its prototypes stay */
+#define memcpy MEM_Copy
+#define memset MEM_Set
+#define memcmp MEM_Compare
+#include "memops.c"
+#undef memcpy
+#undef memset
+#undef memcmp
+
+#define GUARD      16              /* bytes checked on each side */
+#define SLACK      8               /* memcpy may read up to 3 bytes past the source */
+
+static uint8_t *src_buf, *dst_buf, *ref_buf;
+static unsigned long checks, failures;
+
+static void fill(uint8_t *p, size_t n, unsigned seed)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        p[i] = (uint8_t)(seed + i * 131 + (i >> 8));
+    }
+}
+
+static void fail(const char *what, unsigned da, unsigned sa, size_t len)
+{
+    failures++;
+    if(failures <= 20)
+    {
+        fprintf(stderr, "FAIL %s dst+%u src+%u len %zu\n", what, da, sa, len);
+    }
+}
+
+static void check_copy(size_t maxlen)
+{
+    size_t size = maxlen + 2 * GUARD + SLACK + 4;
+    unsigned da, sa;
+    size_t len;
+    void *r;
+
+    for(da = 0; da < 4; da++)
+    {
+        for(sa = 0; sa < 4; sa++)
+        {
+            for(len = 0; len <= maxlen; len++)
+            {
+                fill(src_buf, size, 7);
+                fill(dst_buf, size, 99);
+                memcpy(ref_buf, dst_buf, size);
+
+                r = MEM_Copy(dst_buf + GUARD + da, src_buf + GUARD + sa, len);
+                memcpy(ref_buf + GUARD + da, src_buf + GUARD + sa, len);
+
+                checks++;
+                if(r != dst_buf + GUARD + da) fail("memcpy return", da, sa, len);
+                else if(memcmp(dst_buf, ref_buf, size)) fail("memcpy", da, sa, len);
+            }
+        }
+    }
+}
+
+static void check_set(size_t maxlen)
+{
+    static const int values[] = { 0x00, 0xA5, 0xFF, 0x1A5 };
+    size_t size = maxlen + 2 * GUARD + 4;
+    unsigned da, v;
+    size_t len;
+    void *r;
+
+    for(v = 0; v < sizeof(values) / sizeof(values[0]); v++)
+    {
+        for(da = 0; da < 4; da++)
+        {
+            for(len = 0; len <= maxlen; len++)
+            {
+                fill(dst_buf, size, 99);
+                memcpy(ref_buf, dst_buf, size);
+
+                r = MEM_Set(dst_buf + GUARD + da, values[v], len);
+                memset(ref_buf + GUARD + da, values[v], len);
+
+                checks++;
+                if(r != dst_buf + GUARD + da) fail("memset return", da, v, len);
+                else if(memcmp(dst_buf, ref_buf, size)) fail("memset", da, v, len);
+            }
+        }
+    }
+}
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+static void check_compare(size_t maxlen)
+{
+    unsigned aa, ba;
+    size_t len, k;
+    uint8_t *a, *b;
+
+    for(aa = 0; aa < 4; aa++)
+    {
+        for(ba = 0; ba < 4; ba++)
+        {
+            a = src_buf + GUARD + aa;
+            b = dst_buf + GUARD + ba;
+            for(len = 0; len <= maxlen; len++)
+            {
+                fill(a, len, 7);
+                fill(b, len, 7);
+                checks++;
+                if(MEM_Compare(a, b, len) != 0) fail("memcmp equal", aa, ba, len);
+
+                for(k = 0; k < len; k++)
+                {
+                    b[k] = a[k] + 1;
+                    checks++;
+                    if(sign(MEM_Compare(a, b, len)) != sign(memcmp(a, b, len))) fail("memcmp less", aa, ba, len);
+                    b[k] = a[k] - 1;
+                    checks++;
+                    if(sign(MEM_Compare(a, b, len)) != sign(memcmp(a, b, len))) fail("memcmp greater", aa, ba, len);
+                    b[k] = a[k];
+                }
+            }
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Byte loops as in newlib nano, kept as loops */
+#define BYTE_FN   __attribute__((noinline, optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+
+BYTE_FN static void *byte_copy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    while(n--) *d++ = *s++;
+    return dst;
+}
+
+BYTE_FN static void *byte_set(void *dst, int value, size_t n)
+{
+    uint8_t *d = dst;
+
+    while(n--) *d++ = (uint8_t)value;
+    return dst;
+}
+
+BYTE_FN static int byte_compare(const void *a, const void *b, size_t n)
+{
+    const uint8_t *p = a;
+    const uint8_t *q = b;
+
+    for(; n; n--, p++, q++)
+    {
+        if(*p != *q) return *p - *q;
+    }
+    return 0;
+}
+
+/* Calls through volatile pointers so nothing is inlined */
+static void *(*volatile ref_copy)(void *, const void *, size_t) = byte_copy;
+static void *(*volatile ref_set)(void *, int, size_t) = byte_set;
+static int (*volatile ref_compare)(const void *, const void *, size_t) = byte_compare;
+static void *(*volatile our_copy)(void *, const void *, size_t) = MEM_Copy;
+static void *(*volatile our_set)(void *, int, size_t) = MEM_Set;
+static int (*volatile our_compare)(const void *, const void *, size_t) = MEM_Compare;
+
+static void bench(void)
+{
+    static const size_t lens[] = { 8, 64, 256, 1024 };
+    static const unsigned offs[][2] = { { 0, 0 }, { 1, 1 }, { 0, 1 }, { 0, 3 } };
+    unsigned l, o;
+    long i, reps;
+    double t0, t[6];
+    uint8_t *d, *s;
+
+    printf("%6s %-8s %9s %9s %9s %9s %9s %9s  ns/call\n", "len", "dst/src",
+           "memcpy", "bytes", "memset", "bytes", "memcmp", "bytes");
+    for(l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+    {
+        reps = 20000000 / (long)(lens[l] + 16);
+        for(o = 0; o < sizeof(offs) / sizeof(offs[0]); o++)
+        {
+            d = dst_buf + GUARD + offs[o][0];
+            s = src_buf + GUARD + offs[o][1];
+            fill(s, lens[l], 7);
+            fill(d, lens[l], 7);
+
+            t0 = now_ns(); for(i = 0; i < reps; i++) our_copy(d, s, lens[l]); t[0] = now_ns() - t0;
+            t0 = now_ns(); for(i = 0; i < reps; i++) ref_copy(d, s, lens[l]); t[1] = now_ns() - t0;
+            t0 = now_ns(); for(i = 0; i < reps; i++) our_set(d, 0x5A, lens[l]); t[2] = now_ns() - t0;
+            t0 = now_ns(); for(i = 0; i < reps; i++) ref_set(d, 0x5A, lens[l]); t[3] = now_ns() - t0;
+            fill(d, lens[l], 7);
+            t0 = now_ns(); for(i = 0; i < reps; i++) our_compare(d, s, lens[l]); t[4] = now_ns() - t0;
+            t0 = now_ns(); for(i = 0; i < reps; i++) ref_compare(d, s, lens[l]); t[5] = now_ns() - t0;
+
+            printf("%6zu   +%u/+%u  %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", lens[l], offs[o][0], offs[o][1],
+                   t[0] / reps, t[1] / reps, t[2] / reps, t[3] / reps, t[4] / reps, t[5] / reps);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxlen = 256;
+    size_t size;
+    int bench_only = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "n:b")) != -1)
+    {
+        switch(c)
+        {
+            case 'n': maxlen = strtoul(optarg, NULL, 0); break;
+            case 'b': bench_only = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-n maxlen] [-b]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    size = (maxlen > 1024 ? maxlen : 1024) + 2 * GUARD + SLACK + 4;
+    src_buf = malloc(size);
+    dst_buf = malloc(size);
+    ref_buf = malloc(size);
+    if(!src_buf || !dst_buf || !ref_buf)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    if(!bench_only)
+    {
+        check_copy(maxlen);
+        check_set(maxlen);
+        check_compare(maxlen);
+        printf("%lu checks, %lu failures (alignments 0..3, lengths 0..%zu)\n", checks, failures, maxlen);
+        if(failures) return 1;
+    }
+
+    bench();
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * mkromfs.c
+ *
+ *  Builds a romfs image (see CH32V003_APP/User/romfs.h) from a directory
+ *  tree. Every regular file below the directory becomes an entry named
+ *  by its path relative to it, '/' separated; names starting with '.'
+ *  are skipped. The directory is sorted by FNV-1a hash, then by name, so
+ *  the target finds any path with a binary search over the hashes.
+ *
+ *  The image is meant to be written at ROMFS_ADDR of the external flash.
+ *  Padding is 0xFF so it programs like erased flash.
+ *
+ *  Build:  cc -O2 -o mkromfs mkromfs.c
+ *  Usage:  mkromfs [-v] dir image.bin
+ *            -v           list the entries
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* romfs.h */
+#define ROMFS_MAGIC         0x464D4F52
+#define ROMFS_VERSION       1
+#define ROMFS_HASH_INIT     0x811C9DC5u
+#define ROMFS_HASH_PRIME    0x01000193u
+#define ROMFS_HDR_SIZE      16
+#define ROMFS_ENTRY_SIZE    16
+#define ROMFS_MAX_ENTRIES   0xFFFF
+
+typedef struct {
+    char *name;              /* relative path */
+    char *path;              /* host path */
+    uint32_t hash;
+    uint32_t name_off, data_off, size;
+} entry_t;
+
+static entry_t *entries;
+static unsigned count, alloc;
+
+static uint32_t hash(const char *s)
+{
+    uint32_t h = ROMFS_HASH_INIT;
+
+    while (*s)
+    {
+        h ^= (uint8_t)*s++;
+        h *= ROMFS_HASH_PRIME;
+    }
+    return h;
+}
+
+static uint32_t align4(uint32_t v)
+{
+    return (v + 3) & ~3u;
+}
+
+static int add(const char *host, const char *name, uint32_t size)
+{
+    entry_t *e;
+
+    if (count == ROMFS_MAX_ENTRIES)
+    {
+        fprintf(stderr, "more than %u files\n", ROMFS_MAX_ENTRIES);
+        return 0;
+    }
+    if (count == alloc)
+    {
+        alloc = alloc ? 2 * alloc : 64;
+        entries = realloc(entries, alloc * sizeof(entry_t));
+    }
+    e = &entries[count++];
+    e->name = strdup(name);
+    e->path = strdup(host);
+    e->hash = hash(name);
+    e->size = size;
+    return 1;
+}
+
+/* Collects the regular files below host, rel is their name prefix */
+static int walk(const char *host, const char *rel)
+{
+    char hp[PATH_MAX], rp[PATH_MAX];
+    struct dirent *d;
+    struct stat st;
+    DIR *dir = opendir(host);
+    int ok = 1;
+
+    if (!dir)
+    {
+        perror(host);
+        return 0;
+    }
+    while (ok && (d = readdir(dir)))
+    {
+        if (d->d_name[0] == '.') continue;
+        snprintf(hp, sizeof(hp), "%s/%s", host, d->d_name);
+        snprintf(rp, sizeof(rp), "%s%s%s", rel, *rel ? "/" : "", d->d_name);
+        if (stat(hp, &st))
+        {
+            perror(hp);
+            ok = 0;
+        }
+        else if (S_ISDIR(st.st_mode)) ok = walk(hp, rp);
+        else if (S_ISREG(st.st_mode)) ok = add(hp, rp, (uint32_t)st.st_size);
+    }
+    closedir(dir);
+    return ok;
+}
+
+static int compare(const void *a, const void *b)
+{
+    const entry_t *x = a, *y = b;
+
+    if (x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-v] dir image.bin\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *src = NULL, *out = NULL;
+    uint32_t off, size;
+    uint8_t *img, *p;
+    int verbose = 0, i;
+    unsigned k;
+    FILE *f;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-v")) verbose = 1;
+        else if (argv[i][0] == '-') usage(argv[0]);
+        else if (!src) src = argv[i];
+        else if (!out) out = argv[i];
+        else usage(argv[0]);
+    }
+    if (!src || !out) usage(argv[0]);
+
+    if (!walk(src, "")) return 1;
+    qsort(entries, count, sizeof(entry_t), compare);
+
+    /* Header, directory, names, then the data extents */
+    off = ROMFS_HDR_SIZE + count * ROMFS_ENTRY_SIZE;
+    for (k = 0; k < count; k++)
+    {
+        entries[k].name_off = off;
+        off += (uint32_t)strlen(entries[k].name) + 1;
+    }
+    for (k = 0; k < count; k++)
+    {
+        off = align4(off);
+        entries[k].data_off = off;
+        off += entries[k].size;
+    }
+    size = align4(off);
+
+    img = malloc(size);
+    memset(img, 0xFF, size);
+    put32(img, ROMFS_MAGIC);
+    img[4] = (uint8_t)ROMFS_VERSION;
+    img[5] = (uint8_t)(ROMFS_VERSION >> 8);
+    img[6] = (uint8_t)count;
+    img[7] = (uint8_t)(count >> 8);
+    put32(img + 8, size);
+    put32(img + 12, 0);
+
+    for (k = 0; k < count; k++)
+    {
+        entry_t *e = &entries[k];
+
+        p = img + ROMFS_HDR_SIZE + k * ROMFS_ENTRY_SIZE;
+        put32(p, e->hash);
+        put32(p + 4, e->name_off);
+        put32(p + 8, e->data_off);
+        put32(p + 12, e->size);
+        memcpy(img + e->name_off, e->name, strlen(e->name) + 1);
+
+        f = fopen(e->path, "rb");
+        if (!f || fread(img + e->data_off, 1, e->size, f) != e->size)
+        {
+            perror(e->path);
+            return 1;
+        }
+        fclose(f);
+
+        if (verbose) printf("%08X %8u @0x%06X %s\n", e->hash, e->size, e->data_off, e->name);
+        if (k && e->hash == entries[k - 1].hash && verbose) printf("         hash shared with %s\n", entries[k - 1].name);
+    }
+
+    f = fopen(out, "wb");
+    if (!f || fwrite(img, 1, size, f) != size || fclose(f))
+    {
+        perror(out);
+        return 1;
+    }
+    printf("%s: %u files, %u bytes\n", out, count, size);
+    free(img);
+    return 0;
+}
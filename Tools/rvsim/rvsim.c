@@ -0,0 +1,2115 @@
+/*
+ * rvsim.c
+ *
+ *  Host side simulator for the CH32V003 firmware: a QingKe V2 (RV32EC)
+ *  core with the peripherals the APP and the IAP touch, so boot and update
+ *  runs can be measured without a board.
+ *
+ *  Modelled:
+ *    - RV32E + C, Zicsr, mret/wfi, the PFIC vector table (mtvec mode 3)
+ *      and the hardware prologue/epilogue (HPE) used by
+ *      interrupt("WCH-Interrupt-fast") handlers, without nesting
+ *    - 16K user flash, the 1920 byte boot area and 2K RAM; the reset
+ *      alias at 0 follows the boot mode bit (FLASH->STATR bit 14) that
+ *      SystemReset_StartMode() sets, latched at every reset
+ *    - flash controller: keys, fast mode 64 byte erase/program through the
+ *      page buffer (CH32_IAP_Program), 1K and mass erase, halfword program
+ *    - RCC (clock switching with immediate ready bits), SysTick (compare
+ *      flag and interrupt), PFIC, GPIOA/C/D, USART1 (TX to stdout, RX from
+ *      a file, paced at the programmed baud rate), DMA1 for USART1 TX,
+ *      SPI1 and a W25Q-style SPI flash selected by PD0, standby with the
+ *      AWU, and the SDI printf mailbox
+ *    - everything else is plain register storage
+ *
+ *  Timing is approximate: one cycle per instruction, one more for loads,
+ *  taken branches and jumps (two with a flash wait state), a fixed cost
+ *  for interrupt entry and mret. Peripherals run on the same cycle count,
+ *  wfi skips ahead to the next timed event. Cycles are attributed to the
+ *  function containing the PC (self) and, through a shadow call stack, to
+ *  its callers (total).
+ *
+ *  WCH "XW" compressed byte/halfword instructions are not decoded, build
+ *  the firmware for simulation with the RVXW option turned off.
+ *
+ *  Build:  cc -O2 -o rvsim rvsim.c
+ *  Usage:  rvsim [options] app.elf|app.bin
+ *            -i iap.elf    boot area image
+ *            -B            start from the boot area (as after GoToIAP)
+ *            -f file       SPI flash contents, main array then the three
+ *                          256 byte security registers (missing = erased)
+ *            -w            write the SPI flash back to -f on exit
+ *            -s bytes      SPI flash size (default 4194304)
+ *            -u file       bytes received on USART1
+ *            -c cycles     stop after this many cycles (default 500000000)
+ *            -x symbol     stop when execution reaches symbol
+ *            -r n          stop at the n-th reset
+ *            -n count      functions listed per image (default 25)
+ *            -g            log GPIO output changes
+ *            -q            do not echo USART1/SDI output
+ *  Output goes to stdout, the report to stderr. Exit status is 2 when the
+ *  core faulted or slept with no way to wake up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Memory map */
+#define FLASH_BASE        0x08000000u
+#define FLASH_SIZE        0x4000u
+#define BOOT_BASE         0x1FFFF000u
+#define BOOT_SIZE         0x840u           /* boot code, ESIG, option bytes */
+#define RAM_BASE          0x20000000u
+#define RAM_SIZE          0x800u
+#define PERIPH_BASE       0x40000000u
+#define PERIPH_SIZE       0x24000u
+#define PFIC_BASE         0xE000E000u
+#define SYSTICK_BASE      0xE000F000u
+#define SDI_DATA0         0xE00000F4u
+#define SDI_DATA1         0xE00000F8u
+
+#define FLASH_ERASED      0xE339E339u      /* what the V003 reads after erase */
+
+/* Peripheral bases */
+#define PWR_BASE          0x40007000u
+#define GPIOA_BASE        0x40010800u
+#define GPIOC_BASE        0x40011000u
+#define GPIOD_BASE        0x40011400u
+#define ADC1_BASE         0x40012400u
+#define SPI1_BASE         0x40013000u
+#define USART1_BASE       0x40013800u
+#define DMA1_BASE         0x40020000u
+#define RCC_BASE          0x40021000u
+#define FLASHC_BASE       0x40022000u
+
+#define FLASH_KEY1        0x45670123u
+#define FLASH_KEY2        0xCDEF89ABu
+
+/* Approximate costs */
+#define CYC_LOAD          1
+#define CYC_JUMP          1
+#define CYC_IRQ_ENTRY     6
+#define CYC_MRET          3
+
+/* Internal flash operation times in us, rough typical values */
+#define FLASH_T_HALF_US   50
+#define FLASH_T_PAGE_US   1000
+#define FLASH_T_ERASE_US  3000
+#define FLASH_T_MASS_US   10000
+
+/* SPI flash operation times in us (W25Q typical) */
+#define SPIF_T_PP_US      700
+#define SPIF_T_SE_US      45000
+#define SPIF_T_BE32_US    120000
+#define SPIF_T_BE64_US    150000
+#define SPIF_T_CE_US      10000000
+
+#define SHADOW_DEPTH      64
+#define HPE_DEPTH         3
+
+enum { IMG_APP = 0, IMG_IAP = 1 };
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    const char *name;
+    uint64_t self;
+    uint64_t total;
+    uint32_t calls;
+} func_t;
+
+typedef struct {
+    const char *path;
+    func_t *f;
+    int n;
+    uint64_t unknown;
+} image_t;
+
+typedef struct {
+    uint8_t op, rd, rs1, rs2;
+    int32_t imm;
+    uint8_t len;
+} insn_t;
+
+enum {
+    OP_ILLEGAL, OP_XW,
+    OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+    OP_SB, OP_SH, OP_SW,
+    OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+    OP_FENCE, OP_ECALL, OP_EBREAK, OP_MRET, OP_WFI,
+    OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+};
+
+/* CSRs */
+#define CSR_MSTATUS       0x300
+#define CSR_MTVEC         0x305
+#define CSR_MEPC          0x341
+#define CSR_MCAUSE        0x342
+#define CSR_MTVAL         0x343
+#define CSR_INTSYSCR      0x804
+
+#define MSTATUS_MIE       0x08
+#define MSTATUS_MPIE      0x80
+
+/* Options */
+static const char *spif_path = NULL;
+static int spif_writeback = 0;
+static uint32_t spif_size = 4u << 20;
+static uint64_t max_cycles = 500000000ull;
+static const char *stop_symbol = NULL;
+static uint32_t stop_resets = 0;
+static int report_lines = 25;
+static int log_gpio = 0;
+static int quiet = 0;
+
+/* Memories */
+static uint8_t user_flash[FLASH_SIZE];
+static uint8_t boot_flash[BOOT_SIZE];
+static uint8_t ram[RAM_SIZE];
+static uint32_t periph[PERIPH_SIZE / 4];
+
+/* Core */
+static uint32_t x[16];
+static uint32_t pc;
+static uint32_t csr[4096];
+static uint32_t hpe_stack[HPE_DEPTH][10];
+static int hpe_depth;
+static int boot_mode;
+static uint64_t cycles;
+static uint64_t instret;
+static double time_ns;
+static double ns_per_cycle;
+static int halted;
+static int exit_code;
+static int reset_request;
+static uint32_t resets;
+
+/* Profiling */
+static image_t img[2];
+static struct { func_t *f; uint64_t start; int irq; } shadow[SHADOW_DEPTH];
+static int shadow_depth;
+static uint64_t sleep_cycles;
+static double standby_ns;
+static uint32_t standby_count;
+static uint32_t irq_count;
+
+/* PFIC */
+static uint32_t pfic_ien[2];
+static uint32_t pfic_swpend[2];
+static uint32_t pfic_active[2];
+static uint8_t pfic_prio[64];
+static uint32_t pfic_sctlr;
+static uint32_t pfic_ithres;
+static int event_flag;
+
+/* SysTick */
+static uint32_t stk_ctlr, stk_sr, stk_cnt, stk_cmp, stk_div8;
+
+/* RCC */
+static uint32_t rcc_ctlr, rcc_cfgr0, rcc_rstsckr;
+
+/* Flash controller */
+static uint32_t fc_ctlr, fc_statr, fc_addr, fc_actlr;
+static int fc_key, fc_modekey, fc_bootkey, fc_boot_unlocked;
+static uint32_t fc_buf[16];
+static uint64_t fc_busy_until;
+static uint32_t fc_erases, fc_programs;
+
+/* GPIO */
+static uint32_t gpio_cfg[3], gpio_out[3];
+
+/* USART1 */
+static uint32_t us_ctlr1, us_brr;
+static uint64_t us_shift_end;         /* TX shift register empty from here */
+static int us_hold;                   /* TX holding register full */
+static FILE *us_rx_file;
+static int us_rx_byte = -1;           /* next input byte not yet received */
+static uint64_t us_rx_at;
+static uint8_t us_rx_data;
+static int us_rxne;
+
+/* DMA1 */
+static uint32_t dma_intfr;
+static struct { uint32_t cfgr, cntr, paddr, maddr; uint64_t done_at; int active; } dma_ch[7];
+
+/* SPI1 */
+static uint32_t spi_ctlr1;
+static uint64_t spi_busy_until;
+static uint8_t spi_rx;
+static int spi_rxne;
+
+/* SPI flash */
+static uint8_t *spif_mem;
+static uint8_t spif_sec[3][256];
+static int spif_cs;                   /* 1 = selected */
+static uint8_t spif_cmd;
+static uint32_t spif_idx, spif_addr;
+static uint8_t spif_page[256];
+static uint32_t spif_page_addr;
+static uint16_t spif_page_len;
+static int spif_wel, spif_dpd;
+static uint64_t spif_busy_until;
+static uint32_t spif_reads, spif_programs, spif_erases, spif_dpd_count;
+
+/* SDI mailbox */
+static uint32_t sdi_data1;
+
+static void sim_reset(int power_on);
+static uint32_t bus_read(uint32_t a, int size, int *fault);
+static void bus_write(uint32_t a, uint32_t v, int size, int *fault);
+
+/************************************************************************/
+/*                              LOADING                                 */
+/************************************************************************/
+
+static uint32_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t rd32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static int func_cmp(const void *a, const void *b)
+{
+    const func_t *fa = a, *fb = b;
+    return (fa->addr > fb->addr) - (fa->addr < fb->addr);
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *buf;
+    long n;
+
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(n ? n : 1);
+    if (buf && fread(buf, 1, n, f) != (size_t)n)
+    {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *size = n;
+    return buf;
+}
+
+/* Copies a loadable range into the flash it belongs to */
+static void place(int which, uint32_t pa, const uint8_t *src, uint32_t len)
+{
+    uint8_t *dst;
+    uint32_t limit, off;
+
+    if (which == IMG_APP)
+    {
+        dst = user_flash;
+        limit = FLASH_SIZE;
+        off = (pa >= FLASH_BASE) ? pa - FLASH_BASE : pa;
+    }
+    else
+    {
+        dst = boot_flash;
+        limit = BOOT_SIZE;
+        off = (pa >= BOOT_BASE) ? pa - BOOT_BASE : pa;
+    }
+    if (off >= limit || len > limit - off)
+    {
+        fprintf(stderr, "%s: segment at 0x%08X does not fit\n", img[which].path, (unsigned)pa);
+        exit(1);
+    }
+    memcpy(dst + off, src, len);
+}
+
+static void load_image(const char *path, int which)
+{
+    uint8_t *e, *ph, *sh, *sym, *str;
+    size_t size;
+    uint32_t i, n, phoff, shoff, symoff, symsize, stroff;
+    uint16_t phnum, phentsize, shnum, shentsize;
+    func_t *f;
+
+    img[which].path = path;
+    e = read_file(path, &size);
+    if (!e)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    /* Raw binary, no symbols */
+    if (size < 52 || memcmp(e, "\x7F" "ELF", 4))
+    {
+        place(which, 0, e, (uint32_t)size);
+        return;
+    }
+    if (e[4] != 1 || e[5] != 1 || rd16(e + 18) != 243)
+    {
+        fprintf(stderr, "%s: not a 32-bit little endian RISC-V ELF\n", path);
+        exit(1);
+    }
+
+    phoff = rd32(e + 28);
+    shoff = rd32(e + 32);
+    phentsize = rd16(e + 42);
+    phnum = rd16(e + 44);
+    shentsize = rd16(e + 46);
+    shnum = rd16(e + 48);
+
+    for (i = 0; i < phnum; i++)
+    {
+        ph = e + phoff + i * phentsize;
+        if (rd32(ph) != 1 || rd32(ph + 16) == 0) continue;       /* PT_LOAD with data */
+        if (rd32(ph + 12) >= RAM_BASE) continue;                 /* copied by the startup code */
+        place(which, rd32(ph + 12), e + rd32(ph + 4), rd32(ph + 16));
+    }
+
+    /* Function symbols for the profile */
+    for (i = 0; i < shnum; i++)
+    {
+        sh = e + shoff + i * shentsize;
+        if (rd32(sh + 4) != 2) continue;                         /* SHT_SYMTAB */
+
+        symoff = rd32(sh + 16);
+        symsize = rd32(sh + 20);
+        stroff = rd32(e + shoff + rd32(sh + 24) * shentsize + 16);
+        str = e + stroff;
+
+        img[which].f = calloc(symsize / 16 + 1, sizeof(func_t));
+        for (n = 0; n < symsize / 16; n++)
+        {
+            sym = e + symoff + n * 16;
+            if ((sym[12] & 0xF) != 2) continue;                  /* STT_FUNC */
+            f = &img[which].f[img[which].n++];
+            f->addr = rd32(sym + 4) & ~1u;
+            f->size = rd32(sym + 8);
+            f->name = (const char *)str + rd32(sym);
+        }
+        qsort(img[which].f, img[which].n, sizeof(func_t), func_cmp);
+        break;
+    }
+}
+
+static void load_spif(void)
+{
+    uint8_t *buf;
+    size_t size = 0, n;
+
+    spif_mem = malloc(spif_size);
+    memset(spif_mem, 0xFF, spif_size);
+    memset(spif_sec, 0xFF, sizeof(spif_sec));
+    if (!spif_path) return;
+
+    buf = read_file(spif_path, &size);
+    if (!buf) return;                                            /* created on write back */
+    n = size < spif_size ? size : spif_size;
+    memcpy(spif_mem, buf, n);
+    if (size > spif_size)
+    {
+        n = size - spif_size;
+        memcpy(spif_sec, buf + spif_size, n < sizeof(spif_sec) ? n : sizeof(spif_sec));
+    }
+    free(buf);
+}
+
+static void save_spif(void)
+{
+    FILE *f;
+
+    if (!spif_path || !spif_writeback) return;
+    f = fopen(spif_path, "wb");
+    if (!f)
+    {
+        perror(spif_path);
+        return;
+    }
+    fwrite(spif_mem, 1, spif_size, f);
+    fwrite(spif_sec, 1, sizeof(spif_sec), f);
+    fclose(f);
+}
+
+/************************************************************************/
+/*                              PROFILING                               */
+/************************************************************************/
+
+/* Image and link address for an execution address */
+static func_t *func_at(uint32_t a, image_t **im)
+{
+    static func_t *last;
+    static image_t *last_im;
+    image_t *p;
+    int which, lo, hi, mid;
+
+    if (a >= BOOT_BASE && a < BOOT_BASE + BOOT_SIZE)
+    {
+        which = IMG_IAP;
+        a -= BOOT_BASE;
+    }
+    else if (a >= FLASH_BASE && a < FLASH_BASE + FLASH_SIZE)
+    {
+        which = IMG_APP;
+        a -= FLASH_BASE;
+    }
+    else
+    {
+        which = boot_mode ? IMG_IAP : IMG_APP;
+    }
+    p = &img[which];
+    *im = p;
+
+    if (last && last_im == p && a >= last->addr && a < last->addr + last->size) return last;
+
+    lo = 0;
+    hi = p->n - 1;
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if (p->f[mid].addr <= a) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    if (hi < 0) return NULL;
+    if (a >= p->f[hi].addr + (p->f[hi].size ? p->f[hi].size : 2)) return NULL;
+
+    last = &p->f[hi];
+    last_im = p;
+    return last;
+}
+
+static void prof_self(uint32_t a, uint32_t n)
+{
+    image_t *im;
+    func_t *f = func_at(a, &im);
+
+    if (f) f->self += n;
+    else im->unknown += n;
+}
+
+static void prof_call(uint32_t target, int irq)
+{
+    image_t *im;
+    func_t *f = func_at(target, &im);
+
+    if (f) f->calls++;
+    if (shadow_depth < SHADOW_DEPTH)
+    {
+        shadow[shadow_depth].f = f;
+        shadow[shadow_depth].start = cycles;
+        shadow[shadow_depth].irq = irq;
+    }
+    shadow_depth++;
+}
+
+/* Returns from a call, or from an interrupt unwinding to its entry */
+static void prof_ret(int irq)
+{
+    int i;
+
+    while (shadow_depth > 0)
+    {
+        i = --shadow_depth;
+        if (i >= SHADOW_DEPTH) continue;
+        if (shadow[i].f) shadow[i].f->total += cycles - shadow[i].start;
+        if (!irq || shadow[i].irq) break;
+    }
+}
+
+static int func_by_self(const void *a, const void *b)
+{
+    const func_t *fa = *(const func_t * const *)a, *fb = *(const func_t * const *)b;
+    return (fa->self < fb->self) - (fa->self > fb->self);
+}
+
+static void report_image(image_t *p, const char *title)
+{
+    func_t **order;
+    uint64_t sum = p->unknown;
+    int i, k = 0;
+
+    if (!p->path) return;
+    for (i = 0; i < p->n; i++) sum += p->f[i].self;
+    if (!sum) return;
+
+    order = malloc((p->n + 1) * sizeof(*order));
+    for (i = 0; i < p->n; i++) if (p->f[i].self) order[k++] = &p->f[i];
+    qsort(order, k, sizeof(*order), func_by_self);
+
+    fprintf(stderr, "\n%s (%s): %llu cycles\n", title, p->path, (unsigned long long)sum);
+    fprintf(stderr, "%12s %6s %8s %12s  %s\n", "self", "%", "calls", "total", "function");
+    for (i = 0; i < k && i < report_lines; i++)
+    {
+        fprintf(stderr, "%12llu %6.2f %8u %12llu  %s\n", (unsigned long long)order[i]->self,
+                100.0 * order[i]->self / sum, order[i]->calls, (unsigned long long)order[i]->total, order[i]->name);
+    }
+    if (p->unknown) fprintf(stderr, "%12llu %6.2f %8s %12s  (no symbol)\n", (unsigned long long)p->unknown,
+                            100.0 * p->unknown / sum, "", "");
+    free(order);
+}
+
+static void report(void)
+{
+    fprintf(stderr, "\n%llu cycles, %llu instructions, %.3f ms simulated, %u reset(s), now in %s\n",
+            (unsigned long long)cycles, (unsigned long long)instret, time_ns / 1e6, resets,
+            boot_mode ? "boot area" : "user flash");
+    fprintf(stderr, "sleep %llu cycles, standby %u times %.3f ms, %u interrupts\n",
+            (unsigned long long)sleep_cycles, standby_count, standby_ns / 1e6, irq_count);
+    fprintf(stderr, "internal flash: %u erases, %u programs\n", fc_erases, fc_programs);
+    fprintf(stderr, "SPI flash: %u reads, %u programs, %u erases, %u power-downs\n",
+            spif_reads, spif_programs, spif_erases, spif_dpd_count);
+    report_image(&img[IMG_APP], "APP");
+    report_image(&img[IMG_IAP], "IAP");
+}
+
+/************************************************************************/
+/*                                CLOCKS                                */
+/************************************************************************/
+
+static uint32_t hclk(void)
+{
+    uint32_t sys = ((rcc_cfgr0 & 3) == 2) ? 48000000u : 24000000u;   /* PLL = 2 x (HSI or 24MHz HSE) */
+    uint32_t h = (rcc_cfgr0 >> 4) & 15;
+
+    return (h < 8) ? sys / (h + 1) : sys >> (h - 7);
+}
+
+static void clock_changed(void)
+{
+    ns_per_cycle = 1e9 / hclk();
+}
+
+static uint64_t us_to_cycles(uint32_t us)
+{
+    return (uint64_t)us * hclk() / 1000000u;
+}
+
+/************************************************************************/
+/*                               SYSTICK                                */
+/************************************************************************/
+
+static void systick_advance(uint64_t n)
+{
+    uint32_t old;
+
+    if (!(stk_ctlr & 1)) return;
+    if (!(stk_ctlr & 4))
+    {
+        stk_div8 += (uint32_t)(n & 7);
+        n = (n >> 3) + (stk_div8 >> 3);
+        stk_div8 &= 7;
+    }
+    if (!n) return;
+
+    old = stk_cnt;
+    if (stk_ctlr & 0x10)
+    {
+        /* Counting down: flag when zero is reached */
+        if (n >= old)
+        {
+            stk_sr |= 1;
+            stk_cnt = (stk_ctlr & 8) ? stk_cmp - (uint32_t)((n - old) % ((uint64_t)stk_cmp + 1)) : old - (uint32_t)n;
+        }
+        else stk_cnt = old - (uint32_t)n;
+        return;
+    }
+
+    stk_cnt = old + (uint32_t)n;
+    if (n >= 0x100000000ull || (uint32_t)(stk_cmp - old - 1) < n)
+    {
+        stk_sr |= 1;
+        if (stk_ctlr & 8) stk_cnt = (uint32_t)((old + n - stk_cmp - 1) % ((uint64_t)stk_cmp + 1));
+    }
+}
+
+/* HCLK cycles until the next compare match, 0 when none can happen */
+static uint64_t systick_next(void)
+{
+    uint64_t d;
+
+    if (!(stk_ctlr & 1) || (stk_ctlr & 0x10)) return 0;
+    d = (uint32_t)(stk_cmp - stk_cnt);
+    if (!d) d = 0x100000000ull;
+    return (stk_ctlr & 4) ? d : d * 8 - stk_div8;
+}
+
+static void tick(uint64_t n)
+{
+    cycles += n;
+    time_ns += n * ns_per_cycle;
+    systick_advance(n);
+}
+
+/************************************************************************/
+/*                              SPI FLASH                               */
+/************************************************************************/
+
+static uint8_t spif_status(void)
+{
+    return (cycles < spif_busy_until ? 1 : 0) | (spif_wel ? 2 : 0);
+}
+
+static void spif_busy(uint32_t us)
+{
+    spif_busy_until = cycles + us_to_cycles(us);
+    spif_wel = 0;
+}
+
+static uint8_t *spif_sec_ptr(uint32_t a)
+{
+    uint32_t r = (a >> 12) & 3;
+
+    return (r >= 1) ? &spif_sec[r - 1][a & 0xFF] : NULL;
+}
+
+/* One byte clocked while selected */
+static uint8_t spif_xfer(uint8_t in)
+{
+    uint32_t i = spif_idx++;
+    uint8_t *p;
+
+    if (i == 0)
+    {
+        spif_cmd = in;
+        spif_addr = 0;
+        spif_page_len = 0;
+        return 0xFF;
+    }
+    if (spif_dpd && spif_cmd != 0xAB) return 0xFF;
+    if (cycles < spif_busy_until && spif_cmd != 0x05) return 0xFF;
+
+    if (i <= 3) spif_addr = (spif_addr << 8) | in;
+
+    switch (spif_cmd)
+    {
+    case 0x05:
+        return spif_status();
+    case 0x35:
+    case 0x15:
+        return 0;
+    case 0x9F:
+        return (i == 1) ? 0xEF : (i == 2) ? 0x40 : 0x16;
+    case 0xAB:
+        return (i >= 4) ? 0x15 : 0xFF;
+    case 0x03:
+    case 0x0B:
+        if (i < 4 || (spif_cmd == 0x0B && i == 4)) return 0xFF;
+        if (i == 4 || (spif_cmd == 0x0B && i == 5)) spif_reads++;
+        return spif_mem[spif_addr++ % spif_size];
+    case 0x48:
+        if (i < 5) return 0xFF;
+        if (i == 5) spif_reads++;
+        p = spif_sec_ptr(spif_addr);
+        spif_addr = (spif_addr & ~0xFFu) | ((spif_addr + 1) & 0xFF);
+        return p ? *p : 0xFF;
+    case 0x02:
+    case 0x42:
+        if (i == 3) spif_page_addr = spif_addr;
+        if (i >= 4)
+        {
+            spif_page[(spif_page_addr + spif_page_len) & 0xFF] = in;
+            if (spif_page_len < 256) spif_page_len++;
+        }
+        return 0xFF;
+    default:
+        return 0xFF;
+    }
+}
+
+/* Chip select released: commands take effect */
+static void spif_deselect(void)
+{
+    uint32_t a = spif_addr, i, base, len;
+    uint8_t *p;
+
+    if (spif_idx == 0) return;
+    spif_idx = 0;
+
+    if (spif_dpd)
+    {
+        if (spif_cmd == 0xAB) spif_dpd = 0;
+        return;
+    }
+    if (cycles < spif_busy_until) return;
+
+    switch (spif_cmd)
+    {
+    case 0x06:
+        spif_wel = 1;
+        break;
+    case 0x04:
+        spif_wel = 0;
+        break;
+    case 0xB9:
+        spif_dpd = 1;
+        spif_dpd_count++;
+        break;
+    case 0x02:
+        if (!spif_wel) break;
+        base = spif_page_addr & ~0xFFu;
+        for (i = 0; i < spif_page_len; i++)
+        {
+            spif_mem[(base + ((spif_page_addr + i) & 0xFF)) % spif_size] &= spif_page[(spif_page_addr + i) & 0xFF];
+        }
+        spif_programs++;
+        spif_busy(SPIF_T_PP_US);
+        break;
+    case 0x42:
+        if (!spif_wel) break;
+        for (i = 0; i < spif_page_len; i++)
+        {
+            p = spif_sec_ptr((spif_page_addr & ~0xFFu) | ((spif_page_addr + i) & 0xFF));
+            if (p) *p &= spif_page[(spif_page_addr + i) & 0xFF];
+        }
+        spif_programs++;
+        spif_busy(SPIF_T_PP_US);
+        break;
+    case 0x20:
+    case 0x52:
+    case 0xD8:
+        if (!spif_wel) break;
+        len = (spif_cmd == 0x20) ? 0x1000 : (spif_cmd == 0x52) ? 0x8000 : 0x10000;
+        memset(spif_mem + ((a % spif_size) & ~(len - 1)), 0xFF, len);
+        spif_erases++;
+        spif_busy(spif_cmd == 0x20 ? SPIF_T_SE_US : spif_cmd == 0x52 ? SPIF_T_BE32_US : SPIF_T_BE64_US);
+        break;
+    case 0x44:
+        if (!spif_wel) break;
+        p = spif_sec_ptr(a & ~0xFFu);
+        if (p) memset(p, 0xFF, 256);
+        spif_erases++;
+        spif_busy(SPIF_T_SE_US);
+        break;
+    case 0xC7:
+    case 0x60:
+        if (!spif_wel) break;
+        memset(spif_mem, 0xFF, spif_size);
+        spif_erases++;
+        spif_busy(SPIF_T_CE_US);
+        break;
+    }
+}
+
+/************************************************************************/
+/*                                 GPIO                                 */
+/************************************************************************/
+
+static void gpio_update(int port, uint32_t out)
+{
+    static const char names[3] = { 'A', 'C', 'D' };
+    int cs;
+
+    if (log_gpio && out != gpio_out[port])
+    {
+        fprintf(stderr, "[%10.3f ms] GPIO%c %02X -> %02X\n", time_ns / 1e6, names[port],
+                (unsigned)gpio_out[port], (unsigned)out);
+    }
+    gpio_out[port] = out & 0xFF;
+
+    /* PD0 is the flash chip select while it is an output */
+    cs = (gpio_cfg[2] & 3) && !(gpio_out[2] & 1);
+    if (spif_cs && !cs) spif_deselect();
+    if (!spif_cs && cs) spif_idx = 0;
+    spif_cs = cs;
+}
+
+/************************************************************************/
+/*                                USART1                                */
+/************************************************************************/
+
+static uint64_t usart_frame(void)
+{
+    return us_brr ? 10ull * us_brr : 1;
+}
+
+static void usart_out(uint8_t c)
+{
+    if (!quiet) putchar(c);
+}
+
+/* Moves the holding register to the shift register and delivers input */
+static void usart_update(void)
+{
+    if (us_hold && cycles >= us_shift_end)
+    {
+        us_shift_end += usart_frame();
+        us_hold = 0;
+    }
+    if (!us_rxne && us_rx_byte >= 0 && cycles >= us_rx_at && (us_ctlr1 & 0x2004) == 0x2004)
+    {
+        us_rx_data = (uint8_t)us_rx_byte;
+        us_rxne = 1;
+        us_rx_byte = fgetc(us_rx_file);
+        us_rx_at = cycles + usart_frame();
+    }
+}
+
+static uint32_t usart_statr(void)
+{
+    uint32_t s = 0;
+
+    if (!us_hold) s |= 0x80;
+    if (!us_hold && cycles >= us_shift_end) s |= 0x40;
+    if (us_rxne) s |= 0x20;
+    return s;
+}
+
+static void usart_tx(uint8_t c)
+{
+    usart_out(c);
+    if (cycles >= us_shift_end) us_shift_end = cycles + usart_frame();
+    else us_hold = 1;
+}
+
+/************************************************************************/
+/*                                 DMA1                                 */
+/************************************************************************/
+
+static void dma_update(void)
+{
+    int ch;
+
+    for (ch = 0; ch < 7; ch++)
+    {
+        if (!dma_ch[ch].active || cycles < dma_ch[ch].done_at) continue;
+        dma_ch[ch].active = 0;
+        dma_ch[ch].cntr = 0;
+        dma_intfr |= 0xFu << (ch * 4) & ~(0x8u << (ch * 4));      /* GIF, TCIF, HTIF */
+    }
+}
+
+static void dma_start(int ch)
+{
+    uint32_t cfgr = dma_ch[ch].cfgr, n = dma_ch[ch].cntr & 0xFFFF, i, m = dma_ch[ch].maddr;
+    uint32_t step = 1u << ((cfgr >> 10) & 3);
+    int fault = 0;
+
+    if (!n) return;
+    dma_ch[ch].active = 1;
+
+    if (cfgr & 0x4000)
+    {
+        /* Memory to memory, done at once */
+        for (i = 0; i < n; i++)
+        {
+            bus_write(dma_ch[ch].paddr + ((cfgr & 0x40) ? i * step : 0),
+                      bus_read(m + ((cfgr & 0x80) ? i * step : 0), step, &fault), step, &fault);
+        }
+        dma_ch[ch].done_at = cycles;
+    }
+    else if ((cfgr & 0x10) && dma_ch[ch].paddr == USART1_BASE + 4)
+    {
+        /* USART1 TX: bytes leave back to back at the baud rate */
+        for (i = 0; i < n; i++) usart_out((uint8_t)bus_read(m + ((cfgr & 0x80) ? i * step : 0), 1, &fault));
+        if (us_shift_end < cycles) us_shift_end = cycles;
+        us_shift_end += n * usart_frame();
+        dma_ch[ch].done_at = us_shift_end;
+    }
+    else
+    {
+        /* Peripheral not modelled: never completes */
+        dma_ch[ch].done_at = UINT64_MAX;
+    }
+}
+
+/************************************************************************/
+/*                           FLASH CONTROLLER                           */
+/************************************************************************/
+
+static uint8_t *fc_target(uint32_t a)
+{
+    if (a >= FLASH_BASE) a -= FLASH_BASE;
+    return (a < FLASH_SIZE) ? &user_flash[a] : NULL;
+}
+
+static void fc_fill(uint8_t *p, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i += 4) memcpy(p + i, &(uint32_t){ FLASH_ERASED }, 4);
+}
+
+static void fc_start(void)
+{
+    uint8_t *p = fc_target(fc_addr);
+
+    if (fc_ctlr & 0x04)
+    {
+        fc_fill(user_flash, FLASH_SIZE);
+        fc_erases++;
+        fc_busy_until = cycles + us_to_cycles(FLASH_T_MASS_US);
+    }
+    else if (!p)
+    {
+        fprintf(stderr, "flash: operation at 0x%08X outside user flash\n", (unsigned)fc_addr);
+        fc_statr |= 0x10;
+        return;
+    }
+    else if ((fc_ctlr & 0x20000) && !(fc_ctlr & 0x8000))
+    {
+        fc_fill(fc_target(fc_addr & ~63u), 64);
+        fc_erases++;
+        fc_busy_until = cycles + us_to_cycles(FLASH_T_ERASE_US);
+    }
+    else if ((fc_ctlr & 0x10000) && !(fc_ctlr & 0x8000))
+    {
+        memcpy(fc_target(fc_addr & ~63u), fc_buf, 64);
+        fc_programs++;
+        fc_busy_until = cycles + us_to_cycles(FLASH_T_PAGE_US);
+    }
+    else if (fc_ctlr & 0x02)
+    {
+        fc_fill(fc_target(fc_addr & ~1023u), 1024);
+        fc_erases++;
+        fc_busy_until = cycles + us_to_cycles(FLASH_T_ERASE_US);
+    }
+    fc_statr |= 0x20;
+}
+
+/* Store to a flash address: page buffer load or halfword program */
+static int fc_store(uint32_t a, uint32_t v, int size)
+{
+    uint8_t *p = fc_target(a);
+
+    if (!p || (fc_ctlr & 0x80)) return 0;
+    if ((fc_ctlr & 0x10000) && size == 4)
+    {
+        fc_buf[(a & 63) / 4] = v;
+        return 1;
+    }
+    if ((fc_ctlr & 0x01) && size == 2)
+    {
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+        fc_programs++;
+        fc_busy_until = cycles + us_to_cycles(FLASH_T_HALF_US);
+        return 1;
+    }
+    return 0;
+}
+
+/************************************************************************/
+/*                              MMIO ACCESS                             */
+/************************************************************************/
+
+static uint32_t pfic_pending(int word);
+
+static uint32_t mmio_read(uint32_t a)
+{
+    uint32_t off, v;
+    int ch;
+
+    if (a == SDI_DATA0) return 0;
+    if (a == SDI_DATA1) return sdi_data1;
+
+    if (a >= PFIC_BASE && a < PFIC_BASE + 0x1000)
+    {
+        off = a - PFIC_BASE;
+        if (off < 0x08) return pfic_ien[off / 4];
+        if (off >= 0x20 && off < 0x28) return pfic_pending((off - 0x20) / 4);
+        if (off == 0x40) return pfic_ithres;
+        if (off >= 0x300 && off < 0x308) return pfic_active[(off - 0x300) / 4];
+        if (off >= 0x400 && off < 0x440) return rd32(&pfic_prio[off - 0x400]);
+        if (off == 0xD10) return pfic_sctlr;
+        return 0;
+    }
+    if (a >= SYSTICK_BASE && a < SYSTICK_BASE + 0x20)
+    {
+        switch (a - SYSTICK_BASE)
+        {
+        case 0x00: return stk_ctlr;
+        case 0x04: return stk_sr;
+        case 0x08: return stk_cnt;
+        case 0x10: return stk_cmp;
+        }
+        return 0;
+    }
+    if (a < PERIPH_BASE || a >= PERIPH_BASE + PERIPH_SIZE) return 0;
+
+    switch (a)
+    {
+    case RCC_BASE + 0x00:
+        return rcc_ctlr | ((rcc_ctlr & 1) << 1) | ((rcc_ctlr & 0x10000) << 1) | ((rcc_ctlr & 0x1000000) << 1);
+    case RCC_BASE + 0x04:
+        return (rcc_cfgr0 & ~0xCu) | ((rcc_cfgr0 & 3) << 2);
+    case RCC_BASE + 0x24:
+        return rcc_rstsckr | ((rcc_rstsckr & 1) << 1);
+    case FLASHC_BASE + 0x00:
+        return fc_actlr;
+    case FLASHC_BASE + 0x0C:
+        return fc_statr | (cycles < fc_busy_until ? 1 : 0) | (fc_boot_unlocked ? 0 : 0x8000);
+    case FLASHC_BASE + 0x10:
+        return fc_ctlr;
+    case FLASHC_BASE + 0x14:
+        return fc_addr;
+    case FLASHC_BASE + 0x1C:
+        return 0x3FFFFFFC;                                       /* no read protection */
+    case GPIOA_BASE + 0x08: case GPIOA_BASE + 0x0C: return gpio_out[0];
+    case GPIOC_BASE + 0x08: case GPIOC_BASE + 0x0C: return gpio_out[1];
+    case GPIOD_BASE + 0x08: case GPIOD_BASE + 0x0C: return gpio_out[2];
+    case GPIOA_BASE: return gpio_cfg[0];
+    case GPIOC_BASE: return gpio_cfg[1];
+    case GPIOD_BASE: return gpio_cfg[2];
+    case USART1_BASE + 0x00:
+        return usart_statr();
+    case USART1_BASE + 0x04:
+        v = us_rx_data;
+        us_rxne = 0;
+        if (us_rx_at < cycles) us_rx_at = cycles;
+        return v;
+    case USART1_BASE + 0x08:
+        return us_brr;
+    case USART1_BASE + 0x0C:
+        return us_ctlr1;
+    case SPI1_BASE + 0x00:
+        return spi_ctlr1;
+    case SPI1_BASE + 0x08:
+        return 0x02 | (cycles < spi_busy_until ? 0x80 : 0) | (spi_rxne && cycles >= spi_busy_until ? 0x01 : 0);
+    case SPI1_BASE + 0x0C:
+        spi_rxne = 0;
+        return spi_rx;
+    case DMA1_BASE + 0x00:
+        return dma_intfr;
+    }
+
+    if (a >= DMA1_BASE + 0x08 && a < DMA1_BASE + 0x08 + 7 * 20)
+    {
+        off = a - DMA1_BASE - 0x08;
+        ch = off / 20;
+        switch (off % 20)
+        {
+        case 0: return dma_ch[ch].cfgr;
+        case 4:
+            if (dma_ch[ch].active && dma_ch[ch].done_at != UINT64_MAX)
+                return (uint32_t)((dma_ch[ch].done_at - cycles + usart_frame() - 1) / usart_frame());
+            return dma_ch[ch].cntr;
+        case 8: return dma_ch[ch].paddr;
+        case 12: return dma_ch[ch].maddr;
+        }
+    }
+    return periph[(a - PERIPH_BASE) / 4];
+}
+
+static void mmio_write(uint32_t a, uint32_t v, uint32_t mask)
+{
+    uint32_t off, old;
+    int ch, port = -1;
+
+    if (a == SDI_DATA1)
+    {
+        sdi_data1 = v;
+        return;
+    }
+    if (a == SDI_DATA0)
+    {
+        /* Length in the low byte, then up to 7 bytes across both words */
+        uint32_t len = v & 0xFF, i;
+        for (i = 0; i < len && i < 7; i++)
+            usart_out((uint8_t)((i < 3 ? v >> ((i + 1) * 8) : sdi_data1 >> ((i - 3) * 8)) & 0xFF));
+        return;
+    }
+
+    if (a >= PFIC_BASE && a < PFIC_BASE + 0x1000)
+    {
+        off = a - PFIC_BASE;
+        v &= mask;
+        if (off == 0x40) pfic_ithres = v;
+        else if (off == 0x48)
+        {
+            if ((v & 0xFFFF0000u) == 0xBEEF0000u && (v & 0x80)) reset_request = 1;
+        }
+        else if (off >= 0x100 && off < 0x108) pfic_ien[(off - 0x100) / 4] |= v;
+        else if (off >= 0x180 && off < 0x188) pfic_ien[(off - 0x180) / 4] &= ~v;
+        else if (off >= 0x200 && off < 0x208) pfic_swpend[(off - 0x200) / 4] |= v;
+        else if (off >= 0x280 && off < 0x288) pfic_swpend[(off - 0x280) / 4] &= ~v;
+        else if (off >= 0x400 && off < 0x440)
+        {
+            for (ch = 0; ch < 4; ch++) if (mask & (0xFFu << (ch * 8))) pfic_prio[off - 0x400 + ch] = (uint8_t)(v >> (ch * 8));
+        }
+        else if (off == 0xD10)
+        {
+            pfic_sctlr = (pfic_sctlr & ~mask) | v;
+            if (pfic_sctlr & 0x20) event_flag = 1;
+            if (pfic_sctlr & 0x80000000u) reset_request = 1;
+        }
+        return;
+    }
+    if (a >= SYSTICK_BASE && a < SYSTICK_BASE + 0x20)
+    {
+        switch (a - SYSTICK_BASE)
+        {
+        case 0x00:
+            stk_ctlr = (stk_ctlr & ~mask) | (v & mask);
+            if (stk_ctlr & 0x20)
+            {
+                stk_cnt = (stk_ctlr & 0x10) ? stk_cmp : 0;
+                stk_ctlr &= ~0x20u;
+            }
+            break;
+        case 0x04: stk_sr = (stk_sr & ~mask) | (v & mask); break;
+        case 0x08: stk_cnt = (stk_cnt & ~mask) | (v & mask); break;
+        case 0x10: stk_cmp = (stk_cmp & ~mask) | (v & mask); break;
+        }
+        return;
+    }
+    if (a < PERIPH_BASE || a >= PERIPH_BASE + PERIPH_SIZE) return;
+
+    old = mmio_read(a);
+    v = (old & ~mask) | (v & mask);
+
+    switch (a)
+    {
+    case RCC_BASE + 0x00:
+        rcc_ctlr = v & ~0x02020002u;
+        return;
+    case RCC_BASE + 0x04:
+        rcc_cfgr0 = v;
+        clock_changed();
+        return;
+    case RCC_BASE + 0x24:
+        rcc_rstsckr = (v & 1) | (rcc_rstsckr & 0xFC000000u);
+        if (v & 0x01000000u) rcc_rstsckr &= ~0xFC000000u;       /* RMVF */
+        return;
+    case FLASHC_BASE + 0x00:
+        fc_actlr = v;
+        return;
+    case FLASHC_BASE + 0x04:
+        fc_key = (fc_key == 0 && v == FLASH_KEY1) ? 1 : 0;
+        if (old == 0 && v == FLASH_KEY2) fc_key = 0;
+        if (v == FLASH_KEY2 && fc_ctlr & 0x80) fc_ctlr &= ~0x80u;
+        return;
+    case FLASHC_BASE + 0x24:
+        if (v == FLASH_KEY1) fc_modekey = 1;
+        else if (v == FLASH_KEY2 && fc_modekey && !(fc_ctlr & 0x80)) fc_ctlr &= ~0x8000u;
+        else fc_modekey = 0;
+        return;
+    case FLASHC_BASE + 0x28:
+        if (v == FLASH_KEY1) fc_bootkey = 1;
+        else if (v == FLASH_KEY2 && fc_bootkey) fc_boot_unlocked = 1;
+        else fc_bootkey = 0;
+        return;
+    case FLASHC_BASE + 0x0C:
+        fc_statr &= ~(v & 0x30);                                 /* EOP, WRPRTERR: write 1 to clear */
+        if (fc_boot_unlocked) fc_statr = (fc_statr & ~0x4000u) | (v & 0x4000);
+        return;
+    case FLASHC_BASE + 0x10:
+        if (v & 0x80)
+        {
+            fc_ctlr |= 0x8080;
+            fc_boot_unlocked = 0;
+            return;
+        }
+        if (fc_ctlr & 0x80) return;
+        fc_ctlr = (v & ~0xC0040u) | (fc_ctlr & 0x8000 & v);
+        if (v & 0x80000) memset(fc_buf, 0xFF, sizeof(fc_buf));   /* BUF_RST */
+        if (v & 0x40) fc_start();
+        return;
+    case FLASHC_BASE + 0x14:
+        fc_addr = v;
+        return;
+    case GPIOA_BASE: gpio_cfg[0] = v; gpio_update(0, gpio_out[0]); return;
+    case GPIOC_BASE: gpio_cfg[1] = v; gpio_update(1, gpio_out[1]); return;
+    case GPIOD_BASE: gpio_cfg[2] = v; gpio_update(2, gpio_out[2]); return;
+    case USART1_BASE + 0x04:
+        usart_tx((uint8_t)v);
+        return;
+    case USART1_BASE + 0x08:
+        us_brr = v & 0xFFFF;
+        return;
+    case USART1_BASE + 0x0C:
+        us_ctlr1 = v;
+        return;
+    case SPI1_BASE + 0x00:
+        spi_ctlr1 = v;
+        return;
+    case SPI1_BASE + 0x0C:
+        if (!(spi_ctlr1 & 0x40)) return;
+        spi_rx = spif_cs ? spif_xfer((uint8_t)v) : 0xFF;
+        spi_rxne = 1;
+        spi_busy_until = cycles + (8u << (((spi_ctlr1 >> 3) & 7) + 1));
+        return;
+    case DMA1_BASE + 0x04:
+        dma_intfr &= ~v;
+        return;
+    case ADC1_BASE + 0x08:
+        v &= ~0x0Cu;                                             /* calibration done at once */
+        break;
+    }
+
+    if (a >= GPIOA_BASE && a < GPIOD_BASE + 0x20 && ((a & 0x3FF) == 0x0C || (a & 0x3FF) == 0x10 || (a & 0x3FF) == 0x14))
+    {
+        port = (a >= GPIOD_BASE) ? 2 : (a >= GPIOC_BASE) ? 1 : (a < GPIOA_BASE + 0x400) ? 0 : -1;
+        if (port < 0) return;
+        off = a & 0x3FF;
+        if (off == 0x0C) gpio_update(port, v);
+        else if (off == 0x10) gpio_update(port, (gpio_out[port] | (v & 0xFF)) & ~((v >> 16) & 0xFF));
+        else gpio_update(port, gpio_out[port] & ~(v & 0xFF));
+        return;
+    }
+    if (a >= DMA1_BASE + 0x08 && a < DMA1_BASE + 0x08 + 7 * 20)
+    {
+        off = a - DMA1_BASE - 0x08;
+        ch = off / 20;
+        switch (off % 20)
+        {
+        case 0:
+            old = dma_ch[ch].cfgr;
+            dma_ch[ch].cfgr = v;
+            if ((v & 1) && !(old & 1)) dma_start(ch);
+            if (!(v & 1)) dma_ch[ch].active = 0;
+            return;
+        case 4: dma_ch[ch].cntr = v & 0xFFFF; return;
+        case 8: dma_ch[ch].paddr = v; return;
+        case 12: dma_ch[ch].maddr = v; return;
+        }
+    }
+    periph[(a - PERIPH_BASE) / 4] = v;
+}
+
+/************************************************************************/
+/*                                 BUS                                  */
+/************************************************************************/
+
+/* Direct pointer for memories, NULL for registers */
+static uint8_t *mem_ptr(uint32_t a, int size)
+{
+    if (a < FLASH_SIZE) return boot_mode ? (a + size <= BOOT_SIZE ? &boot_flash[a] : NULL) : &user_flash[a];
+    if (a >= FLASH_BASE && a + size <= FLASH_BASE + FLASH_SIZE) return &user_flash[a - FLASH_BASE];
+    if (a >= BOOT_BASE && a + size <= BOOT_BASE + BOOT_SIZE) return &boot_flash[a - BOOT_BASE];
+    if (a >= RAM_BASE && a + size <= RAM_BASE + RAM_SIZE) return &ram[a - RAM_BASE];
+    return NULL;
+}
+
+static int is_mmio(uint32_t a)
+{
+    return (a >= PERIPH_BASE && a < PERIPH_BASE + PERIPH_SIZE) || (a >= 0xE0000000u);
+}
+
+static uint32_t bus_read(uint32_t a, int size, int *fault)
+{
+    uint8_t *p;
+    uint32_t v, sh;
+
+    if (a & (size - 1))
+    {
+        *fault = 4;
+        return 0;
+    }
+    p = mem_ptr(a, size);
+    if (p) return (size == 1) ? p[0] : (size == 2) ? rd16(p) : rd32(p);
+    if (!is_mmio(a))
+    {
+        *fault = 5;
+        return 0;
+    }
+
+    sh = (a & 3) * 8;
+    v = mmio_read(a & ~3u) >> sh;
+    return (size == 1) ? (v & 0xFF) : (size == 2) ? (v & 0xFFFF) : v;
+}
+
+static void bus_write(uint32_t a, uint32_t v, int size, int *fault)
+{
+    uint8_t *p;
+    uint32_t sh, mask;
+
+    if (a & (size - 1))
+    {
+        *fault = 6;
+        return;
+    }
+    if (a >= RAM_BASE && a + size <= RAM_BASE + RAM_SIZE)
+    {
+        p = &ram[a - RAM_BASE];
+        p[0] = (uint8_t)v;
+        if (size > 1) p[1] = (uint8_t)(v >> 8);
+        if (size > 2)
+        {
+            p[2] = (uint8_t)(v >> 16);
+            p[3] = (uint8_t)(v >> 24);
+        }
+        return;
+    }
+    if (mem_ptr(a, size))
+    {
+        if (!fc_store(a, v, size)) fprintf(stderr, "write to flash at 0x%08X ignored (pc 0x%08X)\n", (unsigned)a, (unsigned)pc);
+        return;
+    }
+    if (!is_mmio(a))
+    {
+        *fault = 7;
+        return;
+    }
+
+    sh = (a & 3) * 8;
+    mask = ((size == 4) ? 0xFFFFFFFFu : ((1u << (size * 8)) - 1)) << sh;
+    mmio_write(a & ~3u, v << sh, mask);
+}
+
+/************************************************************************/
+/*                              INTERRUPTS                              */
+/************************************************************************/
+
+static int irq_level(int n)
+{
+    int ch;
+
+    switch (n)
+    {
+    case 12:
+        return (stk_sr & 1) && (stk_ctlr & 2);
+    case 32:
+        return (usart_statr() & us_ctlr1 & 0xE0) != 0;
+    }
+    if (n >= 22 && n <= 28)
+    {
+        ch = n - 22;
+        return ((dma_intfr >> (ch * 4)) & dma_ch[ch].cfgr & 0xE) != 0;
+    }
+    return 0;
+}
+
+static const int irq_sources[] = { 12, 22, 23, 24, 25, 26, 27, 28, 32 };
+
+static uint32_t pfic_pending(int word)
+{
+    uint32_t p = pfic_swpend[word];
+    unsigned i;
+
+    for (i = 0; i < sizeof(irq_sources) / sizeof(irq_sources[0]); i++)
+    {
+        if (irq_sources[i] / 32 == word && irq_level(irq_sources[i])) p |= 1u << (irq_sources[i] % 32);
+    }
+    return p;
+}
+
+/* Highest priority enabled pending interrupt, -1 if none */
+static int irq_select(void)
+{
+    uint32_t p[2];
+    int n, best = -1;
+
+    p[0] = pfic_pending(0) & pfic_ien[0];
+    p[1] = pfic_pending(1) & pfic_ien[1];
+    if (!p[0] && !p[1]) return -1;
+
+    for (n = 0; n < 64; n++)
+    {
+        if (!(p[n / 32] & (1u << (n % 32)))) continue;
+        if (best < 0 || pfic_prio[n] < pfic_prio[best]) best = n;
+    }
+    return best;
+}
+
+static void irq_enter(int n)
+{
+    static const uint8_t saved[10] = { 1, 5, 6, 7, 10, 11, 12, 13, 14, 15 };
+    int fault = 0, i;
+
+    if (csr[CSR_INTSYSCR] & 1)
+    {
+        if (hpe_depth < HPE_DEPTH)
+            for (i = 0; i < 10; i++) hpe_stack[hpe_depth][i] = x[saved[i]];
+        hpe_depth++;
+    }
+
+    pfic_swpend[n / 32] &= ~(1u << (n % 32));
+    pfic_active[n / 32] |= 1u << (n % 32);
+    csr[CSR_MEPC] = pc;
+    csr[CSR_MCAUSE] = (n < 16 && n != 12 && n != 14) ? (uint32_t)n : 0x80000000u | n;
+    csr[CSR_MSTATUS] = (csr[CSR_MSTATUS] & ~(MSTATUS_MIE | MSTATUS_MPIE)) |
+                       ((csr[CSR_MSTATUS] & MSTATUS_MIE) ? MSTATUS_MPIE : 0);
+
+    if ((csr[CSR_MTVEC] & 3) == 3) pc = bus_read((csr[CSR_MTVEC] & ~3u) + 4 * n, 4, &fault);
+    else pc = (csr[CSR_MTVEC] & ~3u) + 4 * n;
+
+    irq_count++;
+    tick(CYC_IRQ_ENTRY);
+    prof_call(pc, 1);
+}
+
+static void irq_return(void)
+{
+    static const uint8_t saved[10] = { 1, 5, 6, 7, 10, 11, 12, 13, 14, 15 };
+    uint32_t mcause = csr[CSR_MCAUSE];
+    int i, n;
+
+    if (mcause & 0x80000000u)
+    {
+        n = mcause & 63;
+        pfic_active[n / 32] &= ~(1u << (n % 32));
+    }
+    pc = csr[CSR_MEPC];
+    csr[CSR_MSTATUS] = (csr[CSR_MSTATUS] & ~MSTATUS_MIE) | ((csr[CSR_MSTATUS] & MSTATUS_MPIE) ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+
+    if ((csr[CSR_INTSYSCR] & 1) && hpe_depth > 0)
+    {
+        hpe_depth--;
+        if (hpe_depth < HPE_DEPTH)
+            for (i = 0; i < 10; i++) x[saved[i]] = hpe_stack[hpe_depth][i];
+    }
+    tick(CYC_MRET);
+    prof_ret(1);
+}
+
+/************************************************************************/
+/*                              SLEEP MODES                             */
+/************************************************************************/
+
+/* Any interrupt source asserted, enabled in the PFIC or not */
+static int any_level(void)
+{
+    unsigned i;
+
+    for (i = 0; i < sizeof(irq_sources) / sizeof(irq_sources[0]); i++)
+        if (irq_level(irq_sources[i])) return 1;
+    return (pfic_swpend[0] | pfic_swpend[1]) != 0;
+}
+
+/* Cycle of the next timed peripheral event, UINT64_MAX if none */
+static uint64_t next_event(void)
+{
+    uint64_t t = UINT64_MAX, d;
+    int ch;
+
+    d = systick_next();
+    if (d && (stk_ctlr & 2)) t = cycles + d;
+    if ((us_ctlr1 & 0xC0) && (us_hold || us_shift_end > cycles) && us_shift_end < t) t = us_shift_end + (us_hold ? usart_frame() : 0);
+    if ((us_ctlr1 & 0x20) && us_rx_byte >= 0 && !us_rxne && us_rx_at < t) t = us_rx_at > cycles ? us_rx_at : cycles;
+    for (ch = 0; ch < 7; ch++)
+        if (dma_ch[ch].active && (dma_ch[ch].cfgr & 0xE) && dma_ch[ch].done_at < t) t = dma_ch[ch].done_at;
+    return t;
+}
+
+static void standby(void)
+{
+    static const uint32_t awu_div[16] = { 1, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 10240, 61440 };
+    uint32_t csr_awu = periph[(PWR_BASE + 0x08 - PERIPH_BASE) / 4];
+    uint32_t win = periph[(PWR_BASE + 0x0C - PERIPH_BASE) / 4] & 0x3F;
+    uint32_t psc = periph[(PWR_BASE + 0x10 - PERIPH_BASE) / 4] & 0xF;
+    double ns;
+
+    if (!(csr_awu & 2))
+    {
+        fprintf(stderr, "standby without the AWU enabled at pc 0x%08X\n", (unsigned)pc);
+        halted = 1;
+        exit_code = 2;
+        return;
+    }
+
+    ns = 1e9 * win * awu_div[psc] / 128000.0;
+    time_ns += ns;
+    standby_ns += ns;
+    standby_count++;
+
+    /* Flash operations finish meanwhile, the system wakes on HSI */
+    if (spif_busy_until > cycles) spif_busy_until = cycles;
+    if (fc_busy_until > cycles) fc_busy_until = cycles;
+    rcc_cfgr0 &= ~3u;
+    rcc_ctlr &= ~0x01010000u;
+    clock_changed();
+}
+
+static void wfi(void)
+{
+    uint64_t t;
+    int wfe = (pfic_sctlr & 0x08) != 0;
+
+    if ((pfic_sctlr & 0x04) && (periph[(PWR_BASE - PERIPH_BASE) / 4] & 0x02))
+    {
+        standby();
+        return;
+    }
+    if (wfe && event_flag)
+    {
+        event_flag = 0;
+        return;
+    }
+
+    while (!halted)
+    {
+        usart_update();
+        dma_update();
+        if (wfe ? any_level() : irq_select() >= 0) return;
+
+        t = next_event();
+        if (t == UINT64_MAX || t > max_cycles)
+        {
+            if (t == UINT64_MAX)
+            {
+                fprintf(stderr, "sleeping with no wake-up source at pc 0x%08X\n", (unsigned)pc);
+                exit_code = 2;
+            }
+            halted = 1;
+            return;
+        }
+        if (t <= cycles) t = cycles + 1;
+        sleep_cycles += t - cycles;
+        tick(t - cycles);
+    }
+}
+
+/************************************************************************/
+/*                               DECODER                                */
+/************************************************************************/
+
+static int32_t sext(uint32_t v, int bits)
+{
+    return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+static void decode32(uint32_t w, insn_t *d)
+{
+    uint32_t f3 = (w >> 12) & 7, f7 = w >> 25;
+
+    d->len = 4;
+    d->rd = (w >> 7) & 31;
+    d->rs1 = (w >> 15) & 31;
+    d->rs2 = (w >> 20) & 31;
+    d->op = OP_ILLEGAL;
+
+    switch (w & 0x7F)
+    {
+    case 0x37: d->op = OP_LUI; d->imm = (int32_t)(w & 0xFFFFF000u); break;
+    case 0x17: d->op = OP_AUIPC; d->imm = (int32_t)(w & 0xFFFFF000u); break;
+    case 0x6F:
+        d->op = OP_JAL;
+        d->imm = sext(((w >> 31) << 20) | (((w >> 12) & 0xFF) << 12) | (((w >> 20) & 1) << 11) | (((w >> 21) & 0x3FF) << 1), 21);
+        break;
+    case 0x67:
+        if (f3 == 0) d->op = OP_JALR;
+        d->imm = sext(w >> 20, 12);
+        break;
+    case 0x63:
+        if (f3 != 2 && f3 != 3) d->op = (uint8_t)(OP_BEQ + (f3 < 2 ? f3 : f3 - 2));
+        d->imm = sext(((w >> 31) << 12) | (((w >> 7) & 1) << 11) | (((w >> 25) & 0x3F) << 5) | (((w >> 8) & 0xF) << 1), 13);
+        break;
+    case 0x03:
+        if (f3 != 3 && f3 < 6) d->op = (uint8_t)(OP_LB + (f3 < 3 ? f3 : f3 - 1));
+        d->imm = sext(w >> 20, 12);
+        break;
+    case 0x23:
+        if (f3 < 3) d->op = (uint8_t)(OP_SB + f3);
+        d->imm = sext(((w >> 25) << 5) | ((w >> 7) & 31), 12);
+        break;
+    case 0x13:
+        d->imm = sext(w >> 20, 12);
+        switch (f3)
+        {
+        case 0: d->op = OP_ADDI; break;
+        case 2: d->op = OP_SLTI; break;
+        case 3: d->op = OP_SLTIU; break;
+        case 4: d->op = OP_XORI; break;
+        case 6: d->op = OP_ORI; break;
+        case 7: d->op = OP_ANDI; break;
+        case 1: if (f7 == 0) d->op = OP_SLLI; d->imm &= 31; break;
+        case 5: if (f7 == 0) d->op = OP_SRLI; else if (f7 == 0x20) d->op = OP_SRAI; d->imm &= 31; break;
+        }
+        break;
+    case 0x33:
+        if (f7 == 0)
+        {
+            static const uint8_t ops[8] = { OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND };
+            d->op = ops[f3];
+        }
+        else if (f7 == 0x20 && f3 == 0) d->op = OP_SUB;
+        else if (f7 == 0x20 && f3 == 5) d->op = OP_SRA;
+        break;
+    case 0x0F:
+        d->op = OP_FENCE;
+        break;
+    case 0x73:
+        d->imm = (int32_t)(w >> 20);
+        if (f3 == 0)
+        {
+            if (w == 0x00000073) d->op = OP_ECALL;
+            else if (w == 0x00100073) d->op = OP_EBREAK;
+            else if (w == 0x30200073) d->op = OP_MRET;
+            else if (w == 0x10500073) d->op = OP_WFI;
+        }
+        else if (f3 != 4) d->op = (uint8_t)(OP_CSRRW + (f3 < 4 ? f3 - 1 : f3 - 2));
+        break;
+    }
+
+    /* RV32E: only x0-x15 */
+    if ((d->rd | d->rs1 | d->rs2) & 16)
+    {
+        if (d->op >= OP_LUI && d->op <= OP_JAL && !(d->rd & 16)) return;
+        if (d->op == OP_FENCE || d->op == OP_ECALL || d->op == OP_EBREAK || d->op == OP_MRET || d->op == OP_WFI) return;
+        if ((d->op >= OP_ADDI && d->op <= OP_SRAI) || (d->op >= OP_LB && d->op <= OP_LHU) || d->op == OP_JALR || d->op >= OP_CSRRW)
+        {
+            if (!((d->rd | d->rs1) & 16) || (d->op >= OP_CSRRWI && !(d->rd & 16))) return;
+        }
+        else if (d->op >= OP_BEQ && d->op <= OP_BGEU)
+        {
+            if (!((d->rs1 | d->rs2) & 16)) return;
+        }
+        else if (d->op >= OP_SB && d->op <= OP_SW)
+        {
+            if (!((d->rs1 | d->rs2) & 16)) return;
+        }
+        d->op = OP_ILLEGAL;
+    }
+}
+
+static void decode16(uint32_t c, insn_t *d)
+{
+    uint32_t f3 = (c >> 13) & 7, rdp = ((c >> 2) & 7) + 8, rs1p = ((c >> 7) & 7) + 8;
+    uint32_t rd = (c >> 7) & 31, rs2 = (c >> 2) & 31;
+    int32_t imm6 = sext(((c >> 12) & 1) << 5 | ((c >> 2) & 31), 6);
+    int32_t jimm = sext(((c >> 12) & 1) << 11 | ((c >> 11) & 1) << 4 | ((c >> 9) & 3) << 8 | ((c >> 8) & 1) << 10 |
+                        ((c >> 7) & 1) << 6 | ((c >> 6) & 1) << 7 | ((c >> 3) & 7) << 1 | ((c >> 2) & 1) << 5, 12);
+    int32_t bimm = sext(((c >> 12) & 1) << 8 | ((c >> 10) & 3) << 3 | ((c >> 5) & 3) << 6 | ((c >> 3) & 3) << 1 |
+                        ((c >> 2) & 1) << 5, 9);
+
+    d->len = 2;
+    d->op = OP_ILLEGAL;
+    d->rd = d->rs1 = d->rs2 = 0;
+    d->imm = 0;
+
+    switch (c & 3)
+    {
+    case 0:
+        switch (f3)
+        {
+        case 0:
+            d->imm = (int32_t)(((c >> 11) & 3) << 4 | ((c >> 7) & 15) << 6 | ((c >> 6) & 1) << 2 | ((c >> 5) & 1) << 3);
+            if (d->imm) { d->op = OP_ADDI; d->rd = rdp; d->rs1 = 2; }
+            break;
+        case 2:
+        case 6:
+            d->op = (f3 == 2) ? OP_LW : OP_SW;
+            d->imm = (int32_t)(((c >> 10) & 7) << 3 | ((c >> 6) & 1) << 2 | ((c >> 5) & 1) << 6);
+            d->rs1 = rs1p;
+            d->rd = rdp;
+            d->rs2 = rdp;
+            break;
+        default:
+            d->op = OP_XW;
+        }
+        break;
+    case 1:
+        switch (f3)
+        {
+        case 0: d->op = OP_ADDI; d->rd = d->rs1 = rd; d->imm = imm6; break;
+        case 1: d->op = OP_JAL; d->rd = 1; d->imm = jimm; break;
+        case 2: d->op = OP_ADDI; d->rd = rd; d->rs1 = 0; d->imm = imm6; break;
+        case 3:
+            if (rd == 2)
+            {
+                d->op = OP_ADDI;
+                d->rd = d->rs1 = 2;
+                d->imm = sext(((c >> 12) & 1) << 9 | ((c >> 6) & 1) << 4 | ((c >> 5) & 1) << 6 | ((c >> 3) & 3) << 7 |
+                              ((c >> 2) & 1) << 5, 10);
+                if (!d->imm) d->op = OP_ILLEGAL;
+            }
+            else if (imm6)
+            {
+                d->op = OP_LUI;
+                d->rd = rd;
+                d->imm = imm6 << 12;
+            }
+            break;
+        case 4:
+            d->rd = d->rs1 = rs1p;
+            d->rs2 = rdp;
+            switch ((c >> 10) & 3)
+            {
+            case 0: if (!(c & 0x1000)) { d->op = OP_SRLI; d->imm = (c >> 2) & 31; } break;
+            case 1: if (!(c & 0x1000)) { d->op = OP_SRAI; d->imm = (c >> 2) & 31; } break;
+            case 2: d->op = OP_ANDI; d->imm = imm6; break;
+            case 3:
+                if (!(c & 0x1000))
+                {
+                    static const uint8_t ops[4] = { OP_SUB, OP_XOR, OP_OR, OP_AND };
+                    d->op = ops[(c >> 5) & 3];
+                }
+                break;
+            }
+            break;
+        case 5: d->op = OP_JAL; d->rd = 0; d->imm = jimm; break;
+        case 6: d->op = OP_BEQ; d->rs1 = rs1p; d->rs2 = 0; d->imm = bimm; break;
+        case 7: d->op = OP_BNE; d->rs1 = rs1p; d->rs2 = 0; d->imm = bimm; break;
+        }
+        break;
+    case 2:
+        switch (f3)
+        {
+        case 0:
+            if (!(c & 0x1000)) { d->op = OP_SLLI; d->rd = d->rs1 = rd; d->imm = (c >> 2) & 31; }
+            break;
+        case 2:
+            if (rd) { d->op = OP_LW; d->rd = rd; d->rs1 = 2; d->imm = (int32_t)(((c >> 12) & 1) << 5 | ((c >> 4) & 7) << 2 | ((c >> 2) & 3) << 6); }
+            break;
+        case 4:
+            if (!(c & 0x1000))
+            {
+                if (!rs2 && rd) { d->op = OP_JALR; d->rd = 0; d->rs1 = rd; }
+                else if (rs2) { d->op = OP_ADD; d->rd = rd; d->rs1 = 0; d->rs2 = rs2; }
+            }
+            else
+            {
+                if (!rs2 && !rd) d->op = OP_EBREAK;
+                else if (!rs2) { d->op = OP_JALR; d->rd = 1; d->rs1 = rd; }
+                else { d->op = OP_ADD; d->rd = d->rs1 = rd; d->rs2 = rs2; }
+            }
+            break;
+        case 6:
+            d->op = OP_SW;
+            d->rs1 = 2;
+            d->rs2 = rs2;
+            d->imm = (int32_t)(((c >> 9) & 15) << 2 | ((c >> 7) & 3) << 6);
+            break;
+        default:
+            d->op = OP_XW;
+        }
+        break;
+    }
+
+    if ((d->rd | d->rs1 | d->rs2) & 16) d->op = OP_ILLEGAL;
+}
+
+/************************************************************************/
+/*                               EXECUTE                                */
+/************************************************************************/
+
+static void dump_regs(void)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) fprintf(stderr, "x%-2d %08X%s", i, (unsigned)x[i], (i % 4 == 3) ? "\n" : "  ");
+    fprintf(stderr, "mepc %08X  mcause %08X  mstatus %08X\n", (unsigned)csr[CSR_MEPC], (unsigned)csr[CSR_MCAUSE],
+            (unsigned)csr[CSR_MSTATUS]);
+}
+
+static void fault(const char *what, uint32_t a)
+{
+    fprintf(stderr, "%s at pc 0x%08X (0x%08X)\n", what, (unsigned)pc, (unsigned)a);
+    dump_regs();
+    halted = 1;
+    exit_code = 2;
+}
+
+static int in_flash(uint32_t a)
+{
+    return a < FLASH_SIZE || (a >= FLASH_BASE && a < FLASH_BASE + FLASH_SIZE) || (a >= BOOT_BASE && a < BOOT_BASE + BOOT_SIZE);
+}
+
+static uint32_t csr_access(uint32_t n, uint32_t v, int op)
+{
+    uint32_t old = csr[n & 0xFFF];
+
+    switch (op)
+    {
+    case 0: csr[n & 0xFFF] = v; break;
+    case 1: if (v) csr[n & 0xFFF] = old | v; break;
+    case 2: if (v) csr[n & 0xFFF] = old & ~v; break;
+    }
+    return old;
+}
+
+static void step(void)
+{
+    insn_t d = { 0 };
+    uint32_t w, npc, a, v = 0, pc0 = pc;
+    uint64_t cost = 1;
+    int f = 0, n, ret = 0;
+
+    usart_update();
+    dma_update();
+    if (csr[CSR_MSTATUS] & MSTATUS_MIE)
+    {
+        n = irq_select();
+        if (n >= 0)
+        {
+            irq_enter(n);
+            return;
+        }
+    }
+
+    /* Fetching from flash stalls while it programs or erases */
+    if (fc_busy_until > cycles && in_flash(pc))
+    {
+        prof_self(pc, (uint32_t)(fc_busy_until - cycles));
+        tick(fc_busy_until - cycles);
+    }
+
+    w = bus_read(pc, 2, &f);
+    if (f)
+    {
+        fault("instruction fetch fault", pc);
+        return;
+    }
+    if ((w & 3) == 3)
+    {
+        w |= bus_read(pc + 2, 2, &f) << 16;
+        decode32(w, &d);
+    }
+    else decode16(w, &d);
+    npc = pc + d.len;
+
+    switch (d.op)
+    {
+    case OP_LUI: v = (uint32_t)d.imm; break;
+    case OP_AUIPC: v = pc + (uint32_t)d.imm; break;
+    case OP_JAL:
+    case OP_JALR:
+        v = npc;
+        npc = (d.op == OP_JAL) ? pc + (uint32_t)d.imm : (x[d.rs1] + (uint32_t)d.imm) & ~1u;
+        cost += CYC_JUMP + ((fc_actlr & 3) && in_flash(npc));
+        if (d.rd == 1 || d.rd == 5) prof_call(npc, 0);
+        else if (d.op == OP_JALR && d.rd == 0 && (d.rs1 == 1 || d.rs1 == 5)) ret = 1;
+        break;
+    case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+    {
+        uint32_t r1 = x[d.rs1], r2 = x[d.rs2];
+        int t = (d.op == OP_BEQ) ? r1 == r2 : (d.op == OP_BNE) ? r1 != r2 :
+                (d.op == OP_BLT) ? (int32_t)r1 < (int32_t)r2 : (d.op == OP_BGE) ? (int32_t)r1 >= (int32_t)r2 :
+                (d.op == OP_BLTU) ? r1 < r2 : r1 >= r2;
+        if (t)
+        {
+            npc = pc + (uint32_t)d.imm;
+            cost += CYC_JUMP + ((fc_actlr & 3) && in_flash(npc));
+        }
+        d.rd = 0;
+        break;
+    }
+    case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+        a = x[d.rs1] + (uint32_t)d.imm;
+        n = (d.op == OP_LB || d.op == OP_LBU) ? 1 : (d.op == OP_LW) ? 4 : 2;
+        v = bus_read(a, n, &f);
+        if (f) { fault(f == 4 ? "misaligned load" : "load access fault", a); return; }
+        if (d.op == OP_LB) v = (uint32_t)sext(v, 8);
+        if (d.op == OP_LH) v = (uint32_t)sext(v, 16);
+        cost += CYC_LOAD;
+        break;
+    case OP_SB: case OP_SH: case OP_SW:
+        a = x[d.rs1] + (uint32_t)d.imm;
+        bus_write(a, x[d.rs2], (d.op == OP_SB) ? 1 : (d.op == OP_SH) ? 2 : 4, &f);
+        if (f) { fault(f == 6 ? "misaligned store" : "store access fault", a); return; }
+        d.rd = 0;
+        break;
+    case OP_ADDI: v = x[d.rs1] + (uint32_t)d.imm; break;
+    case OP_SLTI: v = (int32_t)x[d.rs1] < d.imm; break;
+    case OP_SLTIU: v = x[d.rs1] < (uint32_t)d.imm; break;
+    case OP_XORI: v = x[d.rs1] ^ (uint32_t)d.imm; break;
+    case OP_ORI: v = x[d.rs1] | (uint32_t)d.imm; break;
+    case OP_ANDI: v = x[d.rs1] & (uint32_t)d.imm; break;
+    case OP_SLLI: v = x[d.rs1] << d.imm; break;
+    case OP_SRLI: v = x[d.rs1] >> d.imm; break;
+    case OP_SRAI: v = (uint32_t)((int32_t)x[d.rs1] >> d.imm); break;
+    case OP_ADD: v = x[d.rs1] + x[d.rs2]; break;
+    case OP_SUB: v = x[d.rs1] - x[d.rs2]; break;
+    case OP_SLL: v = x[d.rs1] << (x[d.rs2] & 31); break;
+    case OP_SLT: v = (int32_t)x[d.rs1] < (int32_t)x[d.rs2]; break;
+    case OP_SLTU: v = x[d.rs1] < x[d.rs2]; break;
+    case OP_XOR: v = x[d.rs1] ^ x[d.rs2]; break;
+    case OP_SRL: v = x[d.rs1] >> (x[d.rs2] & 31); break;
+    case OP_SRA: v = (uint32_t)((int32_t)x[d.rs1] >> (x[d.rs2] & 31)); break;
+    case OP_OR: v = x[d.rs1] | x[d.rs2]; break;
+    case OP_AND: v = x[d.rs1] & x[d.rs2]; break;
+    case OP_FENCE: d.rd = 0; break;
+    case OP_CSRRW: case OP_CSRRS: case OP_CSRRC:
+        v = csr_access((uint32_t)d.imm, x[d.rs1], d.op - OP_CSRRW);
+        break;
+    case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI:
+        v = csr_access((uint32_t)d.imm, d.rs1, d.op - OP_CSRRWI);
+        break;
+    case OP_MRET:
+        prof_self(pc0, (uint32_t)cost);
+        instret++;
+        irq_return();
+        return;
+    case OP_WFI:
+        prof_self(pc0, (uint32_t)cost);
+        tick(cost);
+        instret++;
+        pc = npc;
+        wfi();
+        return;
+    case OP_ECALL:
+        fault("ecall", pc);
+        return;
+    case OP_EBREAK:
+        fprintf(stderr, "ebreak at pc 0x%08X\n", (unsigned)pc);
+        dump_regs();
+        halted = 1;
+        return;
+    case OP_XW:
+        fault("unsupported compressed instruction (WCH XW extension?), rebuild without RVXW", w & 0xFFFF);
+        return;
+    default:
+        fault("illegal instruction", w);
+        return;
+    }
+
+    if (d.rd) x[d.rd] = v;
+    pc = npc;
+    instret++;
+    prof_self(pc0, (uint32_t)cost);
+    tick(cost);
+    if (ret) prof_ret(0);
+}
+
+/************************************************************************/
+/*                                RESET                                 */
+/************************************************************************/
+
+static void sim_reset(int power_on)
+{
+    boot_mode = (fc_statr >> 14) & 1;
+
+    memset(x, 0, sizeof(x));
+    memset(csr, 0, sizeof(csr));
+    pc = 0;
+    hpe_depth = 0;
+    shadow_depth = 0;
+    reset_request = 0;
+
+    memset(periph, 0, sizeof(periph));
+    memset(pfic_ien, 0, sizeof(pfic_ien));
+    memset(pfic_swpend, 0, sizeof(pfic_swpend));
+    memset(pfic_active, 0, sizeof(pfic_active));
+    memset(pfic_prio, 0, sizeof(pfic_prio));
+    pfic_sctlr = 0;
+    pfic_ithres = 0;
+    event_flag = 0;
+
+    stk_ctlr = stk_sr = stk_cnt = stk_cmp = stk_div8 = 0;
+
+    rcc_ctlr = 0x81;
+    rcc_cfgr0 = 0;
+    rcc_rstsckr = (rcc_rstsckr & 0xFC000000u) | (power_on ? 0x0C000000u : 0x10000000u);
+    clock_changed();
+
+    fc_ctlr = 0x8080;
+    fc_statr &= 0x4000;
+    fc_actlr = 0;
+    fc_key = fc_modekey = fc_bootkey = fc_boot_unlocked = 0;
+
+    gpio_cfg[0] = gpio_cfg[1] = gpio_cfg[2] = 0x44444444;
+    gpio_out[0] = gpio_out[1] = gpio_out[2] = 0;
+    if (spif_cs) spif_deselect();
+    spif_cs = 0;
+
+    us_ctlr1 = us_brr = 0;
+    us_hold = 0;
+    us_shift_end = cycles;
+    us_rxne = 0;
+
+    dma_intfr = 0;
+    memset(dma_ch, 0, sizeof(dma_ch));
+
+    spi_ctlr1 = 0;
+    spi_rxne = 0;
+}
+
+/************************************************************************/
+/*                                 MAIN                                 */
+/************************************************************************/
+
+static uint32_t symbol_addr(const char *name, int *which)
+{
+    int i, k;
+
+    for (k = 0; k < 2; k++)
+        for (i = 0; i < img[k].n; i++)
+            if (!strcmp(img[k].f[i].name, name))
+            {
+                *which = k;
+                return img[k].f[i].addr;
+            }
+    fprintf(stderr, "symbol '%s' not found\n", name);
+    exit(1);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i iap.elf] [-B] [-f spiflash.bin [-w]] [-s bytes] [-u rxfile]\n"
+                    "       [-c cycles] [-x symbol] [-r resets] [-n count] [-g] [-q] app.elf\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *app = NULL, *iap = NULL, *rx = NULL;
+    uint32_t stop_addr = 0;
+    int stop_img = -1, start_boot = 0, i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            app = argv[i];
+            continue;
+        }
+        switch (argv[i][1])
+        {
+        case 'B': start_boot = 1; continue;
+        case 'w': spif_writeback = 1; continue;
+        case 'g': log_gpio = 1; continue;
+        case 'q': quiet = 1; continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        switch (argv[i][1])
+        {
+        case 'i': iap = argv[++i]; break;
+        case 'f': spif_path = argv[++i]; break;
+        case 's': spif_size = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'u': rx = argv[++i]; break;
+        case 'c': max_cycles = strtoull(argv[++i], NULL, 0); break;
+        case 'x': stop_symbol = argv[++i]; break;
+        case 'r': stop_resets = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'n': report_lines = atoi(argv[++i]); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!app || !spif_size) usage(argv[0]);
+
+    /* Erased internal flash, ESIG (16K, chip ID) and option bytes */
+    fc_fill(user_flash, FLASH_SIZE);
+    fc_fill(boot_flash, BOOT_SIZE);
+    memset(&boot_flash[0x7C4], 0, 0x40);
+    memcpy(&boot_flash[0x7C4], &(uint32_t){ 0x00300500 }, 4);
+    memset(&boot_flash[0x7D4], 0xFF, 4);                         /* no PLL trim */
+    boot_flash[0x7E0] = 16;
+    memcpy(&boot_flash[0x800], "\xA5\x5A\xFF\x00\xFF\x00\xFF\x00", 8);
+
+    load_image(app, IMG_APP);
+    if (iap) load_image(iap, IMG_IAP);
+    load_spif();
+    if (rx)
+    {
+        us_rx_file = fopen(rx, "rb");
+        if (!us_rx_file)
+        {
+            perror(rx);
+            return 1;
+        }
+        us_rx_byte = fgetc(us_rx_file);
+    }
+    if (stop_symbol) stop_addr = symbol_addr(stop_symbol, &stop_img);
+
+    fc_statr = start_boot ? 0x4000 : 0;
+    sim_reset(1);
+
+    while (!halted && cycles < max_cycles)
+    {
+        step();
+
+        if (reset_request)
+        {
+            resets++;
+            if (stop_resets && resets >= stop_resets) break;
+            sim_reset(0);
+        }
+        if (stop_symbol && pc == stop_addr && (stop_img == (boot_mode ? IMG_IAP : IMG_APP)))
+        {
+            fprintf(stderr, "reached %s\n", stop_symbol);
+            break;
+        }
+    }
+
+    fflush(stdout);
+    report();
+    save_spif();
+    return exit_code;
+}
@@ -0,0 +1,164 @@
+/*
+ * tracedecode.c
+ *
+ *  Host side decoder for the frames sent by TRACE_Dump() (APP built with
+ *  TRACE = TRACE_ENABLE). Reads the captured debug output, passes plain
+ *  text through and prints every trace frame as a timeline: time since the
+ *  first record, time since the previous one, event name and arguments.
+ *
+ *  Build:  cc -O2 -o tracedecode tracedecode.c
+ *  Usage:  tracedecode [capture]      (stdin when no file given)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TRACE_SYNC1     0xD7
+#define TRACE_SYNC2     0x7D
+#define TRACE_RECORD    16
+
+/* Keep in step with trace_id_t in CH32V003_APP/User/trace.h */
+static const struct {
+    uint32_t id;
+    const char *name;
+    const char *a0;
+    const char *a1;
+} trace_names[] = {
+    { 1, "SPIF_READ",     "addr",  "size"   },
+    { 2, "SPIF_WRITE",    "addr",  "size"   },
+    { 3, "SPIF_ERASE",    "addr",  "kind"   },
+    { 4, "SPIF_PROGRAM",  "addr",  "size"   },
+    { 5, "SPIF_BUSY",     "polls", "cycles" },
+    { 6, "IAP_RX",        "cmd",   "len"    },
+    { 7, "IAP_RX_BAD",    "cmd",   "sum"    },
+    { 8, "IAP_CMD",       "cmd",   "status" },
+    { 9, "IAP_PROGRAM",   "addr",  NULL     },
+};
+
+static unsigned frames_ok = 0;
+static unsigned frames_bad = 0;
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Reads exactly n bytes, 0 at end of input */
+static int read_exact(FILE *in, uint8_t *buf, size_t n)
+{
+    return fread(buf, 1, n, in) == n;
+}
+
+static void print_record(const uint8_t *r, double t_us, double d_us, double cyc_us)
+{
+    uint32_t id = rd32(r + 4), a0 = rd32(r + 8), a1 = rd32(r + 12);
+    size_t i;
+
+    printf("%12.3f %+10.3f  ", t_us, d_us);
+    for (i = 0; i < sizeof(trace_names) / sizeof(trace_names[0]); i++)
+    {
+        if (trace_names[i].id != id) continue;
+
+        if (!strcmp(trace_names[i].a0, "addr")) printf("%-13s addr=0x%08X", trace_names[i].name, (unsigned)a0);
+        else printf("%-13s %s=%u", trace_names[i].name, trace_names[i].a0, (unsigned)a0);
+        if (!trace_names[i].a1) printf("\n");
+        else if (id == 5) printf(" %s=%u (%.3f us)\n", trace_names[i].a1, (unsigned)a1, a1 * cyc_us);
+        else printf(" %s=%u\n", trace_names[i].a1, (unsigned)a1);
+        return;
+    }
+    printf("%s%-9u a0=0x%08X a1=0x%08X\n", id >= 0x80 ? "USER+" : "EVENT", (unsigned)(id >= 0x80 ? id - 0x80 : id),
+           (unsigned)a0, (unsigned)a1);
+}
+
+/* Decodes the frame following a sync, returns 0 at end of input */
+static int decode_frame(FILE *in)
+{
+    uint8_t hdr[10], sum_le[2];
+    uint8_t *rec;
+    uint32_t count, clk, total, i, prev = 0;
+    uint16_t sum = 0;
+    double cyc_us, t;
+
+    if (!read_exact(in, hdr, sizeof(hdr))) return 0;
+    count = hdr[0] | (hdr[1] << 8);
+    clk = rd32(hdr + 2);
+    total = rd32(hdr + 6);
+
+    rec = malloc(count ? count * TRACE_RECORD : 1);
+    if (!rec) return 0;
+    if (!read_exact(in, rec, count * TRACE_RECORD) || !read_exact(in, sum_le, 2))
+    {
+        free(rec);
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(hdr); i++) sum += hdr[i];
+    for (i = 0; i < count * TRACE_RECORD; i++) sum += rec[i];
+    if (sum != (uint16_t)(sum_le[0] | (sum_le[1] << 8)))
+    {
+        frames_bad++;
+        fprintf(stderr, "checksum error in trace frame\n");
+        free(rec);
+        return 1;
+    }
+
+    cyc_us = clk ? 1e6 / clk : 0;
+    printf("\nTRACE: %u of %u event(s), %u Hz\n", (unsigned)count, (unsigned)total, (unsigned)clk);
+    printf("%12s %10s  event\n", "time(us)", "delta(us)");
+
+    /* SysTick is 32 bit and free running, deltas survive a wrap */
+    t = 0;
+    for (i = 0; i < count; i++)
+    {
+        uint32_t ts = rd32(rec + i * TRACE_RECORD);
+
+        if (i == 0) prev = ts;
+        t += (uint32_t)(ts - prev) * cyc_us;
+        print_record(rec + i * TRACE_RECORD, t, (uint32_t)(ts - prev) * cyc_us, cyc_us);
+        prev = ts;
+    }
+
+    frames_ok++;
+    free(rec);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    int c, prev = -1;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+    {
+        fprintf(stderr, "usage: %s [capture]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2)
+    {
+        in = fopen(argv[1], "rb");
+        if (!in)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    /* Text is echoed unchanged, frames are recognised by their sync pair */
+    while ((c = fgetc(in)) != EOF)
+    {
+        if (prev == TRACE_SYNC1 && c == TRACE_SYNC2)
+        {
+            prev = -1;
+            if (!decode_frame(in)) break;
+            continue;
+        }
+        if (prev >= 0) putchar(prev);
+        prev = c;
+    }
+    if (prev >= 0 && prev != TRACE_SYNC1) putchar(prev);
+
+    fprintf(stderr, "%u frame(s) decoded, %u with checksum errors\n", frames_ok, frames_bad);
+    return frames_bad ? 1 : 0;
+}